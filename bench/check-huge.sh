@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# 64-bit layout checks on huge.img from mkimages.sh (sparse, 20 TiB: the
+# image directory must allow files over 16 TiB, tmpfs, xfs or btrfs do).
+# /far, whose extents and extent index block lie above 2^32, has to read
+# back with both backends, and the group descriptors e2img decodes have
+# to match dumpe2fs for the first group, a flex-packed one, the first of
+# a meta_bg, the one holding /far and the last one.
+#
+# usage: check-huge.sh [<image-dir>]
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+dir=${1:-${BENCH_DIR:-/tmp/e2img-bench}}
+img=$dir/huge.img
+ext2info=$here/../ext2info/a.out
+far=4400000000
+fail=0
+
+if [ ! -f "$img" ]; then
+	echo "generating images in $dir" >&2
+	"$here/mkimages.sh" "$dir" >&2
+fi
+if [ ! -f "$img" ]; then
+	echo "no $img, $dir cannot hold a 20 TiB sparse file" >&2
+	exit 1
+fi
+
+bad() {
+	echo "FAIL: $*" >&2
+	fail=1
+}
+
+# level 0 entry of a depth 1 tree points at the index block
+idx=$(debugfs -R "ex far" "$img" 2>/dev/null | awk '$1 == "0/" { print $8 }')
+[ -n "$idx" ] && [ "$idx" -ge $((1 << 32)) ] ||
+	bad "/far index block '$idx' is not above 2^32, the image does not test it"
+
+expect() {
+	for k in $(seq 0 7); do
+		yes "e2img bench far $k" | head -c 4096
+	done
+}
+for backend in "" -m; do
+	"$ext2info" -f "$img" -p /far $backend | cmp -s - <(expect) ||
+		bad "/far reads back wrong${backend:+ with $backend}"
+done
+
+dump=$(mktemp)
+gdump=$(mktemp)
+trap 'rm -f "$dump" "$gdump"' EXIT
+dumpe2fs "$img" 2> /dev/null > "$dump"
+dumpe2fs -g "$img" 2> /dev/null > "$gdump"
+last=$(tail -n 1 "$gdump" | cut -d: -f1)
+per_group=$(awk -F': *' '$1 == "Blocks per group" { print $2 }' "$dump")
+
+for g in 0 17 64 $((far / per_group)) $last; do
+	locs=$(awk -F: -v g=$g '$1 == g { print $5 ":" $6 ":" $7 }' "$gdump")
+	counts=$(awk -v g=$g '$1 == "Group" && $2 == g ":" { f = 1 }
+		f && / free blocks, / { print $1 ":" $4 ":" $7 ":" $9; exit }' "$dump")
+	got=$("$ext2info" -f "$img" -g $g | cut -d: -f2-8)
+	[ "$got" = "$locs:$counts" ] ||
+		bad "group $g: e2img $got, dumpe2fs $locs:$counts"
+done
+
+[ $fail -eq 0 ] && echo "huge.img: ok" >&2
+exit $fail
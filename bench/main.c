@@ -0,0 +1,448 @@
+#include <ext2fs/ext2fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "e2img.h"
+
+/*
+ * e2img micro benchmarks on one image. The tree is listed once, then every
+ * benchmark runs cold (fresh e2img caches, image dropped from the page
+ * cache as far as the kernel lets an unprivileged user) and warm (the same
+ * run again). Results go to stdout, one JSON object per line.
+ */
+
+#define BENCH_IO_SIZE (1 << 20)
+#define BENCH_AIO_DEPTH 32
+
+struct bench_tree {
+	char		**paths;	/* absolute, every entry below the root */
+	ext2_ino_t	*inos;		/* inode of each path */
+	ext2_ino_t	*dirs;
+	ext2_ino_t	*files;		/* regular files */
+	size_t		npaths, ndirs, nfiles;
+	size_t		cap_paths, cap_dirs, cap_files;
+};
+
+struct bench_result {
+	uint64_t	ops;
+	uint64_t	bytes;
+};
+
+struct bench {
+	char const	*name;
+	int		(*run)(struct e2img *fs, struct bench_tree *t, struct bench_result *res);
+};
+
+static
+void push_ino(ext2_ino_t **arr, size_t *n, size_t *cap, ext2_ino_t ino)
+{
+	if (*n == *cap) {
+		*cap = *cap ? *cap * 2 : 256;
+		*arr = realloc(*arr, sizeof(**arr) * *cap);
+		release_assert(*arr);
+	}
+	(*arr)[(*n)++] = ino;
+}
+
+/* Walked with one thread, entries come in a fixed order */
+static
+int collect_ent(struct e2img *fs, struct e2img_walk_ent const *ent, void *priv)
+{
+	struct bench_tree *t = priv;
+	uint16_t mode = ent->ip->i.i_mode;
+
+	if (LINUX_S_ISDIR(mode))
+		push_ino(&t->dirs, &t->ndirs, &t->cap_dirs, ent->ip->ino);
+	else if (LINUX_S_ISREG(mode))
+		push_ino(&t->files, &t->nfiles, &t->cap_files, ent->ip->ino);
+	if (!ent->path_len)
+		return 0;
+
+	size_t cap = t->cap_paths;
+	push_ino(&t->inos, &t->npaths, &t->cap_paths, ent->ip->ino);
+	if (cap != t->cap_paths) {
+		t->paths = realloc(t->paths, sizeof(*t->paths) * t->cap_paths);
+		release_assert(t->paths);
+	}
+	char *path = xmalloc(ent->path_len + 2);
+	path[0] = '/';
+	memcpy(path + 1, ent->path, ent->path_len);
+	path[ent->path_len + 1] = '\0';
+	t->paths[t->npaths - 1] = path;
+	return 0;
+}
+
+static
+void free_tree(struct bench_tree *t)
+{
+	for (size_t i = 0; i < t->npaths; ++i)
+		free(t->paths[i]);
+	free(t->paths);
+	free(t->inos);
+	free(t->dirs);
+	free(t->files);
+}
+
+static
+int bench_lookup(struct e2img *fs, struct bench_tree *t, struct bench_result *res)
+{
+	int rc;
+	ext2_ino_t ino;
+
+	for (size_t i = 0; i < t->npaths; ++i) {
+		if ((rc = e2img_path_lookup(fs, t->paths[i], &ino)) < 0)
+			return rc;
+		if (ino != t->inos[i])
+			return -EIO;
+	}
+	res->ops = t->npaths;
+	return 0;
+}
+
+static
+int bench_read_inode(struct e2img *fs, struct bench_tree *t, struct bench_result *res)
+{
+	int rc;
+	struct ext2_inode inode;
+
+	for (size_t i = 0; i < t->npaths; ++i) {
+		if ((rc = e2img_read_inode(fs, t->inos[i], &inode)) < 0)
+			return rc;
+	}
+	res->ops = t->npaths;
+	res->bytes = t->npaths * EXT2_INODE_SIZE(fs->sb);
+	return 0;
+}
+
+static
+int count_dirent(struct ext2_dir_entry *dirent, void *priv)
+{
+	++*(uint64_t *) priv;
+	return 0;
+}
+
+/* ops are entries, bytes the directory sizes */
+static
+int bench_iterate_dir(struct e2img *fs, struct bench_tree *t, struct bench_result *res)
+{
+	int rc;
+	struct e2img_inode *ip;
+
+	for (size_t i = 0; i < t->ndirs; ++i) {
+		if ((rc = e2img_iget(fs, t->dirs[i], &ip)) < 0)
+			return rc;
+		rc = e2img_iterate_dir(fs, ip, count_dirent, &res->ops);
+		res->bytes += EXT2_I_SIZE(&ip->i);
+		e2img_iput(fs, ip);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
+/* Whole files front to back with readahead, as ext2info -x does */
+static
+int bench_read(struct e2img *fs, struct bench_tree *t, struct bench_result *res)
+{
+	ssize_t rc = 0;
+	struct e2img_inode *ip;
+	void *buf = xmemalign(fs->blk_sz, BENCH_IO_SIZE);
+
+	for (size_t i = 0; i < t->nfiles && !(rc < 0); ++i) {
+		struct e2img_ra ra;
+		if ((rc = e2img_iget(fs, t->files[i], &ip)) < 0)
+			break;
+		e2img_ra_init(&ra);
+		for (ext2_off64_t off = 0;; off += rc) {
+			e2img_readahead(fs, ip, &ra, off, BENCH_IO_SIZE);
+			if ((rc = e2img_file_read(fs, ip, buf, BENCH_IO_SIZE, off)) <= 0)
+				break;
+			res->bytes += rc;
+		}
+		e2img_ra_destroy(&ra);
+		e2img_iput(fs, ip);
+	}
+	free(buf);
+	res->ops = t->nfiles;
+	return rc < 0 ? rc : 0;
+}
+
+static
+int count_inode(struct e2img *fs, ext2_ino_t ino, struct ext2_inode *inode, void *priv)
+{
+	__atomic_fetch_add((uint64_t *) priv, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Whole inode tables, chunk reads go through e2img_aio */
+static
+int bench_scan(struct e2img *fs, struct bench_tree *t, struct bench_result *res)
+{
+	int rc;
+	if ((rc = e2img_scan_inodes(fs, 0, count_inode, &res->ops)) < 0)
+		return rc;
+	res->bytes = res->ops * EXT2_INODE_SIZE(fs->sb);
+	return 0;
+}
+
+struct aio_file {
+	struct e2img_aio	*aio;
+	struct e2img_aio_req	req[BENCH_AIO_DEPTH];
+	struct e2img_aio_req	*idle[BENCH_AIO_DEPTH];
+	unsigned		nidle;
+};
+
+static
+int aio_file_reap(struct aio_file *af, unsigned wait_nr, struct bench_result *res)
+{
+	int n, rc = 0;
+	struct e2img_aio_req *done[BENCH_AIO_DEPTH];
+
+	if ((n = e2img_aio_reap(af->aio, done, BENCH_AIO_DEPTH, wait_nr)) < 0)
+		return n;
+	for (int i = 0; i < n; ++i) {
+		if (done[i]->res < 0)
+			rc = done[i]->res;
+		else
+			res->bytes += (size_t) done[i]->nblocks * af->aio->fs->blk_sz;
+		af->idle[af->nidle++] = done[i];
+	}
+	return rc;
+}
+
+/* Every data run of a file, up to BENCH_AIO_DEPTH reads in flight */
+static
+int aio_file_read(struct e2img *fs, struct aio_file *af, struct e2img_inode *ip,
+		struct bench_result *res)
+{
+	int rc = 0;
+	blk_t max_blk = BENCH_IO_SIZE / fs->blk_sz;
+	blk_t nblocks = div_rup(EXT2_I_SIZE(&ip->i), fs->blk_sz);
+	struct e2img_extent ext;
+
+	for (blk_t lblk = 0; lblk < nblocks && !rc;) {
+		if ((rc = e2img_inode_map(fs, ip, lblk, &ext)) < 0)
+			break;
+		if (!ext.len) {
+			++lblk;
+			continue;
+		}
+		ext.len = min(ext.len, nblocks - lblk);
+		if (!ext.pblk) {
+			lblk += ext.len;
+			continue;
+		}
+		for (blk_t off = 0; off < ext.len && !rc;) {
+			if (!af->nidle && (rc = aio_file_reap(af, 1, res)) < 0)
+				break;
+			struct e2img_aio_req *req = af->idle[af->nidle - 1];
+			req->blkno = ext.pblk + off;
+			req->nblocks = min(ext.len - off, max_blk);
+			if ((rc = e2img_aio_submit(af->aio, &req, 1)) < 0)
+				break;
+			af->nidle--;
+			rc = 0;
+			off += req->nblocks;
+		}
+		lblk += ext.len;
+	}
+	while (e2img_aio_inflight(af->aio)) {
+		int err = aio_file_reap(af, BENCH_AIO_DEPTH, res);
+		if (!rc)
+			rc = err;
+	}
+	return rc;
+}
+
+/* Like read, but raw blocks of the run list through e2img_aio */
+static
+int bench_aio_read(struct e2img *fs, struct bench_tree *t, struct bench_result *res)
+{
+	int rc = 0;
+	struct e2img_inode *ip;
+	struct aio_file af;
+
+	if ((rc = e2img_aio_init(fs, &af.aio, BENCH_AIO_DEPTH)) < 0)
+		return rc;
+	for (int i = 0; i < BENCH_AIO_DEPTH; ++i) {
+		af.req[i].buf = xmemalign(fs->blk_sz, BENCH_IO_SIZE);
+		af.idle[i] = &af.req[i];
+	}
+	af.nidle = BENCH_AIO_DEPTH;
+
+	for (size_t i = 0; i < t->nfiles && !rc; ++i) {
+		if ((rc = e2img_iget(fs, t->files[i], &ip)) < 0)
+			break;
+		if (!ip->idata)
+			rc = aio_file_read(fs, &af, ip, res);
+		e2img_iput(fs, ip);
+	}
+	for (int i = 0; i < BENCH_AIO_DEPTH; ++i)
+		free(af.req[i].buf);
+	e2img_aio_destroy(af.aio);
+	res->ops = t->nfiles;
+	return rc;
+}
+
+static const struct bench g_benches[] = {
+	{ "lookup",		bench_lookup },
+	{ "read_inode",		bench_read_inode },
+	{ "iterate_dir",	bench_iterate_dir },
+	{ "read",		bench_read },
+	{ "aio_read",		bench_aio_read },
+	{ "scan",		bench_scan },
+};
+
+static
+double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+int open_cold(struct e2img *fs, char const *path, struct e2img_conf const *conf)
+{
+	int rc;
+	if ((rc = e2img_open_conf(fs, path, conf)) < 0)
+		return rc;
+	/* clean pages only, mapped ones stay */
+	posix_fadvise(fs->fd, 0, 0, POSIX_FADV_DONTNEED);
+	return 0;
+}
+
+static
+int run_bench(struct bench const *b, struct e2img *fs, struct bench_tree *t,
+		char const *label, char const *backend, char const *cache)
+{
+	int rc;
+	struct bench_result res = { 0 };
+	double start = now_sec();
+
+	if ((rc = b->run(fs, t, &res)) < 0) {
+		err_display(-rc, "%s %s", b->name, cache);
+		return rc;
+	}
+	double secs = now_sec() - start;
+	printf("{\"image\":\"%s\",\"backend\":\"%s\",\"bench\":\"%s\",\"cache\":\"%s\","
+		"\"ops\":%lu,\"bytes\":%lu,\"secs\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f}\n",
+		label, backend, b->name, cache, res.ops, res.bytes, secs,
+		secs > 0 ? res.ops / secs : 0.0, secs > 0 ? res.bytes / secs / (1 << 20) : 0.0);
+	fflush(stdout);
+	return 0;
+}
+
+/* list is comma separated, "read" must not pick "aio_read" */
+static
+int bench_selected(char const *list, char const *name)
+{
+	size_t len = strlen(name);
+	for (char const *p = list; p; p = strchr(p, ',')) {
+		if (*p == ',')
+			++p;
+		if (!strncmp(p, name, len) && (p[len] == ',' || !p[len]))
+			return 1;
+	}
+	return 0;
+}
+
+static
+int get_strtoul(char const *str, unsigned long *val)
+{
+	errno = 0;
+	char *eptr;
+	*val = strtoul(str, &eptr, 0);
+	if (errno)
+		return -errno;
+	if (*eptr)
+		return -EINVAL;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int rc;
+	struct e2img img;
+	struct e2img_conf conf = e2img_default_conf;
+	struct bench_tree tree = { 0 };
+	char *imgpath = NULL;
+	char *label = NULL;
+	char *only = NULL;
+	unsigned long tmp;
+	int c;
+	opterr = 0;
+	while ((c = getopt(argc, argv, "hmf:l:b:c:")) != -1) switch (c) {
+		case 'f':
+			imgpath = optarg;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'b':
+			only = optarg;
+			break;
+		case 'c':
+			if ((rc = get_strtoul(optarg, &tmp)) < 0) {
+				err_display(-rc, "wrong cache size");
+				return 1;
+			}
+			conf.bcache_sz = tmp << 20;
+			break;
+		case 'm':
+			conf.backend = E2IMG_BACKEND_MMAP;
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "usage: %s -f <ext2-image> [-l <label>] "
+				"[-b <bench>[,<bench>...]] [-c <cache-MiB>] [-m]\n"
+				"\tbenches: lookup read_inode iterate_dir read aio_read scan\n", argv[0]);
+			return 1;
+	}
+	if (!imgpath) {
+		fprintf(stderr, "no <ext2-image> presented\n");
+		return 1;
+	}
+	if (!label) {
+		char const *slash = strrchr(imgpath, '/');
+		label = slash ? (char *) slash + 1 : imgpath;
+	}
+	char const *backend = conf.backend == E2IMG_BACKEND_MMAP ? "mmap" : "pread";
+
+	if ((rc = e2img_open_conf(&img, imgpath, &conf)) < 0) {
+		err_display(-rc, "e2img_open");
+		return 1;
+	}
+	rc = e2img_walk(&img, EXT2_ROOT_INO, 1, collect_ent, &tree);
+	e2img_close(&img);
+	if (rc < 0) {
+		err_display(-rc, "e2img_walk");
+		return 1;
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < ARRAY_SIZE(g_benches) && !ret; ++i) {
+		struct bench const *b = &g_benches[i];
+		if (only && !bench_selected(only, b->name))
+			continue;
+		if ((rc = open_cold(&img, imgpath, &conf)) < 0) {
+			err_display(-rc, "e2img_open");
+			ret = 1;
+			break;
+		}
+		if (run_bench(b, &img, &tree, label, backend, "cold") < 0 ||
+				run_bench(b, &img, &tree, label, backend, "warm") < 0)
+			ret = 1;
+		e2img_close(&img);
+	}
+	free_tree(&tree);
+	return ret;
+}
@@ -0,0 +1,141 @@
+#!/bin/bash
+# Builds the benchmark images into <dir>. Everything is written by debugfs
+# from a fixed command list with a fixed UUID, hash seed and clock, so the
+# same e2fsprogs version always produces the same images.
+set -e
+
+out=${1:?usage: $0 <dir>}
+mkdir -p "$out"
+src=$(mktemp -d)
+trap 'rm -rf "$src"' EXIT
+
+export E2FSPROGS_FAKE_TIME=1700000000
+uuid=6b1d6a4e-3c2f-4f4a-9d7e-0e2b5a1c8f10
+seed=0f1e2d3c-4b5a-6978-8796-a5b4c3d2e1f0
+
+# pattern data, never all zero so debugfs keeps every block
+pattern() {
+	yes "e2img bench $1" | head -c "$2" > "$src/$1"
+}
+
+# mkimg <name> <size> [mke2fs options]
+mkimg() {
+	local img=$out/$1.img size=$2; shift 2
+	rm -f "$img"
+	mke2fs -q -F -t ext2 -U $uuid -E hash_seed=$seed,root_owner=0:0 "$@" "$img" $size
+}
+
+populate() {
+	debugfs -w -f "$src/cmds" "$out/$1.img" > /dev/null 2>&1
+	e2fsck -fn "$out/$1.img" > /dev/null 2>&1
+}
+
+for k in 1 2 3 4 6 8 12 16; do
+	pattern f${k}k $((k * 1024 - 100))
+done
+: > "$src/empty"
+
+# many small files: 200 directories of 100 files, 1 to 16 KiB
+sizes=(1 2 3 4 6 8 12 16)
+{
+	for d in $(seq 0 199); do
+		# debugfs resolves mkdir against the cwd, even for "/d1"
+		echo "cd /"
+		echo "mkdir d$d"
+		echo "cd d$d"
+		for f in $(seq 0 99); do
+			echo "write $src/f${sizes[$(((d + f) % 8))]}k f$f"
+		done
+	done
+} > "$src/cmds"
+mkimg small 160M -b 4096 -N 24000
+populate small
+
+# deep tree: a chain of 128 directories, 4 files on every level
+{
+	for l in $(seq 0 127); do
+		echo "mkdir l$l"
+		echo "cd l$l"
+		for f in 0 1 2 3; do
+			echo "write $src/f4k f$f"
+		done
+	done
+} > "$src/cmds"
+mkimg deep 32M -b 4096
+populate deep
+
+# huge directory: 100000 empty files in one htree directory
+{
+	echo "mkdir /big"
+	echo "cd /big"
+	for f in $(seq 0 99999); do
+		echo "write $src/empty entry-with-a-longer-name-$f"
+	done
+} > "$src/cmds"
+mkimg hugedir 96M -b 4096 -N 110000
+populate hugedir
+# debugfs only appends entries, let e2fsck build the index
+e2fsck -fyD "$out/hugedir.img" > /dev/null 2>&1 || [ $? -eq 1 ]
+e2fsck -fn "$out/hugedir.img" > /dev/null 2>&1
+
+# large fragmented file: fill with 8 KiB files, free every other one,
+# then a 48 MiB file takes the gaps first
+pattern big $((48 << 20))
+{
+	echo "mkdir /fill"
+	for f in $(seq 0 5999); do
+		echo "write $src/f8k /fill/f$f"
+	done
+	for f in $(seq 0 2 5999); do
+		echo "rm /fill/f$f"
+	done
+	echo "write $src/big /big"
+} > "$src/cmds"
+mkimg frag 128M -b 4096
+populate frag
+
+# triple indirect: 1 KiB blocks, 256 KiB of data every 16 MiB up to 512 MiB
+rm -f "$src/sparse"
+for c in $(seq 0 31); do
+	yes "e2img bench sparse $c" | head -c $((256 << 10)) |
+		dd of="$src/sparse" bs=64K seek=$((c * 256)) conv=notrunc status=none
+done
+truncate -s 512M "$src/sparse"
+echo "write $src/sparse /sparse" > "$src/cmds"
+mkimg tind 32M -b 1024
+populate tind
+
+# 64-bit layout: a sparse 20 TiB ext4 with flex_bg and meta_bg. /far has
+# eight separate extents starting above 2^32, more than the inode holds,
+# so the tree gets an index block, allocated next to them. Data is put in
+# place with dd, e2fsck then accounts the blocks. check-huge.sh reads it.
+far=4400000000
+rm -f "$out/huge.img"
+if ! truncate -s 20T "$out/huge.img" 2> /dev/null; then
+	echo "skipping huge.img, $out cannot hold a 20 TiB sparse file" >&2
+	ls -l "$out"/*.img
+	exit 0
+fi
+mke2fs -q -F -t ext4 -b 4096 -i 1048576 -U $uuid \
+	-O 64bit,flex_bg,meta_bg,^resize_inode,^has_journal \
+	-E hash_seed=$seed,root_owner=0:0,lazy_itable_init=1,nodiscard \
+	"$out/huge.img"
+{
+	echo "write /dev/null far"
+	echo "setb $far 16"
+	echo "extent_open far"
+	for k in $(seq 0 7); do
+		echo "set_bmap $k $((far + 2 * k))"
+	done
+	echo "extent_close"
+	echo "sif far size $((8 * 4096))"
+} > "$src/cmds"
+debugfs -w -f "$src/cmds" "$out/huge.img" > /dev/null 2>&1
+for k in $(seq 0 7); do
+	yes "e2img bench far $k" | head -c 4096 |
+		dd of="$out/huge.img" bs=4096 seek=$((far + 2 * k)) conv=notrunc status=none
+done
+e2fsck -fy "$out/huge.img" > /dev/null 2>&1 || [ $? -eq 1 ]
+e2fsck -fn "$out/huge.img" > /dev/null 2>&1
+
+ls -l "$out"/*.img
@@ -0,0 +1,25 @@
+#!/bin/bash
+#
+# Generate the benchmark images (once) and run every benchmark on each of
+# them with both backends. JSON lines go to stdout, progress to stderr.
+#
+# usage: run.sh [<image-dir>]
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+dir=${1:-${BENCH_DIR:-/tmp/e2img-bench}}
+images="small deep hugedir frag tind"
+
+for name in $images; do
+	if [ ! -f "$dir/$name.img" ]; then
+		echo "generating images in $dir" >&2
+		"$here/mkimages.sh" "$dir" >&2
+		break
+	fi
+done
+
+for name in $images; do
+	echo "$name" >&2
+	"$here/a.out" -f "$dir/$name.img" -l $name
+	"$here/a.out" -f "$dir/$name.img" -l $name -m
+done
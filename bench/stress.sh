@@ -0,0 +1,79 @@
+#!/bin/bash
+#
+# Mount each benchmark image with the multithreaded fuse-ext2, high-level
+# and --lowlevel in turn, with caches small enough to keep evicting, and
+# run stress/a.out against a debugfs rdump copy of the tree. With
+# SANITIZE=thread or SANITIZE=address fuse-ext2 is rebuilt with that
+# sanitizer first and any report fails the run. Summaries go to stdout,
+# progress and failures to stderr.
+#
+# usage: stress.sh [<image-dir>]
+#	STRESS_THREADS (32), STRESS_OPS per thread (20000), STRESS_SEED (1)
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+dir=${1:-${BENCH_DIR:-/tmp/e2img-bench}}
+images="small deep hugedir frag"
+fuse=$here/../fuse-ext2/a.out
+stress=$here/stress/a.out
+
+if [ -n "$SANITIZE" ]; then
+	make -C "$here/../fuse-ext2" clean >&2
+	CFLAGS="-fsanitize=$SANITIZE" LDFLAGS="-fsanitize=$SANITIZE" \
+		make -C "$here/../fuse-ext2" >&2
+fi
+
+for name in $images; do
+	if [ ! -f "$dir/$name.img" ]; then
+		echo "generating images in $dir" >&2
+		"$here/mkimages.sh" "$dir" >&2
+		break
+	fi
+done
+
+mnt=$(mktemp -d)
+log=$(mktemp)
+trap 'fusermount3 -u "$mnt" 2> /dev/null; rmdir "$mnt"; rm -f "$log"' EXIT
+
+ret=0
+for name in $images; do
+	img=$dir/$name.img
+	ref=$dir/$name.ref
+	if [ ! -d "$ref" ]; then
+		rm -rf "$ref.tmp"
+		mkdir "$ref.tmp"
+		# ownership is not restored without root, nothing compares it
+		debugfs -R "rdump / $ref.tmp" "$img" > /dev/null 2>&1
+		mv "$ref.tmp" "$ref"
+	fi
+
+	for mode in "" --lowlevel; do
+		echo "$name ${mode:-highlevel}" >&2
+		"$fuse" --img="$img" --bcache=1 --icache=1 --dcache=1 $mode \
+			-f "$mnt" 2> "$log" &
+		pid=$!
+		for i in $(seq 100); do
+			mountpoint -q "$mnt" && break
+			sleep 0.1
+		done
+		if ! mountpoint -q "$mnt"; then
+			echo "FAIL: $name ${mode:-highlevel}: not mounted" >&2
+			cat "$log" >&2
+			kill $pid 2> /dev/null || true
+			wait $pid || true
+			ret=1
+			continue
+		fi
+
+		printf "%s %s: " $name ${mode:-highlevel}
+		"$stress" -m "$mnt" -r "$ref" -t ${STRESS_THREADS:-32} \
+			-n ${STRESS_OPS:-20000} -s ${STRESS_SEED:-1} || ret=1
+		fusermount3 -u "$mnt"
+		wait $pid || ret=1
+		if grep -q "Sanitizer" "$log"; then
+			cat "$log" >&2
+			ret=1
+		fi
+	done
+done
+exit $ret
@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <ftw.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "common.h"
+
+/*
+ * Hammers a mounted fuse-ext2 from many threads with random lookups,
+ * stats, directory listings, reads and readlinks, and checks every answer
+ * against a reference copy of the same tree (debugfs rdump). Each mismatch
+ * is reported, the exit status is 1 if there was any.
+ */
+
+#define STRESS_MAX_IO		(256 << 10)
+#define STRESS_MAX_REPORTS	32
+
+enum stress_op {
+	OP_STAT,
+	OP_MISSING,
+	OP_READDIR,
+	OP_READ,
+	OP_READLINK,
+	OP_NR,
+};
+
+static char const *const g_op_names[OP_NR] = {
+	[OP_STAT]	= "stat",
+	[OP_MISSING]	= "missing",
+	[OP_READDIR]	= "readdir",
+	[OP_READ]	= "read",
+	[OP_READLINK]	= "readlink",
+};
+
+struct stress_ent {
+	char	*path;		/* relative, "" for the root */
+	mode_t	mode;
+	off_t	size;
+};
+
+struct stress_set {
+	struct stress_ent	*v;
+	size_t			n, cap;
+};
+
+struct stress_worker {
+	pthread_t	tid;
+	unsigned	seed;
+	uint64_t	ops[OP_NR];
+};
+
+static char const *g_mnt;
+static char const *g_ref;
+static size_t g_ref_len;
+static unsigned long g_nops = 10000;
+static struct stress_set g_all, g_dirs, g_files, g_links;
+static uint64_t g_bad;
+
+static
+void set_push(struct stress_set *s, struct stress_ent const *e)
+{
+	if (s->n == s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 256;
+		s->v = realloc(s->v, sizeof(*s->v) * s->cap);
+		release_assert(s->v);
+	}
+	s->v[s->n++] = *e;
+}
+
+static
+int collect_ent(char const *fpath, struct stat const *st, int flag, struct FTW *ftw)
+{
+	char const *rel = fpath + g_ref_len;
+	struct stress_ent e = {
+		.path	= strdup(*rel == '/' ? rel + 1 : rel),
+		.mode	= st->st_mode,
+		.size	= st->st_size,
+	};
+	release_assert(e.path);
+
+	set_push(&g_all, &e);
+	if (S_ISDIR(st->st_mode))
+		set_push(&g_dirs, &e);
+	else if (S_ISREG(st->st_mode))
+		set_push(&g_files, &e);
+	else if (S_ISLNK(st->st_mode))
+		set_push(&g_links, &e);
+	return 0;
+}
+
+static
+void mismatch(char const *op, char const *path, char const *fmt, ...)
+{
+	va_list ap;
+	uint64_t n = __atomic_fetch_add(&g_bad, 1, __ATOMIC_RELAXED);
+	if (n >= STRESS_MAX_REPORTS)
+		return;
+	flockfile(stderr);
+	fprintf(stderr, "%s /%s: ", op, path);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	funlockfile(stderr);
+}
+
+static
+void join(char *buf, char const *root, char const *rel)
+{
+	int n = snprintf(buf, PATH_MAX, "%s%s%s", root, *rel ? "/" : "", rel);
+	release_assert(n >= 0 && n < PATH_MAX);
+}
+
+static
+struct stress_ent *pick(struct stress_set *s, unsigned *seed)
+{
+	return s->n ? &s->v[rand_r(seed) % s->n] : NULL;
+}
+
+static
+void op_stat(struct stress_ent *e)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	join(path, g_mnt, e->path);
+	if (lstat(path, &st) < 0) {
+		mismatch("stat", e->path, "%s", strerror(errno));
+		return;
+	}
+	if ((st.st_mode & (S_IFMT | 07777)) != (e->mode & (S_IFMT | 07777)))
+		mismatch("stat", e->path, "mode %o, expected %o", st.st_mode, e->mode);
+	/* directory sizes depend on the filesystem holding the copy */
+	if (!S_ISDIR(e->mode) && st.st_size != e->size)
+		mismatch("stat", e->path, "size %ld, expected %ld",
+			(long) st.st_size, (long) e->size);
+}
+
+/* negative lookups, repeated names land in the negative dentry cache */
+static
+void op_missing(struct stress_ent *dir, unsigned *seed)
+{
+	char path[PATH_MAX], name[PATH_MAX];
+	struct stat st;
+
+	snprintf(name, sizeof(name), "%s%sno-such-%u", dir->path,
+		*dir->path ? "/" : "", rand_r(seed) % 64);
+	join(path, g_mnt, name);
+	if (lstat(path, &st) == 0)
+		mismatch("missing", name, "exists");
+	else if (errno != ENOENT)
+		mismatch("missing", name, "%s", strerror(errno));
+}
+
+static
+int name_cmp(void const *a, void const *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* Sorted names without "." and "..", -errno on failure */
+static
+ssize_t list_dir(char const *path, char ***namesp)
+{
+	DIR *d;
+	struct dirent *de;
+	size_t n = 0, cap = 64;
+	char **names;
+
+	if (!(d = opendir(path)))
+		return -errno;
+	names = xmalloc(sizeof(*names) * cap);
+	while ((errno = 0, de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (n == cap) {
+			cap *= 2;
+			names = realloc(names, sizeof(*names) * cap);
+			release_assert(names);
+		}
+		names[n++] = strdup(de->d_name);
+	}
+	int err = errno;
+	closedir(d);
+	qsort(names, n, sizeof(*names), name_cmp);
+	*namesp = names;
+	if (err) {
+		for (size_t i = 0; i < n; ++i)
+			free(names[i]);
+		free(names);
+		return -err;
+	}
+	return n;
+}
+
+static
+void op_readdir(struct stress_ent *e)
+{
+	char path[PATH_MAX];
+	char **got = NULL, **want = NULL;
+	ssize_t ngot, nwant;
+
+	join(path, g_ref, e->path);
+	nwant = list_dir(path, &want);
+	join(path, g_mnt, e->path);
+	ngot = list_dir(path, &got);
+
+	if (ngot < 0 || nwant < 0) {
+		if (ngot != nwant)
+			mismatch("readdir", e->path, "%s, expected %s",
+				ngot < 0 ? strerror(-ngot) : "ok",
+				nwant < 0 ? strerror(-nwant) : "ok");
+		goto out;
+	}
+	if (ngot != nwant) {
+		mismatch("readdir", e->path, "%zd entries, expected %zd", ngot, nwant);
+		goto out;
+	}
+	for (ssize_t i = 0; i < ngot; ++i) {
+		if (strcmp(got[i], want[i])) {
+			mismatch("readdir", e->path, "entry %s, expected %s", got[i], want[i]);
+			break;
+		}
+	}
+out:
+	for (ssize_t i = 0; i < ngot; ++i)
+		free(got[i]);
+	for (ssize_t i = 0; i < nwant; ++i)
+		free(want[i]);
+	free(got);
+	free(want);
+}
+
+static
+int compare_range(struct stress_ent *e, int fd, int rfd, char *buf, char *rbuf,
+		off_t off, size_t len)
+{
+	ssize_t got = pread(fd, buf, len, off);
+	ssize_t want = pread(rfd, rbuf, len, off);
+
+	if (got < 0) {
+		mismatch("read", e->path, "at %ld: %s", (long) off, strerror(errno));
+		return -1;
+	}
+	if (got != want || memcmp(buf, rbuf, got)) {
+		mismatch("read", e->path, "%zd bytes at %ld differ from the copy (%zd)",
+			got, (long) off, want);
+		return -1;
+	}
+	return got;
+}
+
+/* A random range, or now and then the whole file front to back */
+static
+void op_read(struct stress_ent *e, unsigned *seed, char *buf, char *rbuf)
+{
+	char path[PATH_MAX];
+	int fd, rfd;
+
+	join(path, g_ref, e->path);
+	if ((rfd = open(path, O_RDONLY)) < 0) {
+		mismatch("read", e->path, "reference: %s", strerror(errno));
+		return;
+	}
+	join(path, g_mnt, e->path);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		mismatch("read", e->path, "open: %s", strerror(errno));
+		close(rfd);
+		return;
+	}
+
+	if (rand_r(seed) % 8 == 0) {
+		for (off_t off = 0;; off += STRESS_MAX_IO / 2) {
+			if (compare_range(e, fd, rfd, buf, rbuf, off, STRESS_MAX_IO / 2) <= 0)
+				break;
+		}
+	} else {
+		off_t off = e->size ? (off_t) (((uint64_t) rand_r(seed) << 16 ^
+				rand_r(seed)) % (e->size + 1)) : 0;
+		size_t len = 1 + rand_r(seed) % STRESS_MAX_IO;
+		compare_range(e, fd, rfd, buf, rbuf, off, len);
+	}
+	close(fd);
+	close(rfd);
+}
+
+static
+void op_readlink(struct stress_ent *e)
+{
+	char path[PATH_MAX], got[PATH_MAX], want[PATH_MAX];
+	ssize_t ngot, nwant;
+
+	join(path, g_ref, e->path);
+	nwant = readlink(path, want, sizeof(want));
+	join(path, g_mnt, e->path);
+	if ((ngot = readlink(path, got, sizeof(got))) < 0) {
+		mismatch("readlink", e->path, "%s", strerror(errno));
+		return;
+	}
+	if (ngot != nwant || memcmp(got, want, ngot))
+		mismatch("readlink", e->path, "'%.*s', expected '%.*s'",
+			(int) ngot, got, (int) max(nwant, (ssize_t) 0), want);
+}
+
+static
+void *stress_worker(void *arg)
+{
+	struct stress_worker *w = arg;
+	char *buf = xmalloc(STRESS_MAX_IO);
+	char *rbuf = xmalloc(STRESS_MAX_IO);
+
+	for (unsigned long i = 0; i < g_nops; ++i) {
+		struct stress_ent *e;
+		enum stress_op op = rand_r(&w->seed) % OP_NR;
+
+		switch (op) {
+		case OP_STAT:
+			e = pick(&g_all, &w->seed);
+			op_stat(e);
+			break;
+		case OP_MISSING:
+			e = pick(&g_dirs, &w->seed);
+			op_missing(e, &w->seed);
+			break;
+		case OP_READDIR:
+			e = pick(&g_dirs, &w->seed);
+			op_readdir(e);
+			break;
+		case OP_READ:
+			if (!(e = pick(&g_files, &w->seed)))
+				continue;
+			op_read(e, &w->seed, buf, rbuf);
+			break;
+		case OP_READLINK:
+			if (!(e = pick(&g_links, &w->seed)))
+				continue;
+			op_readlink(e);
+			break;
+		default:
+			continue;
+		}
+		w->ops[op]++;
+	}
+	free(rbuf);
+	free(buf);
+	return NULL;
+}
+
+static
+int get_strtoul(char const *str, unsigned long *val)
+{
+	errno = 0;
+	char *eptr;
+	*val = strtoul(str, &eptr, 0);
+	if (errno)
+		return -errno;
+	if (*eptr)
+		return -EINVAL;
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int rc;
+	unsigned long nthreads = 16, seed = 1, tmp;
+	int c;
+	opterr = 0;
+	while ((c = getopt(argc, argv, "hm:r:t:n:s:")) != -1) switch (c) {
+		case 'm':
+			g_mnt = optarg;
+			break;
+		case 'r':
+			g_ref = optarg;
+			break;
+		case 't':
+		case 'n':
+		case 's':
+			if ((rc = get_strtoul(optarg, &tmp)) < 0 || (c != 's' && !tmp)) {
+				err_display(rc < 0 ? -rc : EINVAL, "wrong -%c", c);
+				return 1;
+			}
+			if (c == 't')
+				nthreads = tmp;
+			else if (c == 'n')
+				g_nops = tmp;
+			else
+				seed = tmp;
+			break;
+		case 'h':
+		default:
+			fprintf(stderr, "usage: %s -m <mountpoint> -r <reference-dir> "
+				"[-t <threads>] [-n <ops-per-thread>] [-s <seed>]\n", argv[0]);
+			return 1;
+	}
+	if (!g_mnt || !g_ref) {
+		fprintf(stderr, "no <mountpoint> or <reference-dir> presented\n");
+		return 1;
+	}
+
+	g_ref_len = strlen(g_ref);
+	if (nftw(g_ref, collect_ent, 64, FTW_PHYS) < 0) {
+		err_display(errno, "%s", g_ref);
+		return 1;
+	}
+
+	struct stress_worker *w = xmalloc(sizeof(*w) * nthreads);
+	memset(w, 0, sizeof(*w) * nthreads);
+	for (unsigned long i = 0; i < nthreads; ++i) {
+		w[i].seed = seed * 7919 + i;
+		if ((rc = pthread_create(&w[i].tid, NULL, stress_worker, &w[i]))) {
+			err_display(rc, "pthread_create");
+			return 1;
+		}
+	}
+
+	uint64_t ops[OP_NR] = { 0 };
+	for (unsigned long i = 0; i < nthreads; ++i) {
+		pthread_join(w[i].tid, NULL);
+		for (int op = 0; op < OP_NR; ++op)
+			ops[op] += w[i].ops[op];
+	}
+	free(w);
+
+	printf("entries %zu threads %lu", g_all.n, nthreads);
+	for (int op = 0; op < OP_NR; ++op)
+		printf(" %s %lu", g_op_names[op], ops[op]);
+	printf(" mismatches %lu\n", g_bad);
+	return g_bad ? 1 : 0;
+}
@@ -15,6 +15,11 @@
         typeof(y) __y = (y);            \
         (__x < __y) ? __x : __y;  })
 
+#define max(x, y) ({                    \
+        typeof(x) __x = (x);            \
+        typeof(y) __y = (y);            \
+        (__x > __y) ? __x : __y;  })
+
 #define BUILD_BUG_ON_ZERO(e)	(sizeof(struct { int:-!!(e); }))
 #define __same_type(a, b)	__builtin_types_compatible_p(typeof(a), typeof(b))
 #define __must_be_array(a)	BUILD_BUG_ON_ZERO(__same_type((a), &(a)[0]))
@@ -24,6 +29,9 @@
 
 #define ptr_add(ptr, val) ((void*) ((uint8_t*) (ptr) + (val)))
 
+#define container_of(ptr, type, member) \
+	((type *) ((uint8_t *) (ptr) - offsetof(type, member)))
+
 #define release_assert(expr)	do {				\
 	if (!(expr))						\
 		__release_assert(__FILE__, __LINE__, #expr);	\
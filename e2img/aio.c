@@ -0,0 +1,174 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <liburing.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * Batched block reads on io_uring. A context belongs to one thread.
+ * Without io_uring (old kernel, seccomp) or with the mmap backend requests
+ * are served synchronously at submit time and handed out by reap.
+ */
+struct e2img_aio {
+	struct e2img		*fs;
+	struct io_uring		uring;
+	int			sync;
+	unsigned		depth;
+	unsigned		inflight;	/* submitted, not yet reaped */
+	struct e2img_aio_req	**ready;	/* sync mode completions */
+	unsigned		nready;
+};
+
+int e2img_aio_init(struct e2img *fs, struct e2img_aio **aiop, unsigned depth)
+{
+	int rc;
+	struct e2img_aio *aio;
+
+	if (!depth)
+		return -EINVAL;
+	aio = xmalloc(sizeof(*aio));
+	aio->fs = fs;
+	aio->depth = depth;
+	aio->inflight = 0;
+	aio->nready = 0;
+	aio->ready = NULL;
+	aio->sync = !!fs->map;
+
+	if (!aio->sync && (rc = io_uring_queue_init(depth, &aio->uring, 0)) < 0) {
+		if (rc != -ENOSYS && rc != -EPERM) {
+			free(aio);
+			return rc;
+		}
+		aio->sync = 1;
+	}
+	if (aio->sync)
+		aio->ready = xmalloc(sizeof(*aio->ready) * depth);
+	*aiop = aio;
+	return 0;
+}
+
+void e2img_aio_destroy(struct e2img_aio *aio)
+{
+	release_assert(!aio->inflight);
+	if (!aio->sync)
+		io_uring_queue_exit(&aio->uring);
+	free(aio->ready);
+	free(aio);
+}
+
+unsigned e2img_aio_inflight(struct e2img_aio *aio)
+{
+	return aio->inflight;
+}
+
+static
+void aio_prep(struct e2img_aio *aio, struct e2img_aio_req *req)
+{
+	size_t blk_sz = aio->fs->blk_sz;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&aio->uring);
+	release_assert(sqe);
+
+	io_uring_prep_read(sqe, aio->fs->fd, ptr_add(req->buf, req->__done),
+			(size_t) req->nblocks * blk_sz - req->__done,
+			req->blkno * blk_sz + req->__done);
+	io_uring_sqe_set_data(sqe, req);
+}
+
+/* Queues as many of reqs as there is room for, returns how many */
+int e2img_aio_submit(struct e2img_aio *aio, struct e2img_aio_req **reqs, unsigned n)
+{
+	int rc;
+	unsigned i;
+
+	for (i = 0; i < n && aio->inflight < aio->depth; ++i) {
+		struct e2img_aio_req *req = reqs[i];
+		if (!req->nblocks || (size_t) req->nblocks * aio->fs->blk_sz > UINT_MAX)
+			return i ? i : -EINVAL;
+		req->__done = 0;
+		aio->inflight++;
+		if (aio->sync) {
+			req->res = e2img_blk_read(aio->fs, req->buf, req->nblocks, req->blkno);
+			aio->ready[aio->nready++] = req;
+			continue;
+		}
+		aio_prep(aio, req);
+	}
+	/* on a transient failure the entries stay queued, reap pushes them */
+	if (!aio->sync && i && (rc = io_uring_submit(&aio->uring)) < 0 &&
+			rc != -EAGAIN && rc != -EBUSY && rc != -EINTR)
+		return rc;
+	return i;
+}
+
+/* Returns 1 once req is finished, 0 if the remainder was queued again */
+static
+int aio_complete(struct e2img_aio *aio, struct e2img_aio_req *req, int res)
+{
+	size_t len = (size_t) req->nblocks * aio->fs->blk_sz;
+
+	if (res == -EAGAIN || res == -EINTR) {
+		aio_prep(aio, req);
+		return 0;
+	}
+	if (res <= 0) {
+		req->res = res ? res : -EIO;	/* EOF inside the image */
+		return 1;
+	}
+	e2img_io_account(aio->fs, 0, res);
+	req->__done += res;
+	if (req->__done < len) {
+		aio_prep(aio, req);
+		return 0;
+	}
+	req->res = req->nblocks;
+	return 1;
+}
+
+/*
+ * Collects up to max finished requests into done, blocking until at least
+ * wait_nr of them (bounded by what is in flight) are available.
+ */
+int e2img_aio_reap(struct e2img_aio *aio, struct e2img_aio_req **done,
+		unsigned max, unsigned wait_nr)
+{
+	int rc;
+	unsigned n = 0;
+
+	if (aio->sync) {
+		for (; n < max && aio->nready; ++n)
+			done[n] = aio->ready[--aio->nready];
+		aio->inflight -= n;
+		return n;
+	}
+
+	wait_nr = min(wait_nr, min(max, aio->inflight));
+	while (n < max && aio->inflight) {
+		struct io_uring_cqe *cqe;
+		if (n < wait_nr) {
+			if (io_uring_sq_ready(&aio->uring))
+				io_uring_submit(&aio->uring);
+			while ((rc = io_uring_wait_cqe(&aio->uring, &cqe)) == -EINTR)
+				;
+		} else if ((rc = io_uring_peek_cqe(&aio->uring, &cqe)) == -EAGAIN)
+			break;
+		if (rc < 0)
+			return n ? n : rc;
+
+		struct e2img_aio_req *req = io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen(&aio->uring, cqe);
+
+		if (aio_complete(aio, req, res)) {
+			done[n++] = req;
+			aio->inflight--;
+		} else if ((rc = io_uring_submit(&aio->uring)) < 0 &&
+				rc != -EAGAIN && rc != -EBUSY && rc != -EINTR) {
+			/* the remainder is queued on the ring, req stays in flight */
+			return n ? n : rc;
+		}
+	}
+	return n;
+}
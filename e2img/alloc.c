@@ -0,0 +1,257 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * Block and inode allocation straight on the on-disk bitmaps, one bitmap
+ * block per group held in the block cache and marked dirty on change. Free
+ * block runs are looked up in the free space map, kept in step here.
+ * Group and superblock counters are updated in memory and written back by
+ * e2img_sync_meta.
+ */
+
+static inline
+int bit_test(uint8_t const *map, uint32_t bit)
+{
+	return map[bit >> 3] & (1 << (bit & 7));
+}
+
+/* First bit in [from, to) equal to val, to if there is none */
+static
+uint32_t bit_find(uint8_t const *map, uint32_t from, uint32_t to, int val)
+{
+	uint8_t skip = val ? 0x00 : 0xff;
+	for (uint32_t i = from; i < to; ++i) {
+		if (!(i & 7) && i + 8 <= to && map[i >> 3] == skip) {
+			i += 7;
+			continue;
+		}
+		if (!!bit_test(map, i) == val)
+			return i;
+	}
+	return to;
+}
+
+static
+void bit_set_range(uint8_t *map, uint32_t from, uint32_t n, int val)
+{
+	for (uint32_t i = from; i < from + n; ++i) {
+		if (val)
+			map[i >> 3] |= 1 << (i & 7);
+		else
+			map[i >> 3] &= ~(1 << (i & 7));
+	}
+}
+
+static
+void sb_add_free_blocks(struct e2img *fs, int64_t delta)
+{
+	struct ext2_super_block *sb = fs->sb;
+	int hi = sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT;
+	uint64_t v = sb->s_free_blocks_count;
+
+	if (hi)
+		v |= (uint64_t) sb->s_free_blocks_hi << 32;
+	v += delta;
+	sb->s_free_blocks_count = v;
+	if (hi)
+		sb->s_free_blocks_hi = v >> 32;
+	fs->sb_dirty = 1;
+}
+
+/* Block numbers the indirect maps can hold */
+static inline
+blk64_t alloc_blocks_limit(struct e2img *fs)
+{
+	return min(fs->blocks_count, (blk64_t) 1 << 32);
+}
+
+/*
+ * Allocates up to want contiguous blocks, as close after goal as possible.
+ * A run of the full length anywhere is preferred over a shorter one near
+ * goal, callers loop until they have all they need.
+ */
+int e2img_alloc_blocks(struct e2img *fs, blk64_t goal, blk_t want,
+		blk64_t *start, blk_t *got)
+{
+	int rc;
+	void *map;
+	blk64_t run;
+	blk_t len;
+	uint32_t bpg = EXT2_BLOCKS_PER_GROUP(fs->sb);
+	blk64_t limit = alloc_blocks_limit(fs);
+
+	if (!fs->writable)
+		return -EROFS;
+	if (!want)
+		return -EINVAL;
+	want = min(want, bpg);
+	rc = e2img_free_extent(fs, goal, want, limit, &run, &len);
+	if (rc == -ENOSPC)
+		rc = e2img_free_extent(fs, goal, 1, limit, &run, &len);
+	if (rc < 0)
+		return rc;
+	len = min(len, want);
+
+	dgrp_t g = (run - fs->sb->s_first_data_block) / bpg;
+	uint32_t bit = (run - fs->sb->s_first_data_block) % bpg;
+	if ((rc = e2img_bcache_access(fs, fs->gd[g].block_bitmap, &map)) < 0)
+		return rc;
+	if (bit_find(map, bit, bit + len, 1) != bit + len) {
+		e2img_bcache_release(fs, map);
+		return -EIO;	/* free space map out of step with the bitmap */
+	}
+	bit_set_range(map, bit, len, 1);
+	rc = e2img_bcache_dirty(fs, fs->gd[g].block_bitmap, map);
+	e2img_bcache_release(fs, map);
+	if (rc < 0)
+		return rc;
+
+	fs->gd[g].free_blocks -= len;
+	fs->gd_dirty[g] = 1;
+	sb_add_free_blocks(fs, -(int64_t) len);
+	e2img_freemap_update(fs, run, len, 1);
+	*start = run;
+	*got = len;
+	return 0;
+}
+
+int e2img_free_blocks(struct e2img *fs, blk64_t start, blk_t n)
+{
+	int rc;
+	uint32_t bpg = EXT2_BLOCKS_PER_GROUP(fs->sb);
+
+	if (start < fs->sb->s_first_data_block || start + n > fs->blocks_count)
+		return -EIO;
+	while (n) {
+		void *map;
+		dgrp_t g = (start - fs->sb->s_first_data_block) / bpg;
+		uint32_t bit = (start - fs->sb->s_first_data_block) % bpg;
+		uint32_t cnt = min(n, bpg - bit);
+
+		if ((rc = e2img_bcache_access(fs, fs->gd[g].block_bitmap, &map)) < 0)
+			return rc;
+		if (bit_find(map, bit, bit + cnt, 0) != bit + cnt) {
+			e2img_bcache_release(fs, map);
+			return -EIO;	/* freeing a free block */
+		}
+		bit_set_range(map, bit, cnt, 0);
+		rc = e2img_bcache_dirty(fs, fs->gd[g].block_bitmap, map);
+		e2img_bcache_release(fs, map);
+		if (rc < 0)
+			return rc;
+		e2img_bcache_discard(fs, start, cnt);
+		fs->gd[g].free_blocks += cnt;
+		fs->gd_dirty[g] = 1;
+		sb_add_free_blocks(fs, cnt);
+		e2img_freemap_update(fs, start, cnt, 0);
+		start += cnt;
+		n -= cnt;
+	}
+	return 0;
+}
+
+/*
+ * Directories are spread out: the group with most free inodes among
+ * those with at least average free blocks. Files stay with their parent.
+ */
+static
+dgrp_t alloc_inode_group(struct e2img *fs, ext2_ino_t parent, int is_dir)
+{
+	dgrp_t pg = (parent - 1) / EXT2_INODES_PER_GROUP(fs->sb);
+	if (!is_dir)
+		return pg;
+
+	uint64_t avg = 0;
+	for (dgrp_t g = 0; g < fs->group_count; ++g)
+		avg += fs->gd[g].free_blocks;
+	avg /= fs->group_count;
+
+	dgrp_t best = pg;
+	uint32_t best_free = 0;
+	for (dgrp_t g = 0; g < fs->group_count; ++g) {
+		if (fs->gd[g].free_blocks >= avg && fs->gd[g].free_inodes > best_free) {
+			best = g;
+			best_free = fs->gd[g].free_inodes;
+		}
+	}
+	return best;
+}
+
+int e2img_alloc_inode(struct e2img *fs, ext2_ino_t parent, int is_dir, ext2_ino_t *ino)
+{
+	int rc;
+	uint32_t ipg = EXT2_INODES_PER_GROUP(fs->sb);
+	dgrp_t first = alloc_inode_group(fs, parent, is_dir);
+
+	if (!fs->writable)
+		return -EROFS;
+	for (dgrp_t i = 0; i < fs->group_count; ++i) {
+		void *map;
+		dgrp_t g = (first + i) % fs->group_count;
+		uint32_t from = g ? 0 : EXT2_FIRST_INO(fs->sb) - 1;
+		uint32_t limit = min(ipg, fs->sb->s_inodes_count - g * ipg);
+
+		if (!fs->gd[g].free_inodes)
+			continue;
+		if ((rc = e2img_bcache_access(fs, fs->gd[g].inode_bitmap, &map)) < 0)
+			return rc;
+		uint32_t bit = bit_find(map, from, limit, 0);
+		if (bit == limit) {
+			e2img_bcache_release(fs, map);
+			continue;
+		}
+		bit_set_range(map, bit, 1, 1);
+		rc = e2img_bcache_dirty(fs, fs->gd[g].inode_bitmap, map);
+		e2img_bcache_release(fs, map);
+		if (rc < 0)
+			return rc;
+
+		fs->gd[g].free_inodes--;
+		if (is_dir)
+			fs->gd[g].used_dirs++;
+		fs->gd_dirty[g] = 1;
+		fs->sb->s_free_inodes_count--;
+		fs->sb_dirty = 1;
+		e2img_freemap_count_inodes(fs, -1);
+		*ino = g * ipg + bit + 1;
+		return 0;
+	}
+	return -ENOSPC;
+}
+
+int e2img_free_inode(struct e2img *fs, ext2_ino_t ino, int is_dir)
+{
+	int rc;
+	void *map;
+	uint32_t ipg = EXT2_INODES_PER_GROUP(fs->sb);
+
+	if (!ino || ino > fs->sb->s_inodes_count)
+		return -EINVAL;
+	dgrp_t g = (ino - 1) / ipg;
+	uint32_t bit = (ino - 1) % ipg;
+
+	if ((rc = e2img_bcache_access(fs, fs->gd[g].inode_bitmap, &map)) < 0)
+		return rc;
+	if (!bit_test(map, bit)) {
+		e2img_bcache_release(fs, map);
+		return -EIO;
+	}
+	bit_set_range(map, bit, 1, 0);
+	rc = e2img_bcache_dirty(fs, fs->gd[g].inode_bitmap, map);
+	e2img_bcache_release(fs, map);
+	if (rc < 0)
+		return rc;
+
+	fs->gd[g].free_inodes++;
+	if (is_dir)
+		fs->gd[g].used_dirs--;
+	fs->gd_dirty[g] = 1;
+	fs->sb->s_free_inodes_count++;
+	fs->sb_dirty = 1;
+	e2img_freemap_count_inodes(fs, 1);
+	return 0;
+}
@@ -0,0 +1,416 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "e2img.h"
+#include "common.h"
+
+#define BH_VALID	(1 << 0)
+#define BH_LOADING	(1 << 1)
+#define BH_REF		(1 << 2)	/* CLOCK reference bit */
+#define BH_DIRTY	(1 << 3)	/* modified, written back on flush or reuse */
+
+#define BCACHE_MIN_SLOTS 16
+
+struct e2img_bhead {
+	blk64_t		blkno;
+	uint32_t	refcnt;
+	uint32_t	flags;
+	int32_t		hnext;
+};
+
+/* Neighbouring blocks land in different shards */
+static inline
+struct e2img_bcache_shard *bcache_shard(struct e2img_bcache *bc, blk64_t blkno)
+{
+	return &bc->shards[blkno % E2IMG_CACHE_SHARDS];
+}
+
+static inline
+size_t bcache_hash(struct e2img_bcache_shard *sh, blk64_t blkno)
+{
+	return ((blkno / E2IMG_CACHE_SHARDS) * 0x9e3779b97f4a7c15ull >> 32) & sh->hmask;
+}
+
+static inline
+void *bcache_slot_data(struct e2img_bcache *bc, struct e2img_bcache_shard *sh,
+		int32_t idx)
+{
+	size_t gidx = (sh - bc->shards) * bc->nslots + idx;
+	return bc->arena + gidx * bc->blk_sz;
+}
+
+static
+int32_t bcache_lookup(struct e2img_bcache_shard *sh, blk64_t blkno)
+{
+	int32_t i = sh->htab[bcache_hash(sh, blkno)];
+	for (; i >= 0; i = sh->bh[i].hnext) {
+		if (sh->bh[i].blkno == blkno)
+			return i;
+	}
+	return -1;
+}
+
+static
+void bcache_hash_insert(struct e2img_bcache_shard *sh, int32_t idx)
+{
+	int32_t *head = &sh->htab[bcache_hash(sh, sh->bh[idx].blkno)];
+	sh->bh[idx].hnext = *head;
+	*head = idx;
+}
+
+static
+void bcache_hash_remove(struct e2img_bcache_shard *sh, int32_t idx)
+{
+	int32_t *pos = &sh->htab[bcache_hash(sh, sh->bh[idx].blkno)];
+	while (*pos != idx) {
+		release_assert(*pos >= 0);
+		pos = &sh->bh[*pos].hnext;
+	}
+	*pos = sh->bh[idx].hnext;
+	sh->bh[idx].hnext = -1;
+}
+
+/*
+ * CLOCK: skip pinned slots, give recently used ones a second chance.
+ * A dirty victim is written out first, under the shard lock.
+ */
+static
+int32_t bcache_evict(struct e2img *fs, struct e2img_bcache_shard *sh, size_t nslots)
+{
+	struct e2img_bcache *bc = &fs->bcache;
+
+	for (size_t n = 0; n < 2 * nslots; ++n) {
+		int32_t idx = sh->hand;
+		struct e2img_bhead *b = &sh->bh[idx];
+		sh->hand = (sh->hand + 1) % nslots;
+
+		if (b->refcnt)
+			continue;
+		if (b->flags & BH_REF) {
+			b->flags &= ~BH_REF;
+			continue;
+		}
+		if (b->flags & BH_DIRTY) {
+			void *data = bcache_slot_data(bc, sh, idx);
+			if (e2img_blk_writev(fs, b->blkno, &data, 1) < 0)
+				continue;
+			b->flags &= ~BH_DIRTY;
+		}
+		if (b->flags & BH_VALID) {
+			bcache_hash_remove(sh, idx);
+			sh->stats.evictions++;
+		}
+		return idx;
+	}
+	return -1;
+}
+
+void e2img_bcache_init(struct e2img_bcache *bc, size_t blk_sz, size_t mem)
+{
+	size_t nslots = mem / blk_sz / E2IMG_CACHE_SHARDS;
+	if (nslots < BCACHE_MIN_SLOTS)
+		nslots = BCACHE_MIN_SLOTS;
+	release_assert(nslots <= INT32_MAX);
+
+	size_t hsize = 1;
+	while (hsize < 2 * nslots)
+		hsize <<= 1;
+
+	bc->blk_sz = blk_sz;
+	bc->nslots = nslots;
+	bc->arena = xmemalign(blk_sz, E2IMG_CACHE_SHARDS * nslots * blk_sz);
+	bc->bh = xmalloc(sizeof(*bc->bh) * E2IMG_CACHE_SHARDS * nslots);
+
+	for (size_t i = 0; i < E2IMG_CACHE_SHARDS * nslots; ++i) {
+		bc->bh[i].blkno = 0;
+		bc->bh[i].refcnt = 0;
+		bc->bh[i].flags = 0;
+		bc->bh[i].hnext = -1;
+	}
+
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_bcache_shard *sh = &bc->shards[s];
+		sh->bh = bc->bh + s * nslots;
+		sh->htab = xmalloc(sizeof(*sh->htab) * hsize);
+		for (size_t i = 0; i < hsize; ++i)
+			sh->htab[i] = -1;
+		sh->hmask = hsize - 1;
+		sh->hand = 0;
+		memset(&sh->stats, 0, sizeof(sh->stats));
+		pthread_mutex_init(&sh->lock, NULL);
+		pthread_cond_init(&sh->wait, NULL);
+	}
+}
+
+void e2img_bcache_destroy(struct e2img_bcache *bc)
+{
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_bcache_shard *sh = &bc->shards[s];
+		pthread_cond_destroy(&sh->wait);
+		pthread_mutex_destroy(&sh->lock);
+		free(sh->htab);
+	}
+	free(bc->bh);
+	free(bc->arena);
+}
+
+/* All slots pinned: serve the block from a private buffer */
+static
+int bcache_access_uncached(struct e2img *fs, blk64_t blkno, void **blk)
+{
+	ssize_t rc;
+	*blk = xmemalign(fs->blk_sz, fs->blk_sz);
+	if ((rc = e2img_blk_read(fs, *blk, 1, blkno)) < 0)
+		goto errout;
+	return 0;
+errout:
+	free(*blk);
+	*blk = NULL;
+	return rc;
+}
+
+int e2img_bcache_access(struct e2img *fs, blk64_t blkno, void **blk)
+{
+	ssize_t rc;
+	int32_t idx;
+	struct e2img_bcache *bc = &fs->bcache;
+	struct e2img_bcache_shard *sh = bcache_shard(bc, blkno);
+	struct e2img_bhead *b;
+
+	*blk = NULL;
+	if (fs->map) {
+		if (!(*blk = e2img_map_block(fs, blkno)))
+			return -EIO;
+		return 0;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+retry:
+	if ((idx = bcache_lookup(sh, blkno)) >= 0) {
+		b = &sh->bh[idx];
+		b->refcnt++;
+		b->flags |= BH_REF;
+		while (b->flags & BH_LOADING)
+			pthread_cond_wait(&sh->wait, &sh->lock);
+		if (!(b->flags & BH_VALID)) {
+			/* loader failed, try ourselves */
+			b->refcnt--;
+			goto retry;
+		}
+		sh->stats.hits++;
+		pthread_mutex_unlock(&sh->lock);
+		*blk = bcache_slot_data(bc, sh, idx);
+		return 0;
+	}
+
+	sh->stats.misses++;
+	if ((idx = bcache_evict(fs, sh, bc->nslots)) < 0) {
+		sh->stats.uncached++;
+		pthread_mutex_unlock(&sh->lock);
+		return bcache_access_uncached(fs, blkno, blk);
+	}
+	b = &sh->bh[idx];
+	b->blkno = blkno;
+	b->refcnt = 1;
+	b->flags = BH_LOADING | BH_REF;
+	bcache_hash_insert(sh, idx);
+	pthread_mutex_unlock(&sh->lock);
+
+	rc = e2img_blk_read(fs, bcache_slot_data(bc, sh, idx), 1, blkno);
+
+	pthread_mutex_lock(&sh->lock);
+	if (rc < 0) {
+		bcache_hash_remove(sh, idx);
+		b->refcnt--;
+		b->flags = 0;
+	} else {
+		b->flags = BH_VALID | BH_REF;
+	}
+	pthread_cond_broadcast(&sh->wait);
+	pthread_mutex_unlock(&sh->lock);
+
+	if (rc < 0)
+		return rc;
+	*blk = bcache_slot_data(bc, sh, idx);
+	return 0;
+}
+
+static inline
+int bcache_in_arena(struct e2img_bcache *bc, void *blk)
+{
+	uintptr_t off = (uintptr_t) blk - (uintptr_t) bc->arena;
+	return (uintptr_t) blk >= (uintptr_t) bc->arena &&
+		off < E2IMG_CACHE_SHARDS * bc->nslots * bc->blk_sz;
+}
+
+static
+struct e2img_bhead *bcache_head(struct e2img_bcache *bc, void *blk,
+		struct e2img_bcache_shard **shp)
+{
+	uintptr_t off = (uintptr_t) blk - (uintptr_t) bc->arena;
+	release_assert(off % bc->blk_sz == 0);
+
+	size_t gidx = off / bc->blk_sz;
+	*shp = &bc->shards[gidx / bc->nslots];
+	return &(*shp)->bh[gidx % bc->nslots];
+}
+
+int e2img_bcache_release(struct e2img *fs, void *blk)
+{
+	struct e2img_bcache *bc = &fs->bcache;
+	struct e2img_bcache_shard *sh;
+
+	if (fs->map && (uintptr_t) blk - (uintptr_t) fs->map < fs->map_sz)
+		return 0;
+	if (!bcache_in_arena(bc, blk)) {
+		free(blk);
+		return 0;
+	}
+
+	struct e2img_bhead *b = bcache_head(bc, blk, &sh);
+	pthread_mutex_lock(&sh->lock);
+	release_assert(b->refcnt);
+	b->refcnt--;
+	pthread_mutex_unlock(&sh->lock);
+	return 0;
+}
+
+/*
+ * Marks a block obtained by e2img_bcache_access as modified, the caller
+ * still holds it. Blocks served outside the cache are written through.
+ */
+int e2img_bcache_dirty(struct e2img *fs, blk64_t blkno, void *blk)
+{
+	struct e2img_bcache *bc = &fs->bcache;
+	struct e2img_bcache_shard *sh;
+
+	if (!fs->writable)
+		return -EROFS;
+	if (!bcache_in_arena(bc, blk))
+		return e2img_blk_writev(fs, blkno, &blk, 1);
+
+	struct e2img_bhead *b = bcache_head(bc, blk, &sh);
+	pthread_mutex_lock(&sh->lock);
+	release_assert(b->refcnt && b->blkno == blkno);
+	b->flags |= BH_DIRTY;
+	pthread_mutex_unlock(&sh->lock);
+	return 0;
+}
+
+/*
+ * Forgets cached copies of freed blocks, so a stale dirty one is not
+ * written over the block's next user.
+ */
+void e2img_bcache_discard(struct e2img *fs, blk64_t blkno, blk_t n)
+{
+	struct e2img_bcache *bc = &fs->bcache;
+
+	if (fs->map)
+		return;
+	for (blk64_t i = blkno; i < blkno + n; ++i) {
+		int32_t idx;
+		struct e2img_bcache_shard *sh = bcache_shard(bc, i);
+
+		pthread_mutex_lock(&sh->lock);
+		if ((idx = bcache_lookup(sh, i)) >= 0) {
+			struct e2img_bhead *b = &sh->bh[idx];
+			b->flags &= ~BH_DIRTY;
+			if (!b->refcnt && (b->flags & BH_VALID)) {
+				bcache_hash_remove(sh, idx);
+				b->flags = 0;
+			}
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
+
+struct bcache_wb {
+	blk64_t			blkno;
+	struct e2img_bhead	*b;
+	void			*data;
+};
+
+static
+int bcache_wb_cmp(void const *a, void const *b)
+{
+	blk64_t x = ((struct bcache_wb const *) a)->blkno;
+	blk64_t y = ((struct bcache_wb const *) b)->blkno;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Writes every dirty block back, sorted by block number, runs of adjacent
+ * blocks go out as one pwritev. Blocks are pinned while being written.
+ */
+int e2img_bcache_flush(struct e2img *fs)
+{
+	int rc = 0;
+	struct e2img_bcache *bc = &fs->bcache;
+	size_t n = 0, cap = 64;
+	struct bcache_wb *wb = xmalloc(sizeof(*wb) * cap);
+
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_bcache_shard *sh = &bc->shards[s];
+		pthread_mutex_lock(&sh->lock);
+		for (size_t i = 0; i < bc->nslots; ++i) {
+			struct e2img_bhead *b = &sh->bh[i];
+			if (!(b->flags & BH_DIRTY))
+				continue;
+			if (n == cap) {
+				cap *= 2;
+				wb = realloc(wb, sizeof(*wb) * cap);
+				release_assert(wb);
+			}
+			b->refcnt++;
+			b->flags &= ~BH_DIRTY;
+			wb[n++] = (struct bcache_wb) {
+				.blkno = b->blkno,
+				.b = b,
+				.data = bcache_slot_data(bc, sh, i),
+			};
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	qsort(wb, n, sizeof(*wb), bcache_wb_cmp);
+
+	void **run = xmalloc(sizeof(*run) * (n ? n : 1));
+	for (size_t i = 0; i < n;) {
+		size_t j = i;
+		while (j < n && wb[j].blkno == wb[i].blkno + (j - i)) {
+			run[j - i] = wb[j].data;
+			j++;
+		}
+		if (!rc)
+			rc = e2img_blk_writev(fs, wb[i].blkno, run, j - i);
+		i = j;
+	}
+	free(run);
+
+	for (size_t i = 0; i < n; ++i) {
+		struct e2img_bcache_shard *sh;
+		bcache_head(bc, wb[i].data, &sh);
+		pthread_mutex_lock(&sh->lock);
+		if (rc < 0)
+			wb[i].b->flags |= BH_DIRTY;
+		wb[i].b->refcnt--;
+		pthread_mutex_unlock(&sh->lock);
+	}
+	free(wb);
+	return rc;
+}
+
+void e2img_bcache_get_stats(struct e2img *fs, struct e2img_bcache_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_bcache_shard *sh = &fs->bcache.shards[s];
+		pthread_mutex_lock(&sh->lock);
+		st->hits += sh->stats.hits;
+		st->misses += sh->stats.misses;
+		st->evictions += sh->stats.evictions;
+		st->uncached += sh->stats.uncached;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
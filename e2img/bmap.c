@@ -0,0 +1,335 @@
+#define _GNU_SOURCE
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "e2img.h"
+#include "common.h"
+
+struct bmap_builder {
+	struct e2img		*fs;
+	struct e2img_bmap	*map;
+	size_t			cap;
+	uint64_t		nblocks;	/* file size in blocks */
+};
+
+static
+void bmap_push(struct bmap_builder *b, uint64_t lblk, blk64_t pblk, uint64_t len)
+{
+	if (lblk >= b->nblocks)
+		return;
+	len = min(len, b->nblocks - lblk);
+
+	if (b->map->len) {
+		struct e2img_extent *last = &b->map->ext[b->map->len - 1];
+		if (last->lblk + last->len == lblk &&
+				((!last->pblk && !pblk) ||
+				 (last->pblk && last->pblk + last->len == pblk))) {
+			last->len += len;
+			return;
+		}
+	}
+	if (b->map->len == b->cap) {
+		b->cap *= 2;
+		b->map = realloc(b->map, sizeof(*b->map) + sizeof(b->map->ext[0]) * b->cap);
+		release_assert(b->map);
+	}
+	b->map->ext[b->map->len++] = (struct e2img_extent) {
+		.lblk = lblk,
+		.pblk = pblk,
+		.len = len,
+	};
+}
+
+static inline
+uint64_t bmap_end(struct bmap_builder *b)
+{
+	if (!b->map->len)
+		return 0;
+	struct e2img_extent *last = &b->map->ext[b->map->len - 1];
+	return last->lblk + last->len;
+}
+
+/* Unmapped gaps before lblk become explicit holes */
+static
+void bmap_append(struct bmap_builder *b, uint64_t lblk, blk64_t pblk, uint64_t len)
+{
+	uint64_t end = bmap_end(b);
+	if (lblk > end)
+		bmap_push(b, end, 0, lblk - end);
+	bmap_push(b, lblk, pblk, len);
+}
+
+/* Walk an indirect tree of the given depth, depth 0 is a data block */
+static
+int bmap_walk_indir(struct bmap_builder *b, blk_t no, int depth,
+		uint64_t lblk, uint64_t span)
+{
+	int rc = 0;
+	void *blk;
+	blk_t per_blk = EXT2_ADDR_PER_BLOCK(b->fs->sb);
+
+	if (lblk >= b->nblocks)
+		return 0;
+	if (!no || !depth) {
+		bmap_append(b, lblk, no, no ? 1 : span);
+		return 0;
+	}
+	if ((rc = e2img_bcache_access(b->fs, no, &blk)) < 0)
+		return rc;
+
+	uint64_t sub_span = span / per_blk;
+	for (blk_t i = 0; i < per_blk && lblk < b->nblocks; ++i) {
+		if ((rc = bmap_walk_indir(b, ((blk_t *) blk)[i], depth - 1,
+				lblk, sub_span)) < 0)
+			break;
+		lblk += sub_span;
+	}
+	e2img_bcache_release(b->fs, blk);
+	return rc;
+}
+
+#define BMAP_EXT_MAX_DEPTH 5
+
+/* eh points into a buffer of size bytes, depth is what the parent expects */
+static
+int bmap_walk_extents(struct bmap_builder *b, struct ext3_extent_header *eh,
+		size_t size, int depth)
+{
+	int rc = 0;
+
+	if (eh->eh_magic != EXT3_EXT_MAGIC || eh->eh_entries > eh->eh_max ||
+			sizeof(*eh) + eh->eh_max * sizeof(struct ext3_extent) > size ||
+			eh->eh_depth != depth)
+		return -EIO;
+
+	if (!depth) {
+		struct ext3_extent *ex = (struct ext3_extent *) (eh + 1);
+		for (int i = 0; i < eh->eh_entries; ++i) {
+			uint64_t len = ex[i].ee_len;
+			blk64_t pblk = ex[i].ee_start | (blk64_t) ex[i].ee_start_hi << 32;
+			if (ex[i].ee_block < bmap_end(b))
+				return -EIO;
+			/* uninitialized: allocated but reads as zeros */
+			if (len > EXT_INIT_MAX_LEN) {
+				len -= EXT_INIT_MAX_LEN;
+				pblk = 0;
+			}
+			bmap_append(b, ex[i].ee_block, pblk, len);
+		}
+		return 0;
+	}
+
+	struct ext3_extent_idx *ix = (struct ext3_extent_idx *) (eh + 1);
+	for (int i = 0; i < eh->eh_entries && ix[i].ei_block < b->nblocks; ++i) {
+		void *blk;
+		blk64_t leaf = ix[i].ei_leaf | (blk64_t) ix[i].ei_leaf_hi << 32;
+		if ((rc = e2img_bcache_access(b->fs, leaf, &blk)) < 0)
+			return rc;
+		rc = bmap_walk_extents(b, blk, b->fs->blk_sz, depth - 1);
+		e2img_bcache_release(b->fs, blk);
+		if (rc < 0)
+			return rc;
+	}
+	return 0;
+}
+
+static
+int bmap_build_extents(struct bmap_builder *b, struct ext2_inode *inode)
+{
+	struct ext3_extent_header *eh = (struct ext3_extent_header *) inode->i_block;
+
+	if (eh->eh_depth > BMAP_EXT_MAX_DEPTH)
+		return -EIO;
+	return bmap_walk_extents(b, eh, sizeof(inode->i_block), eh->eh_depth);
+}
+
+static
+int bmap_build_indir(struct bmap_builder *b, struct ext2_inode *inode)
+{
+	int rc = 0;
+	blk_t per_blk = EXT2_ADDR_PER_BLOCK(b->fs->sb);
+
+	uint64_t lblk = 0;
+	for (int i = 0; i < EXT2_NDIR_BLOCKS; ++i)
+		bmap_append(b, lblk++, inode->i_block[i], 1);
+
+	uint64_t span = per_blk;
+	for (int depth = 1; depth <= 3; ++depth) {
+		blk_t no = inode->i_block[EXT2_IND_BLOCK + depth - 1];
+		if ((rc = bmap_walk_indir(b, no, depth, lblk, span)) < 0)
+			break;
+		lblk += span;
+		span *= per_blk;
+	}
+	return rc;
+}
+
+static
+int bmap_build(struct e2img *fs, struct ext2_inode *inode, struct e2img_bmap **map)
+{
+	int rc;
+	struct bmap_builder b = {
+		.fs = fs,
+		.cap = 16,
+		.nblocks = div_rup(EXT2_I_SIZE(inode), fs->blk_sz),
+	};
+	b.map = xmalloc(sizeof(*b.map) + sizeof(b.map->ext[0]) * b.cap);
+	b.map->len = 0;
+
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		rc = bmap_build_extents(&b, inode);
+	else
+		rc = bmap_build_indir(&b, inode);
+
+	if (rc < 0) {
+		free(b.map);
+		return rc;
+	}
+	/* trailing hole up to i_size */
+	uint64_t end = bmap_end(&b);
+	if (end < b.nblocks)
+		bmap_push(&b, end, 0, b.nblocks - end);
+	/* kept for the inode's lifetime and charged to the icache, trim it */
+	if (b.map->len < b.cap) {
+		struct e2img_bmap *fit = realloc(b.map,
+				sizeof(*b.map) + sizeof(b.map->ext[0]) * b.map->len);
+		if (fit)
+			b.map = fit;
+	}
+	*map = b.map;
+	return 0;
+}
+
+/* The map is immutable once published, readers need no lock */
+static
+int bmap_get(struct e2img *fs, struct e2img_inode *ip, struct e2img_bmap **mapp)
+{
+	int rc;
+	struct e2img_bmap *map, *old = NULL;
+
+	if ((*mapp = __atomic_load_n(&ip->bmap, __ATOMIC_ACQUIRE)))
+		return 0;
+	if ((rc = bmap_build(fs, &ip->i, &map)) < 0)
+		return rc;
+
+	if (!__atomic_compare_exchange_n(&ip->bmap, &old, map, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(map);
+		map = old;
+	} else {
+		e2img_icache_charge(fs, ip);
+	}
+	*mapp = map;
+	return 0;
+}
+
+/* -EOPNOTSUPP for inline data, there are no blocks to map */
+int e2img_inode_map(struct e2img *fs, struct e2img_inode *ip, blk_t lblk,
+		struct e2img_extent *ext)
+{
+	int rc;
+	struct e2img_bmap *map;
+	if (ip->idata)
+		return -EOPNOTSUPP;
+	if ((rc = bmap_get(fs, ip, &map)) < 0)
+		return rc;
+
+	size_t lo = 0, hi = map->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (map->ext[mid].lblk + map->ext[mid].len <= lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == map->len || map->ext[lo].lblk > lblk) {
+		ext->lblk = lblk;
+		ext->pblk = 0;
+		ext->len = 0;
+		return 0;
+	}
+
+	struct e2img_extent *e = &map->ext[lo];
+	blk_t skip = lblk - e->lblk;
+	ext->lblk = lblk;
+	ext->pblk = e->pblk ? e->pblk + skip : 0;
+	ext->len = e->len - skip;
+	return 0;
+}
+
+/* One pread per physical run, straight into the caller's buffer */
+ssize_t e2img_file_read(struct e2img *fs, struct e2img_inode *ip,
+		void *buf, size_t size, ext2_off64_t off)
+{
+	ssize_t rc;
+	ext2_off64_t fsize = EXT2_I_SIZE(&ip->i);
+	size_t done = 0;
+
+	if (off >= fsize)
+		return 0;
+	size = min(size, fsize - off);
+
+	if (ip->idata) {
+		if (off + size > ip->idata_len)
+			return -EIO;
+		memcpy(buf, ip->idata + off, size);
+		return size;
+	}
+	while (done < size) {
+		struct e2img_extent ext;
+		ext2_off64_t pos = off + done;
+		size_t boff = pos % fs->blk_sz;
+
+		if ((rc = e2img_inode_map(fs, ip, pos / fs->blk_sz, &ext)) < 0)
+			return rc;
+		if (!ext.len)
+			return -EIO;
+
+		size_t len = min((size_t) ext.len * fs->blk_sz - boff, size - done);
+		if (!ext.pblk) {
+			memset(ptr_add(buf, done), 0, len);
+			done += len;
+			continue;
+		}
+		off_t poff = (off_t) ext.pblk * fs->blk_sz + boff;
+		if ((rc = e2img_pread(fs, ptr_add(buf, done), len, poff)) < 0)
+			return rc;
+		done += len;
+	}
+	e2img_wbuf_overlay(ip, fs->blk_sz, buf, done, off);
+	return done;
+}
+
+/*
+ * SEEK_DATA / SEEK_HOLE from the block map, no data is read. Unwritten
+ * extents count as holes, there is an implicit hole at i_size.
+ */
+off_t e2img_lseek(struct e2img *fs, struct e2img_inode *ip, off_t off, int whence)
+{
+	int rc;
+	ext2_off64_t fsize = EXT2_I_SIZE(&ip->i);
+	uint64_t nblocks = div_rup(fsize, fs->blk_sz);
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;
+	if (off < 0 || (ext2_off64_t) off >= fsize)
+		return -ENXIO;
+	/* inline data and delayed writes are not in a map, report it all as data */
+	if (ip->idata || (ip->wb && ip->wb->len))
+		return whence == SEEK_HOLE ? (off_t) fsize : off;
+
+	for (uint64_t lblk = off / fs->blk_sz; lblk < nblocks;) {
+		struct e2img_extent ext;
+		if ((rc = e2img_inode_map(fs, ip, lblk, &ext)) < 0)
+			return rc;
+		if (!ext.len)
+			break;
+		if (!ext.pblk == (whence == SEEK_HOLE))
+			return max((off_t) (lblk * fs->blk_sz), off);
+		lblk += ext.len;
+	}
+	return whence == SEEK_HOLE ? (off_t) fsize : -ENXIO;
+}
@@ -0,0 +1,260 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "e2img.h"
+#include "common.h"
+
+#define DCACHE_MIN_MEM (64 << 10)
+
+/*
+ * (parent, name) -> ino, ino == 0 is a negative entry.
+ * Whole paths are kept under parent 0, which is never a valid inode. Any
+ * namespace change may affect any path, those are dropped wholesale by
+ * bumping path_gen.
+ */
+struct e2img_dentry {
+	struct e2img_dlink	lru;
+	struct e2img_dentry	*hnext;
+	uint32_t		hash;
+	unsigned		gen;
+	ext2_ino_t		parent;
+	ext2_ino_t		ino;
+	size_t			len;
+	char			name[];
+};
+
+static inline
+size_t dentry_mem(size_t len)
+{
+	return sizeof(struct e2img_dentry) + len;
+}
+
+static inline
+uint32_t dcache_hash(ext2_ino_t parent, char const *name, size_t len)
+{
+	uint32_t h = 2166136261u ^ parent;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (uint8_t) name[i]) * 16777619u;
+	return h;
+}
+
+static inline
+struct e2img_dcache_shard *dcache_shard(struct e2img_dcache *dc, uint32_t hash)
+{
+	return &dc->shards[(hash >> 24) % E2IMG_CACHE_SHARDS];
+}
+
+static inline
+struct e2img_dentry *dentry_of(struct e2img_dlink *l)
+{
+	return container_of(l, struct e2img_dentry, lru);
+}
+
+static inline
+void dcache_lru_del(struct e2img_dentry *de)
+{
+	de->lru.prev->next = de->lru.next;
+	de->lru.next->prev = de->lru.prev;
+}
+
+static inline
+void dcache_lru_add(struct e2img_dcache_shard *dc, struct e2img_dentry *de)
+{
+	de->lru.next = dc->lru.next;
+	de->lru.prev = &dc->lru;
+	dc->lru.next->prev = &de->lru;
+	dc->lru.next = &de->lru;
+}
+
+static
+struct e2img_dentry **dcache_find(struct e2img_dcache_shard *dc, uint32_t hash,
+		ext2_ino_t parent, char const *name, size_t len)
+{
+	struct e2img_dentry **pos = &dc->htab[hash & dc->hmask];
+	for (; *pos; pos = &(*pos)->hnext) {
+		struct e2img_dentry *de = *pos;
+		if (de->hash == hash && de->parent == parent && de->len == len &&
+				!memcmp(de->name, name, len))
+			break;
+	}
+	return pos;
+}
+
+static
+void dcache_remove(struct e2img_dcache_shard *dc, struct e2img_dentry **pos)
+{
+	struct e2img_dentry *de = *pos;
+	*pos = de->hnext;
+	dcache_lru_del(de);
+	dc->mem -= dentry_mem(de->len);
+	free(de);
+}
+
+static
+void dcache_shrink(struct e2img_dcache_shard *dc)
+{
+	while (dc->mem > dc->max_mem && dc->lru.prev != &dc->lru) {
+		struct e2img_dentry *de = dentry_of(dc->lru.prev);
+		struct e2img_dentry **pos = dcache_find(dc, de->hash,
+				de->parent, de->name, de->len);
+		release_assert(*pos == de);
+		dcache_remove(dc, pos);
+		dc->stats.evictions++;
+	}
+}
+
+void e2img_dcache_init(struct e2img_dcache *dcache, size_t mem)
+{
+	mem /= E2IMG_CACHE_SHARDS;
+	if (mem < DCACHE_MIN_MEM)
+		mem = DCACHE_MIN_MEM;
+
+	size_t hsize = 1;
+	while (hsize < mem / dentry_mem(16))
+		hsize <<= 1;
+
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_dcache_shard *dc = &dcache->shards[s];
+		dc->htab = xmalloc(sizeof(*dc->htab) * hsize);
+		for (size_t i = 0; i < hsize; ++i)
+			dc->htab[i] = NULL;
+		dc->hmask = hsize - 1;
+		dc->mem = 0;
+		dc->max_mem = mem;
+		dc->lru.prev = dc->lru.next = &dc->lru;
+		memset(&dc->stats, 0, sizeof(dc->stats));
+		pthread_mutex_init(&dc->lock, NULL);
+	}
+	dcache->path_gen = 0;
+}
+
+void e2img_dcache_destroy(struct e2img_dcache *dcache)
+{
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_dcache_shard *dc = &dcache->shards[s];
+		struct e2img_dlink *l = dc->lru.next;
+		while (l != &dc->lru) {
+			struct e2img_dlink *next = l->next;
+			free(dentry_of(l));
+			l = next;
+		}
+		free(dc->htab);
+		pthread_mutex_destroy(&dc->lock);
+	}
+}
+
+/* Returns 1 and sets *ino (0 for negative entry) on hit, 0 on miss */
+int e2img_dcache_lookup(struct e2img_dcache *dcache, ext2_ino_t parent,
+		char const *name, size_t len, ext2_ino_t *ino)
+{
+	uint32_t hash = dcache_hash(parent, name, len);
+	struct e2img_dcache_shard *dc = dcache_shard(dcache, hash);
+	struct e2img_dentry **pos, *de;
+
+	pthread_mutex_lock(&dc->lock);
+	pos = dcache_find(dc, hash, parent, name, len);
+	if ((de = *pos) && !parent &&
+			de->gen != __atomic_load_n(&dcache->path_gen, __ATOMIC_RELAXED)) {
+		dcache_remove(dc, pos);
+		de = NULL;
+	}
+	if (!de) {
+		dc->stats.misses++;
+		pthread_mutex_unlock(&dc->lock);
+		return 0;
+	}
+	dcache_lru_del(de);
+	dcache_lru_add(dc, de);
+	if (de->ino)
+		dc->stats.hits++;
+	else
+		dc->stats.neg_hits++;
+	*ino = de->ino;
+	pthread_mutex_unlock(&dc->lock);
+	return 1;
+}
+
+void e2img_dcache_insert(struct e2img_dcache *dcache, ext2_ino_t parent,
+		char const *name, size_t len, ext2_ino_t ino)
+{
+	uint32_t hash = dcache_hash(parent, name, len);
+	struct e2img_dcache_shard *dc = dcache_shard(dcache, hash);
+	struct e2img_dentry **pos, *de;
+
+	if (dentry_mem(len) > dc->max_mem / 16)
+		return;
+
+	de = xmalloc(dentry_mem(len));
+	de->hash = hash;
+	de->gen = __atomic_load_n(&dcache->path_gen, __ATOMIC_RELAXED);
+	de->parent = parent;
+	de->ino = ino;
+	de->len = len;
+	memcpy(de->name, name, len);
+
+	pthread_mutex_lock(&dc->lock);
+	if (*(pos = dcache_find(dc, hash, parent, name, len))) {
+		(*pos)->ino = ino;
+		(*pos)->gen = de->gen;
+		pthread_mutex_unlock(&dc->lock);
+		free(de);
+		return;
+	}
+	de->hnext = NULL;
+	*pos = de;
+	dcache_lru_add(dc, de);
+	dc->mem += dentry_mem(len);
+	dcache_shrink(dc);
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/* After (parent, name) was created or removed */
+void e2img_dcache_invalidate(struct e2img_dcache *dcache, ext2_ino_t parent,
+		char const *name, size_t len)
+{
+	uint32_t hash = dcache_hash(parent, name, len);
+	struct e2img_dcache_shard *dc = dcache_shard(dcache, hash);
+	struct e2img_dentry **pos;
+
+	pthread_mutex_lock(&dc->lock);
+	if (*(pos = dcache_find(dc, hash, parent, name, len)))
+		dcache_remove(dc, pos);
+	pthread_mutex_unlock(&dc->lock);
+	__atomic_fetch_add(&dcache->path_gen, 1, __ATOMIC_RELAXED);
+}
+
+/* After directory parent was removed, its inode number may come back */
+void e2img_dcache_invalidate_dir(struct e2img_dcache *dcache, ext2_ino_t parent)
+{
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_dcache_shard *dc = &dcache->shards[s];
+		pthread_mutex_lock(&dc->lock);
+		for (size_t i = 0; i <= dc->hmask; ++i) {
+			struct e2img_dentry **pos = &dc->htab[i];
+			while (*pos) {
+				if ((*pos)->parent == parent)
+					dcache_remove(dc, pos);
+				else
+					pos = &(*pos)->hnext;
+			}
+		}
+		pthread_mutex_unlock(&dc->lock);
+	}
+	__atomic_fetch_add(&dcache->path_gen, 1, __ATOMIC_RELAXED);
+}
+
+void e2img_dcache_get_stats(struct e2img *fs, struct e2img_dcache_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_dcache_shard *dc = &fs->dcache.shards[s];
+		pthread_mutex_lock(&dc->lock);
+		st->hits += dc->stats.hits;
+		st->neg_hits += dc->stats.neg_hits;
+		st->misses += dc->stats.misses;
+		st->evictions += dc->stats.evictions;
+		pthread_mutex_unlock(&dc->lock);
+	}
+}
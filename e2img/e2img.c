@@ -1,23 +1,27 @@
+#define _GNU_SOURCE
 #include <ext2fs/ext2fs.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "e2img.h"
 #include "common.h"
 
 static
-ssize_t blk_read(int fd, size_t blk_sz, void *buf, size_t len, size_t off)
+ssize_t __pread(int fd, void *buf, size_t len, off_t off)
 {
-	ssize_t rc, orig;
-	len *= blk_sz;
-	off *= blk_sz;
-	orig = len;
+	ssize_t rc;
+	size_t orig = len;
 
 	while (len) {
 		if ((rc = pread(fd, buf, len, off)) < 0)
@@ -28,33 +32,139 @@ ssize_t blk_read(int fd, size_t blk_sz, void *buf, size_t len, size_t off)
 		off += rc;
 		buf = (uint8_t*) buf + rc;
 	}
-	return (orig - len) / blk_sz;
+	return orig - len;
 }
 
-ssize_t e2img_blk_read(struct e2img *fs, void *buf, blk_t len, blk_t off)
+static
+ssize_t blk_read(int fd, size_t blk_sz, void *buf, size_t len, blk64_t off)
 {
-	ssize_t rc = blk_read(fs->fd, fs->blk_sz, buf, len, off);
+	ssize_t rc = __pread(fd, buf, len * blk_sz, (off_t) (off * blk_sz));
+	return rc < 0 ? rc : rc / blk_sz;
+}
+
+/* Large copies out of the mapping get their pages faulted in ahead */
+#define E2IMG_MAP_WILLNEED_MIN (64 << 10)
+
+static
+ssize_t map_read(struct e2img *fs, void *buf, size_t len, off_t off)
+{
+	if (off < 0 || (size_t) off > fs->map_sz || len > fs->map_sz - off)
+		return -EIO;
+	if (len >= E2IMG_MAP_WILLNEED_MIN) {
+		size_t pg = sysconf(_SC_PAGESIZE);
+		size_t start = off & ~(pg - 1);
+		madvise(fs->map + start, off + len - start, MADV_WILLNEED);
+	}
+	memcpy(buf, fs->map + off, len);
+	return len;
+}
+
+/* One call moving bytes to or from the image, readers may be concurrent */
+void e2img_io_account(struct e2img *fs, int write, size_t bytes)
+{
+	struct e2img_io_stats *st = &fs->io_stats;
+	__atomic_add_fetch(write ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(write ? &st->write_bytes : &st->read_bytes, bytes,
+			__ATOMIC_RELAXED);
+}
+
+void e2img_io_get_stats(struct e2img *fs, struct e2img_io_stats *st)
+{
+	st->reads = __atomic_load_n(&fs->io_stats.reads, __ATOMIC_RELAXED);
+	st->read_bytes = __atomic_load_n(&fs->io_stats.read_bytes, __ATOMIC_RELAXED);
+	st->writes = __atomic_load_n(&fs->io_stats.writes, __ATOMIC_RELAXED);
+	st->write_bytes = __atomic_load_n(&fs->io_stats.write_bytes, __ATOMIC_RELAXED);
+}
+
+ssize_t e2img_pread(struct e2img *fs, void *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+	if (fs->map)
+		rc = map_read(fs, buf, len, off);
+	else
+		rc = __pread(fs->fd, buf, len, off);
+	if (!(rc < 0))
+		e2img_io_account(fs, 0, rc);
 	if (!(rc < 0) && rc != len)
 		rc = -EIO;
 	return rc;
 }
 
-/* dummy buffer cache */
-int e2img_bcache_access(struct e2img *fs, blk_t blkno, void **blk)
+ssize_t e2img_blk_read(struct e2img *fs, void *buf, blk_t len, blk64_t off)
 {
 	ssize_t rc;
-	*blk = xmemalign(fs->blk_sz, fs->blk_sz);
-	if ((rc = e2img_blk_read(fs, *blk, 1, blkno)) < 0)
-		goto errout;
-	return 0;
-errout:
-	free(*blk);
+	if (fs->map) {
+		rc = map_read(fs, buf, (size_t) len * fs->blk_sz, off * fs->blk_sz);
+		if (!(rc < 0))
+			e2img_io_account(fs, 0, rc);
+		return rc < 0 ? rc : len;
+	}
+	rc = blk_read(fs->fd, fs->blk_sz, buf, len, off);
+	if (!(rc < 0))
+		e2img_io_account(fs, 0, rc * fs->blk_sz);
+	if (!(rc < 0) && rc != len)
+		rc = -EIO;
 	return rc;
 }
 
-int e2img_bcache_release(struct e2img *fs, void *blk)
+/* Writes n consecutive blocks starting at blkno from separate buffers */
+int e2img_blk_writev(struct e2img *fs, blk64_t blkno, void * const *blks, size_t n)
 {
-	free(blk);
+	struct iovec iov[IOV_MAX];
+
+	while (n) {
+		int cnt = min(n, (size_t) IOV_MAX);
+		for (int i = 0; i < cnt; ++i) {
+			iov[i].iov_base = blks[i];
+			iov[i].iov_len = fs->blk_sz;
+		}
+		off_t off = (off_t) blkno * fs->blk_sz;
+		struct iovec *v = iov;
+		e2img_io_account(fs, 1, (size_t) cnt * fs->blk_sz);
+		for (int left = cnt; left;) {
+			ssize_t rc = pwritev(fs->fd, v, left, off);
+			if (rc < 0 && errno == EINTR)
+				continue;
+			if (rc < 0)
+				return -errno;
+			if (!rc)
+				return -EIO;
+			off += rc;
+			for (; left && (size_t) rc >= v->iov_len; --left)
+				rc -= (v++)->iov_len;
+			if (rc) {
+				v->iov_base = ptr_add(v->iov_base, rc);
+				v->iov_len -= rc;
+			}
+		}
+		blkno += cnt;
+		blks += cnt;
+		n -= cnt;
+	}
+	return 0;
+}
+
+/* Address of a block inside the mapping, NULL if it is past the image end */
+void *e2img_map_block(struct e2img *fs, blk64_t blkno)
+{
+	if (blkno >= fs->map_sz / fs->blk_sz)
+		return NULL;
+	return fs->map + blkno * fs->blk_sz;
+}
+
+static
+int __init_map(struct e2img *fs, struct stat const *st)
+{
+	if ((uint64_t) st->st_size > SIZE_MAX)
+		return -EFBIG;
+	fs->map_sz = st->st_size;
+	fs->map = mmap(NULL, fs->map_sz, PROT_READ, MAP_SHARED, fs->fd, 0);
+	if (fs->map == MAP_FAILED) {
+		fs->map = NULL;
+		return -errno;
+	}
+	/* metadata lookups jump around, no point in readahead */
+	madvise(fs->map, fs->map_sz, MADV_RANDOM);
 	return 0;
 }
 
@@ -68,8 +178,10 @@ int __init_super_block(struct e2img *fs)
 
 	buf = xmemalign(fs->blk_sz, blen * fs->blk_sz);
 
-	if (blk_read(fs->fd, fs->blk_sz, buf, blen, boff) != blen)
+	if (blk_read(fs->fd, fs->blk_sz, buf, blen, boff) != blen) {
+		free(buf);
 		return -EIO;
+	}
 
 	fs->sb = xmalloc(sizeof(*fs->sb));
 
@@ -80,72 +192,278 @@ int __init_super_block(struct e2img *fs)
 	return 0;
 }
 
+static
+int group_has_super(struct ext2_super_block *sb, dgrp_t grp)
+{
+	if (grp <= 1 || !(sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return 1;
+	if (!(grp & 1))
+		return 0;
+	for (dgrp_t base = 3; base <= 7; base += 2) {
+		uint64_t p = base;
+		while (p < grp)
+			p *= base;
+		if (p == grp)
+			return 1;
+	}
+	return 0;
+}
+
+/* With meta_bg, descriptor block i lives in the first group it describes */
+static
+blk64_t desc_block_loc(struct e2img *fs, blk64_t i)
+{
+	struct ext2_super_block *sb = fs->sb;
+
+	if (!(sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG) ||
+			i < sb->s_first_meta_bg)
+		return sb->s_first_data_block + 1 + i;
+
+	dgrp_t grp = i * EXT2_DESC_PER_BLOCK(sb);
+	return sb->s_first_data_block + (blk64_t) grp * EXT2_BLOCKS_PER_GROUP(sb) +
+		group_has_super(sb, grp);
+}
+
+static
+void decode_group_desc(struct e2img *fs, void const *raw, struct e2img_group *grp)
+{
+	struct ext4_group_desc const *gd = raw;
+
+	grp->block_bitmap = gd->bg_block_bitmap;
+	grp->inode_bitmap = gd->bg_inode_bitmap;
+	grp->inode_table = gd->bg_inode_table;
+	grp->free_blocks = gd->bg_free_blocks_count;
+	grp->free_inodes = gd->bg_free_inodes_count;
+	grp->used_dirs = gd->bg_used_dirs_count;
+	grp->itable_unused = gd->bg_itable_unused;
+	grp->flags = gd->bg_flags;
+
+	if (fs->desc_sz < EXT2_MIN_DESC_SIZE_64BIT)
+		return;
+	grp->block_bitmap |= (blk64_t) gd->bg_block_bitmap_hi << 32;
+	grp->inode_bitmap |= (blk64_t) gd->bg_inode_bitmap_hi << 32;
+	grp->inode_table |= (blk64_t) gd->bg_inode_table_hi << 32;
+	grp->free_blocks |= (uint32_t) gd->bg_free_blocks_count_hi << 16;
+	grp->free_inodes |= (uint32_t) gd->bg_free_inodes_count_hi << 16;
+	grp->used_dirs |= (uint32_t) gd->bg_used_dirs_count_hi << 16;
+	grp->itable_unused |= (uint32_t) gd->bg_itable_unused_hi << 16;
+}
+
+/* Only the counters change on a writable image */
+static
+void encode_group_counts(struct e2img *fs, struct e2img_group const *grp, void *raw)
+{
+	struct ext4_group_desc *gd = raw;
+
+	gd->bg_free_blocks_count = grp->free_blocks;
+	gd->bg_free_inodes_count = grp->free_inodes;
+	gd->bg_used_dirs_count = grp->used_dirs;
+	if (fs->desc_sz < EXT2_MIN_DESC_SIZE_64BIT)
+		return;
+	gd->bg_free_blocks_count_hi = grp->free_blocks >> 16;
+	gd->bg_free_inodes_count_hi = grp->free_inodes >> 16;
+	gd->bg_used_dirs_count_hi = grp->used_dirs >> 16;
+}
+
+static
+int __init_group_desc(struct e2img *fs)
+{
+	ssize_t rc;
+	struct ext2_super_block *sb = fs->sb;
+
+	fs->blocks_count = sb->s_blocks_count;
+	if (sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		fs->blocks_count |= (blk64_t) sb->s_blocks_count_hi << 32;
+
+	fs->desc_sz = EXT2_DESC_SIZE(sb);
+	if (fs->desc_sz < EXT2_MIN_DESC_SIZE || fs->desc_sz > EXT2_MAX_DESC_SIZE ||
+			(fs->desc_sz & (fs->desc_sz - 1)))
+		return -EINVAL;
+
+	fs->group_count = div_rup(fs->blocks_count - sb->s_first_data_block,
+			(blk64_t) EXT2_BLOCKS_PER_GROUP(sb));
+
+	blk64_t blen = div_rup((blk64_t) fs->group_count, EXT2_DESC_PER_BLOCK(sb));
+	uint8_t *buf = xmemalign(fs->blk_sz, blen * fs->blk_sz);
+
+	/* the classic layout is one contiguous table after the superblock */
+	blk64_t flat = blen;
+	if (sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)
+		flat = min(blen, (blk64_t) sb->s_first_meta_bg);
+
+	rc = 0;
+	if (flat)
+		rc = e2img_blk_read(fs, buf, flat, desc_block_loc(fs, 0));
+	for (blk64_t i = flat; i < blen && rc >= 0; ++i)
+		rc = e2img_blk_read(fs, buf + i * fs->blk_sz, 1, desc_block_loc(fs, i));
+	if (rc < 0) {
+		free(buf);
+		return rc;
+	}
+
+	fs->gd = xmalloc(sizeof(*fs->gd) * fs->group_count);
+	for (dgrp_t i = 0; i < fs->group_count; ++i)
+		decode_group_desc(fs, buf + (size_t) i * fs->desc_sz, &fs->gd[i]);
+	free(buf);
+	return 0;
+}
+
+const struct e2img_conf e2img_default_conf = {
+	.bcache_sz = 16 << 20,
+	.icache_sz = 4 << 20,
+	.dcache_sz = 4 << 20,
+	.backend = E2IMG_BACKEND_PREAD,
+	.ra_max_sz = 2 << 20,
+	.writable = 0,
+};
+
 int e2img_open(struct e2img *fs, char const *path)
+{
+	return e2img_open_conf(fs, path, &e2img_default_conf);
+}
+
+int e2img_open_conf(struct e2img *fs, char const *path, struct e2img_conf const *conf)
 {
 	int rc;
 	struct stat st;
 
-	if ((fs->fd = open(path, O_RDONLY)) < 0)
+	/* writes go through pwrite, the mapping is read-only */
+	if (conf->writable && conf->backend == E2IMG_BACKEND_MMAP)
+		return -EINVAL;
+	if ((fs->fd = open(path, conf->writable ? O_RDWR : O_RDONLY)) < 0)
 		return -errno;
 
-	if (fstat(fs->fd, &st) < 0)
-		return -errno;
+	fs->map = NULL;
+	fs->map_sz = 0;
+	fs->sb = NULL;
+	fs->gd = NULL;
 
+	if (fstat(fs->fd, &st) < 0) {
+		rc = -errno;
+		goto errout;
+	}
 	fs->blk_sz = st.st_blksize;
 
-	rc = __init_super_block(fs);
+	if (conf->backend == E2IMG_BACKEND_MMAP && (rc = __init_map(fs, &st)) < 0)
+		goto errout;
+
+	if ((rc = __init_super_block(fs)) < 0)
+		goto errout;
 	fs->blk_sz = EXT2_BLOCK_SIZE(fs->sb);
+	fs->ra_max = conf->ra_max_sz / fs->blk_sz;
+
+	/* needs_recovery, encrypt, largedir and the like */
+	if (fs->sb->s_feature_incompat & ~E2IMG_INCOMPAT_SUPPORTED) {
+		rc = -EOPNOTSUPP;
+		goto errout;
+	}
+
+	fs->writable = conf->writable;
+	if (fs->writable && ((fs->sb->s_feature_incompat & ~E2IMG_RW_INCOMPAT) ||
+			(fs->sb->s_feature_ro_compat & ~E2IMG_RW_RO_COMPAT))) {
+		rc = -EROFS;
+		goto errout;
+	}
 
-	release_assert(!(fs->sb->s_feature_incompat & ~E2IMG_INCOMPAT_SUPPORTED));
+	if ((rc = __init_group_desc(fs)) < 0)
+		goto errout;
+
+	fs->gd_dirty = fs->writable ? calloc(fs->group_count, 1) : NULL;
+	release_assert(!fs->writable || fs->gd_dirty);
+	fs->sb_dirty = 0;
+	fs->wb_list.prev = fs->wb_list.next = &fs->wb_list;
+	fs->wb_mem = 0;
+	memset(&fs->io_stats, 0, sizeof(fs->io_stats));
+	e2img_freemap_init(fs);
+
+	/* mapped blocks bypass the cache, keep only the minimal arena */
+	e2img_bcache_init(&fs->bcache, fs->blk_sz, fs->map ? 0 : conf->bcache_sz);
+	e2img_icache_init(&fs->icache, conf->icache_sz);
+	e2img_dcache_init(&fs->dcache, conf->dcache_sz);
+	return 0;
+
+errout:
+	free(fs->gd);
+	free(fs->sb);
+	if (fs->map)
+		munmap(fs->map, fs->map_sz);
+	close(fs->fd);
 	return rc;
 }
 
 int e2img_close(struct e2img *fs)
 {
+	int rc = 0;
+
+	if (fs->writable)
+		rc = e2img_sync(fs);
+	e2img_dcache_destroy(&fs->dcache);
+	e2img_icache_destroy(&fs->icache);
+	e2img_bcache_destroy(&fs->bcache);
+	e2img_freemap_destroy(fs);
+	free(fs->gd_dirty);
+	free(fs->gd);
 	free(fs->sb);
-	return close(fs->fd);
+	if (fs->map)
+		munmap(fs->map, fs->map_sz);
+	if (close(fs->fd) < 0 && !rc)
+		rc = -errno;
+	return rc;
 }
 
-int e2img_read_group(struct e2img *fs, dgrp_t grpno, struct ext2_group_desc *grp)
+int e2img_read_group(struct e2img *fs, dgrp_t grpno, struct e2img_group *grp)
 {
-	int rc;
-	void *blk;
-	blk_t desc_per_blk = EXT2_DESC_PER_BLOCK(fs->sb);
-	blk_t blkno = fs->sb->s_first_data_block + 1 + grpno / desc_per_blk;
-	ext2_off_t blkoff = (grpno % desc_per_blk) * sizeof(*grp);
+	if (grpno >= fs->group_count)
+		return -EINVAL;
+	*grp = fs->gd[grpno];
+	return 0;
+}
 
-	if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
-		return rc;
+/* Dirty descriptors go to their block in the cache, the superblock straight out */
+int e2img_sync_meta(struct e2img *fs)
+{
+	int rc;
+	size_t per_blk = EXT2_DESC_PER_BLOCK(fs->sb);
+
+	for (dgrp_t g = 0; g < fs->group_count; ++g) {
+		void *blk;
+		if (!fs->gd_dirty[g])
+			continue;
+		blk64_t blkno = desc_block_loc(fs, g / per_blk);
+		if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
+			return rc;
+		encode_group_counts(fs, &fs->gd[g], ptr_add(blk, (g % per_blk) * fs->desc_sz));
+		rc = e2img_bcache_dirty(fs, blkno, blk);
+		e2img_bcache_release(fs, blk);
+		if (rc < 0)
+			return rc;
+		fs->gd_dirty[g] = 0;
+	}
 
-	memcpy(grp, ptr_add(blk, blkoff), sizeof(*grp));
-	e2img_bcache_release(fs, blk);
+	if (!fs->sb_dirty)
+		return 0;
+	fs->sb->s_wtime = time(NULL);
+	ssize_t wr = pwrite(fs->fd, fs->sb, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET);
+	if (wr != SUPERBLOCK_SIZE)
+		return wr < 0 ? -errno : -EIO;
+	e2img_io_account(fs, 1, wr);
+	fs->sb_dirty = 0;
 	return 0;
 }
 
 int e2img_read_inode(struct e2img *fs, ext2_ino_t ino, struct ext2_inode *inode)
 {
 	int rc;
-	void *blk;
-	struct ext2_group_desc grp;
-
-	--ino;
-	dgrp_t grpno = ino / EXT2_INODES_PER_GROUP(fs->sb);
-	e2img_read_group(fs, grpno, &grp);
-
-	blk_t blkno = grp.bg_inode_table +
-		(ino % EXT2_INODES_PER_GROUP(fs->sb)) / EXT2_INODES_PER_BLOCK(fs->sb);
-
-	ext2_off_t blkoff = (ino % EXT2_INODES_PER_BLOCK(fs->sb)) * EXT2_INODE_SIZE(fs->sb);
+	struct e2img_inode *ip;
 
-	if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
+	if ((rc = e2img_iget(fs, ino, &ip)) < 0)
 		return rc;
-
-	memcpy(inode, ptr_add(blk, blkoff), EXT2_INODE_SIZE(fs->sb));
-	e2img_bcache_release(fs, blk);
-
+	*inode = ip->i;
+	e2img_iput(fs, ip);
 	return 0;
 }
 
+/* -ENODATA if file_blkno falls into a hole, block 0 is never file data */
 int e2img_inode_get_blkno(struct e2img *fs, struct ext2_inode *inode,
 		blk_t file_blkno, blk_t *fs_blkno)
 {
@@ -153,9 +471,13 @@ int e2img_inode_get_blkno(struct e2img *fs, struct ext2_inode *inode,
 	void *blk = NULL;
 	ext2_off_t per_blk = EXT2_ADDR_PER_BLOCK(fs->sb);
 
+	/* indirect maps only, extent files go through e2img_inode_map */
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return -EOPNOTSUPP;
+
 	if (file_blkno < EXT2_NDIR_BLOCKS) {
 		*fs_blkno = inode->i_block[file_blkno];
-		return 0;
+		return *fs_blkno ? 0 : -ENODATA;
 	}
 	file_blkno -= (EXT2_NDIR_BLOCKS - 1);
 
@@ -170,38 +492,68 @@ int e2img_inode_get_blkno(struct e2img *fs, struct ext2_inode *inode,
 
 	blk_t no = inode->i_block[(EXT2_IND_BLOCK - 1) + indir_lvl];
 	for (int i = indir_lvl; i > 0; --i) {
-		if ((rc = e2img_bcache_access(fs, no, &blk) >= 0) < 0)
+		if (!no)
+			return -ENODATA;
+		if ((rc = e2img_bcache_access(fs, no, &blk)) < 0)
 			return rc;
 		no = ((blk_t*) blk)[level[i - 1]];
-		if ((rc = e2img_bcache_release(fs, blk) >= 0) < 0)
+		if ((rc = e2img_bcache_release(fs, blk)) < 0)
 			return rc;
 	}
 	*fs_blkno = no;
-	return 0;
+	return no ? 0 : -ENODATA;
 }
 
-int e2img_iterate_dir(struct e2img *fs, struct ext2_inode *inode,
-		int (*func)(struct ext2_dir_entry *dirent, void *priv), void *priv)
+/*
+ * Resumes at byte offset off, func gets the offset of the following entry.
+ * ra carries readahead state across calls on one stream, NULL for a
+ * one-shot scan.
+ */
+int e2img_iterate_dir_at(struct e2img *fs, struct e2img_inode *dir, ext2_off64_t off,
+		struct e2img_ra *ra,
+		int (*func)(struct ext2_dir_entry *dirent, ext2_off64_t next, void *priv),
+		void *priv)
 {
-	ssize_t rc;
-	blk_t file_blkno, fs_blkno;
-	ext2_off64_t fpos, fsize = EXT2_I_SIZE(inode);
+	ssize_t rc = 0;
+	struct e2img_extent ext;
+	struct e2img_ra local_ra;
+	blk_t file_blkno;
+	ext2_off64_t fpos = off, fsize = EXT2_I_SIZE(&dir->i);
 	void *blk = NULL;
 
-	file_blkno = 0;
-	fpos = 0;
-	if (!fsize)
+	if (dir->idata)
+		return e2img_inline_iterate_dir(fs, dir, off, func, priv);
+	if (fpos >= fsize)
 		return 0;
+	if (!ra) {
+		ra = &local_ra;
+		e2img_ra_init(ra);
+		ra->next = fpos / fs->blk_sz;
+	}
 
 fetch_blk:
 	if (blk && (rc = e2img_bcache_release(fs, blk)) < 0) {
 		blk = NULL;
 		goto out;
 	}
+	blk = NULL;
 	file_blkno = fpos / fs->blk_sz;
-	if ((rc = e2img_inode_get_blkno(fs, inode, file_blkno, &fs_blkno)) < 0)
+	e2img_readahead(fs, dir, ra, fpos, fs->blk_sz - fpos % fs->blk_sz);
+	if ((rc = e2img_inode_map(fs, dir, file_blkno, &ext)) < 0)
+		goto out;
+	if (!ext.len) {
+		rc = -EIO;
 		goto out;
-	if ((rc = e2img_bcache_access(fs, fs_blkno, &blk)) < 0)
+	}
+	if (!ext.pblk) {
+		/* holes in directories hold no entries */
+		fpos = (ext2_off64_t) (file_blkno + ext.len) * fs->blk_sz;
+		rc = 0;
+		if (fpos >= fsize)
+			goto out;
+		goto fetch_blk;
+	}
+	if ((rc = e2img_bcache_access(fs, ext.pblk, &blk)) < 0)
 		goto out;
 
 	rc = 0;
@@ -209,17 +561,49 @@ fetch_blk:
 		if (fpos / fs->blk_sz != file_blkno)
 			goto fetch_blk;
 
-		struct ext2_dir_entry *dirent = ptr_add(blk, fpos % fs->blk_sz);
+		ext2_off_t boff = fpos % fs->blk_sz;
+		struct ext2_dir_entry *dirent = ptr_add(blk, boff);
+		if (dirent->rec_len < EXT2_DIR_REC_LEN(0) ||
+				boff + dirent->rec_len > fs->blk_sz) {
+			rc = -EIO;
+			break;
+		}
 		fpos += dirent->rec_len;
-		if ((rc = func(dirent, priv)))
+		if (!dirent->inode)
+			continue;
+		if ((rc = func(dirent, fpos, priv)))
 			break;
 	}
 out:
 	if (blk)
 		e2img_bcache_release(fs, blk);
+	if (ra == &local_ra)
+		e2img_ra_destroy(ra);
 	return rc;
 }
 
+struct iterate_dir_data {
+	int (*func)(struct ext2_dir_entry *dirent, void *priv);
+	void *priv;
+};
+
+static
+int iterate_dir_apply(struct ext2_dir_entry *dirent, ext2_off64_t next, void *priv)
+{
+	struct iterate_dir_data *d = priv;
+	return d->func(dirent, d->priv);
+}
+
+int e2img_iterate_dir(struct e2img *fs, struct e2img_inode *dir,
+		int (*func)(struct ext2_dir_entry *dirent, void *priv), void *priv)
+{
+	struct iterate_dir_data d = {
+		.func = func,
+		.priv = priv,
+	};
+	return e2img_iterate_dir_at(fs, dir, 0, NULL, iterate_dir_apply, &d);
+}
+
 char *e2img_ftype_str_tab[EXT2_FT_MAX] = {
 	[EXT2_FT_UNKNOWN]	= "unknown",
 	[EXT2_FT_REG_FILE]	= "regular",
@@ -252,15 +636,46 @@ int dirent_cmp(struct ext2_dir_entry *dirent, void *priv)
 	return 1;
 }
 
-int e2img_path_lookup(struct e2img *fs, char const *path, ext2_ino_t *ino)
+int e2img_dir_lookup(struct e2img *fs, struct e2img_inode *dir,
+		char const *name, size_t len, ext2_ino_t *ino)
 {
 	int rc;
 	struct dirent_cmp_data data;
-	struct ext2_inode inode;
 
-	if (path[0] != '/')
+	if (!len)
+		return -EINVAL;
+	if (len > EXT2_NAME_LEN)
+		return -ENAMETOOLONG;
+	if (e2img_dcache_lookup(&fs->dcache, dir->ino, name, len, ino))
+		return *ino ? 0 : -ENOENT;
+
+	if (!LINUX_S_ISDIR(dir->i.i_mode))
+		return -ENOTDIR;
+
+	data.name = name;
+	data.name_len = len;
+	data.ino = 0;
+	rc = e2img_htree_lookup(fs, dir, name, len, &data.ino);
+	if (rc == -EOPNOTSUPP)
+		rc = e2img_iterate_dir(fs, dir, dirent_cmp, &data);
+	else if (rc == -ENOENT)
+		rc = 0;
+	if (rc < 0)
+		return rc;
+
+	e2img_dcache_insert(&fs->dcache, dir->ino, name, len, data.ino);
+	if (!data.ino)
 		return -ENOENT;
-	data.ino = EXT2_ROOT_INO;
+	*ino = data.ino;
+	return 0;
+}
+
+static
+int __path_lookup(struct e2img *fs, char const *path, ext2_ino_t *ino)
+{
+	int rc;
+	ext2_ino_t cur = EXT2_ROOT_INO;
+	struct e2img_inode *dir;
 
 	while (1) {
 		while (*path == '/')
@@ -270,22 +685,39 @@ int e2img_path_lookup(struct e2img *fs, char const *path, ext2_ino_t *ino)
 		size_t len = 0;
 		for (; path[len] != '/' && path[len] != '\0'; ++len) {
 			if (len > EXT2_NAME_LEN)
-				return -EINVAL;
+				return -ENAMETOOLONG;
 		}
-		data.name = path;
-		data.name_len = len;
-		path += len;
 
-		if ((rc = e2img_read_inode(fs, data.ino, &inode)) < 0)
+		if ((rc = e2img_iget(fs, cur, &dir)) < 0)
 			return rc;
-		if (!LINUX_S_ISDIR(inode.i_mode))
+		rc = e2img_dir_lookup(fs, dir, path, len, &cur);
+		e2img_iput(fs, dir);
+		if (rc == -ENOTDIR)
 			return -ENOENT;
-
-		if ((rc = e2img_iterate_dir(fs, &inode, dirent_cmp, &data)) < 0)
+		if (rc < 0)
 			return rc;
-		if (!rc)
-			return -ENOENT;
+		path += len;
 	}
-	*ino = data.ino;
+	*ino = cur;
 	return 0;
 }
+
+int e2img_path_lookup(struct e2img *fs, char const *path, ext2_ino_t *ino)
+{
+	int rc;
+	size_t len;
+
+	if (path[0] != '/')
+		return -ENOENT;
+
+	len = strlen(path);
+	if (e2img_dcache_lookup(&fs->dcache, 0, path, len, ino))
+		return *ino ? 0 : -ENOENT;
+
+	rc = __path_lookup(fs, path, ino);
+	if (!rc)
+		e2img_dcache_insert(&fs->dcache, 0, path, len, *ino);
+	else if (rc == -ENOENT)
+		e2img_dcache_insert(&fs->dcache, 0, path, len, 0);
+	return rc;
+}
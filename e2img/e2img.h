@@ -1,35 +1,402 @@
+#ifndef _E2IMG_H
+#define _E2IMG_H
+
 #include <ext2fs/ext2fs.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
 
 #define EXT2_I_NBLOCKS(sb, i) ((i)->i_blocks / (2 << (sb)->s_log_block_size))
 #define EXT2_I_FTYPE(i) ((i)->i_mode & (0xf000))
 
-#define E2IMG_INCOMPAT_SUPPORTED (EXT2_FEATURE_INCOMPAT_FILETYPE)
+#define E2IMG_INCOMPAT_SUPPORTED (EXT2_FEATURE_INCOMPAT_FILETYPE | \
+		EXT2_FEATURE_INCOMPAT_META_BG | EXT3_FEATURE_INCOMPAT_EXTENTS | \
+		EXT4_FEATURE_INCOMPAT_64BIT | EXT4_FEATURE_INCOMPAT_FLEX_BG | \
+		EXT4_FEATURE_INCOMPAT_INLINE_DATA)
+
+/* what the write path keeps consistent: indirect maps, no checksums */
+#define E2IMG_RW_INCOMPAT (EXT2_FEATURE_INCOMPAT_FILETYPE | \
+		EXT2_FEATURE_INCOMPAT_META_BG | EXT4_FEATURE_INCOMPAT_64BIT | \
+		EXT4_FEATURE_INCOMPAT_FLEX_BG)
+#define E2IMG_RW_RO_COMPAT (EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER | \
+		EXT2_FEATURE_RO_COMPAT_LARGE_FILE)
+
+/* caches are split into independently locked shards */
+#define E2IMG_CACHE_SHARDS 16
+#define __cacheline_aligned __attribute__((aligned(64)))
+
+struct e2img_dlink {
+	struct e2img_dlink *prev;
+	struct e2img_dlink *next;
+};
+
+struct e2img_bcache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t uncached;	/* misses served outside, all slots pinned */
+};
+
+/* traffic to the image file, copies out of the mapping count as reads */
+struct e2img_io_stats {
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+};
+
+struct e2img_bhead;
+
+struct e2img_bcache_shard {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	struct e2img_bhead	*bh;
+	int32_t			*htab;
+	size_t			hmask;
+	size_t			hand;
+	struct e2img_bcache_stats stats;
+} __cacheline_aligned;
+
+/* refcounted block cache, CLOCK eviction */
+struct e2img_bcache {
+	uint8_t			*arena;
+	struct e2img_bhead	*bh;
+	size_t			blk_sz;
+	size_t			nslots;		/* per shard */
+	struct e2img_bcache_shard shards[E2IMG_CACHE_SHARDS];
+};
+
+struct e2img_icache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+/* contiguous run of file blocks, pblk == 0 for a hole */
+struct e2img_extent {
+	blk_t	lblk;
+	blk64_t	pblk;
+	blk_t	len;
+};
+
+struct e2img_bmap {
+	size_t			len;
+	struct e2img_extent	ext[];
+};
+
+/* block written but not yet allocated and on disk */
+struct e2img_wblk {
+	blk_t	lblk;
+	void	*data;
+};
+
+/* delayed writes of one inode, sorted by lblk */
+struct e2img_wbuf {
+	struct e2img_inode	*ip;
+	struct e2img_dlink	link;	/* on e2img.wb_list, holds a reference */
+	size_t			len;
+	size_t			cap;
+	struct e2img_wblk	*blk;
+};
+
+/* cached inode, pointer is stable between e2img_iget and e2img_iput */
+struct e2img_inode {
+	ext2_ino_t		ino;
+	struct ext2_inode	i;
+
+	struct e2img_bmap	*bmap;	/* built on first e2img_inode_map */
+	struct e2img_wbuf	*wb;	/* written data not yet allocated/on disk */
+	uint8_t			*idata;	/* inline data, i_block then system.data */
+	size_t			idata_len;
+	int			unlinked; /* freed on disk by the last e2img_iput */
+
+	size_t			charge;	/* bytes counted against the shard budget */
+	uint32_t		refcnt;
+	struct e2img_inode	*hnext;
+	struct e2img_dlink	lru;
+};
+
+struct e2img_icache_shard {
+	pthread_mutex_t		lock;
+	struct e2img_inode	**htab;
+	size_t			hmask;
+	size_t			bytes;	/* inodes, run lists and inline copies */
+	size_t			max;
+	struct e2img_dlink	lru;
+	struct e2img_icache_stats stats;
+} __cacheline_aligned;
+
+/* inode cache, unreferenced entries are kept in LRU order */
+struct e2img_icache {
+	struct e2img_icache_shard shards[E2IMG_CACHE_SHARDS];
+};
+
+struct e2img_dcache_stats {
+	uint64_t hits;
+	uint64_t neg_hits;
+	uint64_t misses;
+	uint64_t evictions;
+};
+
+struct e2img_dentry;
+
+struct e2img_dcache_shard {
+	pthread_mutex_t		lock;
+	struct e2img_dentry	**htab;
+	size_t			hmask;
+	size_t			mem;
+	size_t			max_mem;
+	struct e2img_dlink	lru;
+	struct e2img_dcache_stats stats;
+} __cacheline_aligned;
+
+/* (parent ino, name) and whole path lookup cache, with negative entries */
+struct e2img_dcache {
+	struct e2img_dcache_shard shards[E2IMG_CACHE_SHARDS];
+	unsigned		path_gen;	/* whole paths from older gens are stale */
+};
+
+/* group descriptor, widened from the 32 or 64 byte on-disk layout */
+struct e2img_group {
+	blk64_t		block_bitmap;
+	blk64_t		inode_bitmap;
+	blk64_t		inode_table;	/* anywhere in the flex group with flex_bg */
+	uint32_t	free_blocks;
+	uint32_t	free_inodes;
+	uint32_t	used_dirs;
+	uint32_t	itable_unused;
+	uint16_t	flags;
+};
+
+struct e2img_fgroup;
+
+/*
+ * Free space, per group containers built from the block bitmaps on first
+ * use. tree is a max tree over the groups' longest free run, an upper
+ * bound for groups not loaded yet, leaves start at index tree_leaves.
+ */
+struct e2img_freemap {
+	pthread_mutex_t		lock;
+	struct e2img_fgroup	*grp;
+	uint32_t		*tree;
+	size_t			tree_leaves;
+	uint64_t		free_blocks;	/* sums of the group counters */
+	uint64_t		free_inodes;
+};
+
+enum e2img_backend {
+	E2IMG_BACKEND_PREAD,
+	E2IMG_BACKEND_MMAP,	/* whole image mapped, blocks served in place */
+};
+
+struct e2img_conf {
+	size_t bcache_sz;	/* block cache budget, bytes */
+	size_t icache_sz;	/* inode cache budget, bytes */
+	size_t dcache_sz;	/* lookup cache budget, bytes */
+	enum e2img_backend backend;
+	size_t ra_max_sz;	/* readahead window limit, bytes, 0 disables */
+	int writable;		/* open read-write, -EROFS if the layout can't be kept */
+};
+
+extern const struct e2img_conf e2img_default_conf;
 
 struct e2img {
 	int fd;
+	uint8_t *map;		/* NULL unless E2IMG_BACKEND_MMAP */
+	size_t map_sz;
 	size_t blk_sz;
 	struct ext2_super_block *sb;
+	blk64_t blocks_count;
+	size_t desc_sz;
+	blk_t ra_max;		/* blocks */
+	dgrp_t group_count;
+	struct e2img_group *gd;
+	int writable;
+	uint8_t *gd_dirty;	/* per group, descriptor to be written back */
+	int sb_dirty;
+	struct e2img_dlink wb_list;	/* inodes holding delayed writes */
+	size_t wb_mem;
+	struct e2img_freemap freemap;
+	struct e2img_io_stats io_stats;
+	struct e2img_bcache bcache;
+	struct e2img_icache icache;
+	struct e2img_dcache dcache;
 };
 
-ssize_t e2img_blk_read(struct e2img *fs, void *buf, blk_t len, blk_t off);
+ssize_t e2img_pread(struct e2img *fs, void *buf, size_t len, off_t off);
+ssize_t e2img_blk_read(struct e2img *fs, void *buf, blk_t len, blk64_t off);
+int e2img_blk_writev(struct e2img *fs, blk64_t blkno, void * const *blks, size_t n);
+void *e2img_map_block(struct e2img *fs, blk64_t blkno);
+void e2img_io_account(struct e2img *fs, int write, size_t bytes);
+void e2img_io_get_stats(struct e2img *fs, struct e2img_io_stats *st);
 
-int e2img_bcache_access(struct e2img *fs, blk_t blkno, void **blk);
+/* *blk is NULL on error */
+int e2img_bcache_access(struct e2img *fs, blk64_t blkno, void **blk);
 int e2img_bcache_release(struct e2img *fs, void *blk);
+int e2img_bcache_dirty(struct e2img *fs, blk64_t blkno, void *blk);
+int e2img_bcache_flush(struct e2img *fs);
+void e2img_bcache_discard(struct e2img *fs, blk64_t blkno, blk_t n);
+void e2img_bcache_get_stats(struct e2img *fs, struct e2img_bcache_stats *st);
+
+void e2img_bcache_init(struct e2img_bcache *bc, size_t blk_sz, size_t mem);
+void e2img_bcache_destroy(struct e2img_bcache *bc);
+
+/* read of nblocks from blkno into buf, res is nblocks or -errno once reaped */
+struct e2img_aio_req {
+	blk64_t		blkno;
+	blk_t		nblocks;
+	void		*buf;
+	void		*priv;
+	ssize_t		res;
+	size_t		__done;
+};
+
+struct e2img_aio;
+
+/* sequential access state, one per open file or directory stream */
+struct e2img_ra {
+	pthread_mutex_t	lock;
+	uint64_t	next;	/* block after the previous read */
+	uint64_t	size;	/* window, blocks, 0 while access is random */
+	uint64_t	ahead;	/* readahead issued up to this block */
+};
+
+int e2img_aio_init(struct e2img *fs, struct e2img_aio **aiop, unsigned depth);
+void e2img_aio_destroy(struct e2img_aio *aio);
+int e2img_aio_submit(struct e2img_aio *aio, struct e2img_aio_req **reqs, unsigned n);
+int e2img_aio_reap(struct e2img_aio *aio, struct e2img_aio_req **done,
+		unsigned max, unsigned wait_nr);
+unsigned e2img_aio_inflight(struct e2img_aio *aio);
 
 int e2img_open(struct e2img *fs, char const *path);
+int e2img_open_conf(struct e2img *fs, char const *path, struct e2img_conf const *conf);
 int e2img_close(struct e2img *fs);
 
-int e2img_read_group(struct e2img *fs, dgrp_t grpno, struct ext2_group_desc *grp);
+int e2img_read_group(struct e2img *fs, dgrp_t grpno, struct e2img_group *grp);
+int e2img_sync_meta(struct e2img *fs);
 
 int e2img_read_inode(struct e2img *fs, ext2_ino_t ino, struct ext2_inode *inode);
 
+int e2img_iget(struct e2img *fs, ext2_ino_t ino, struct e2img_inode **ipp);
+void e2img_iget_batch(struct e2img *fs, ext2_ino_t const *inos, size_t n,
+		struct e2img_inode **ips);
+struct e2img_inode *e2img_igrab(struct e2img *fs, struct e2img_inode *ip);
+void e2img_iput(struct e2img *fs, struct e2img_inode *ip);
+void e2img_icache_get_stats(struct e2img *fs, struct e2img_icache_stats *st);
+
+void e2img_icache_charge(struct e2img *fs, struct e2img_inode *ip);
+void e2img_inode_drop_bmap(struct e2img *fs, struct e2img_inode *ip);
+
+void e2img_icache_init(struct e2img_icache *ic, size_t mem);
+void e2img_icache_destroy(struct e2img_icache *ic);
+
+int e2img_dcache_lookup(struct e2img_dcache *dc, ext2_ino_t parent,
+		char const *name, size_t len, ext2_ino_t *ino);
+void e2img_dcache_insert(struct e2img_dcache *dc, ext2_ino_t parent,
+		char const *name, size_t len, ext2_ino_t ino);
+void e2img_dcache_invalidate(struct e2img_dcache *dc, ext2_ino_t parent,
+		char const *name, size_t len);
+void e2img_dcache_invalidate_dir(struct e2img_dcache *dc, ext2_ino_t parent);
+void e2img_dcache_get_stats(struct e2img *fs, struct e2img_dcache_stats *st);
+
+void e2img_dcache_init(struct e2img_dcache *dc, size_t mem);
+void e2img_dcache_destroy(struct e2img_dcache *dc);
+
 int e2img_inode_get_blkno(struct e2img *fs, struct ext2_inode *inode,
 		blk_t file_blkno, blk_t *fs_blkno);
 
-int e2img_iterate_dir(struct e2img *fs, struct ext2_inode *inode,
+int e2img_inode_map(struct e2img *fs, struct e2img_inode *ip, blk_t lblk,
+		struct e2img_extent *ext);
+
+ssize_t e2img_file_read(struct e2img *fs, struct e2img_inode *ip,
+		void *buf, size_t size, ext2_off64_t off);
+off_t e2img_lseek(struct e2img *fs, struct e2img_inode *ip, off_t off, int whence);
+
+void e2img_ra_init(struct e2img_ra *ra);
+void e2img_ra_destroy(struct e2img_ra *ra);
+void e2img_prefetch(struct e2img *fs, blk64_t blkno, blk_t len);
+void e2img_readahead(struct e2img *fs, struct e2img_inode *ip, struct e2img_ra *ra,
+		ext2_off64_t off, size_t size);
+
+int e2img_iterate_dir(struct e2img *fs, struct e2img_inode *dir,
 		int (*func)(struct ext2_dir_entry *dirent, void *priv), void *priv);
+int e2img_iterate_dir_at(struct e2img *fs, struct e2img_inode *dir, ext2_off64_t off,
+		struct e2img_ra *ra,
+		int (*func)(struct ext2_dir_entry *dirent, ext2_off64_t next, void *priv),
+		void *priv);
 
 extern char *e2img_ftype_str_tab[EXT2_FT_MAX];
 
+void e2img_inline_load(struct e2img *fs, struct e2img_inode *ip, void const *raw);
+int e2img_inline_iterate_dir(struct e2img *fs, struct e2img_inode *dir, ext2_off64_t off,
+		int (*func)(struct ext2_dir_entry *dirent, ext2_off64_t next, void *priv),
+		void *priv);
+int e2img_is_fast_symlink(struct e2img *fs, struct ext2_inode *inode);
+ssize_t e2img_readlink(struct e2img *fs, struct e2img_inode *ip, char *buf, size_t size);
+
+typedef int (*e2img_scan_fn)(struct e2img *fs, ext2_ino_t ino,
+		struct ext2_inode *inode, void *priv);
+
+int e2img_scan_inodes(struct e2img *fs, unsigned nthreads, e2img_scan_fn fn, void *priv);
+
+/* entry reported by e2img_walk, valid only during the callback */
+struct e2img_walk_ent {
+	ext2_ino_t		parent;		/* 0 for the walk root */
+	struct e2img_inode	*ip;
+	char const		*path;		/* relative to the root, "" for itself */
+	size_t			path_len;
+	unsigned		depth;
+};
+
+typedef int (*e2img_walk_fn)(struct e2img *fs, struct e2img_walk_ent const *ent,
+		void *priv);
+
+int e2img_walk(struct e2img *fs, ext2_ino_t root, unsigned nthreads,
+		e2img_walk_fn fn, void *priv);
+
+struct statvfs;
+
+void e2img_statfs(struct e2img *fs, struct statvfs *st);
+int e2img_free_extent(struct e2img *fs, blk64_t goal, blk_t minlen, blk64_t end,
+		blk64_t *start, blk_t *len);
+void e2img_freemap_update(struct e2img *fs, blk64_t start, blk_t n, int used);
+void e2img_freemap_count_inodes(struct e2img *fs, int delta);
+
+void e2img_freemap_init(struct e2img *fs);
+void e2img_freemap_destroy(struct e2img *fs);
+
+/*
+ * Writing, plain indirect-mapped images only. Calls that modify the image
+ * must not run concurrently with any other call on it, including reads.
+ */
+int e2img_alloc_blocks(struct e2img *fs, blk64_t goal, blk_t want,
+		blk64_t *start, blk_t *got);
+int e2img_free_blocks(struct e2img *fs, blk64_t start, blk_t n);
+int e2img_alloc_inode(struct e2img *fs, ext2_ino_t parent, int is_dir, ext2_ino_t *ino);
+int e2img_free_inode(struct e2img *fs, ext2_ino_t ino, int is_dir);
+
+int e2img_inode_write(struct e2img *fs, struct e2img_inode *ip, int fresh);
+ssize_t e2img_file_write(struct e2img *fs, struct e2img_inode *ip,
+		void const *buf, size_t size, ext2_off64_t off);
+int e2img_truncate(struct e2img *fs, struct e2img_inode *ip, ext2_off64_t size);
+int e2img_inode_flush(struct e2img *fs, struct e2img_inode *ip);
+void e2img_inode_evict(struct e2img *fs, struct e2img_inode *ip);
+int e2img_create(struct e2img *fs, struct e2img_inode *dir, char const *name,
+		size_t len, uint16_t mode, uid_t uid, gid_t gid,
+		struct e2img_inode **ipp);
+int e2img_unlink(struct e2img *fs, struct e2img_inode *dir, char const *name,
+		size_t len);
+int e2img_rmdir(struct e2img *fs, struct e2img_inode *dir, char const *name,
+		size_t len);
+int e2img_sync(struct e2img *fs);
+void e2img_wbuf_overlay(struct e2img_inode *ip, size_t blk_sz, void *buf,
+		size_t size, ext2_off64_t off);
+
+int e2img_htree_lookup(struct e2img *fs, struct e2img_inode *dir,
+		char const *name, size_t len, ext2_ino_t *ino);
+int e2img_dir_lookup(struct e2img *fs, struct e2img_inode *dir,
+		char const *name, size_t len, ext2_ino_t *ino);
 int e2img_path_lookup(struct e2img *fs, char const *path, ext2_ino_t *ino);
+
+#endif /* _E2IMG_H */
@@ -0,0 +1,528 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * Free blocks per group, offsets relative to the group's first block.
+ * Like a roaring container a group holds a sorted run list while that is
+ * smaller than its bitmap, and a copy of the bitmap once fragmentation
+ * makes the list larger.
+ */
+enum {
+	FGRP_UNLOADED,
+	FGRP_RUNS,
+	FGRP_BITMAP,
+};
+
+struct e2img_frun {
+	uint32_t	start;
+	uint32_t	len;
+};
+
+struct e2img_fgroup {
+	int		type;
+	int		stale;		/* bitmap changed, largest is only a bound */
+	uint32_t	largest;	/* longest free run */
+	uint32_t	nruns;
+	uint32_t	cap;
+	union {
+		struct e2img_frun	*runs;
+		uint8_t			*bits;
+	};
+};
+
+static inline
+blk64_t group_first_block(struct e2img *fs, dgrp_t g)
+{
+	return fs->sb->s_first_data_block + (blk64_t) g * EXT2_BLOCKS_PER_GROUP(fs->sb);
+}
+
+static inline
+uint32_t group_nbits(struct e2img *fs, dgrp_t g)
+{
+	return min((blk64_t) EXT2_BLOCKS_PER_GROUP(fs->sb),
+			fs->blocks_count - group_first_block(fs, g));
+}
+
+/* A run list larger than this takes more memory than the bitmap */
+static inline
+uint32_t fgroup_max_runs(struct e2img *fs)
+{
+	return fs->blk_sz / sizeof(struct e2img_frun);
+}
+
+static inline
+uint64_t bm_word(uint8_t const *map, uint32_t w)
+{
+	uint64_t v;
+	memcpy(&v, map + w * sizeof(v), sizeof(v));
+	return v;
+}
+
+/* First bit in [i, n) equal to val, n if there is none */
+static
+uint32_t bm_next(uint8_t const *map, uint32_t i, uint32_t n, int val)
+{
+	while (i < n) {
+		uint64_t w = bm_word(map, i / 64);
+		if (!val)
+			w = ~w;
+		w >>= i % 64;
+		if (w)
+			return min(i + (uint32_t) __builtin_ctzll(w), n);
+		i = (i / 64 + 1) * 64;
+	}
+	return n;
+}
+
+static
+void bm_set(uint8_t *map, uint32_t from, uint32_t n, int val)
+{
+	for (uint32_t i = from; i < from + n; ++i) {
+		if (val)
+			map[i >> 3] |= 1 << (i & 7);
+		else
+			map[i >> 3] &= ~(1 << (i & 7));
+	}
+}
+
+/* Index of the first run ending after off */
+static
+uint32_t runs_search(struct e2img_fgroup *fg, uint32_t off)
+{
+	uint32_t lo = 0, hi = fg->nruns;
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (fg->runs[mid].start + fg->runs[mid].len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static
+void runs_insert(struct e2img_fgroup *fg, uint32_t i, uint32_t start, uint32_t len)
+{
+	if (fg->nruns == fg->cap) {
+		fg->cap = fg->cap ? fg->cap * 2 : 4;
+		fg->runs = realloc(fg->runs, sizeof(*fg->runs) * fg->cap);
+		release_assert(fg->runs);
+	}
+	memmove(&fg->runs[i + 1], &fg->runs[i], sizeof(*fg->runs) * (fg->nruns - i));
+	fg->runs[i] = (struct e2img_frun) {
+		.start = start,
+		.len = len,
+	};
+	fg->nruns++;
+}
+
+static
+void runs_remove(struct e2img_fgroup *fg, uint32_t i)
+{
+	fg->nruns--;
+	memmove(&fg->runs[i], &fg->runs[i + 1], sizeof(*fg->runs) * (fg->nruns - i));
+}
+
+static
+uint32_t runs_largest(struct e2img_fgroup *fg)
+{
+	uint32_t largest = 0;
+	for (uint32_t i = 0; i < fg->nruns; ++i)
+		largest = max(largest, fg->runs[i].len);
+	return largest;
+}
+
+static
+void bits_rescan(struct e2img_fgroup *fg, uint32_t nbits)
+{
+	uint32_t largest = 0;
+	for (uint32_t i = bm_next(fg->bits, 0, nbits, 0); i < nbits;) {
+		uint32_t end = bm_next(fg->bits, i, nbits, 1);
+		largest = max(largest, end - i);
+		i = bm_next(fg->bits, end, nbits, 0);
+	}
+	fg->largest = largest;
+	fg->stale = 0;
+}
+
+/* Bits past the end of the image are kept set, they are never free */
+static
+void fgroup_to_bitmap(struct e2img *fs, struct e2img_fgroup *fg)
+{
+	uint8_t *bits = xmalloc(fs->blk_sz);
+
+	memset(bits, 0xff, fs->blk_sz);
+	for (uint32_t i = 0; i < fg->nruns; ++i)
+		bm_set(bits, fg->runs[i].start, fg->runs[i].len, 0);
+	free(fg->runs);
+	fg->bits = bits;
+	fg->nruns = fg->cap = 0;
+	fg->type = FGRP_BITMAP;
+}
+
+static
+void fgroup_reset(struct e2img_fgroup *fg)
+{
+	if (fg->type == FGRP_RUNS)
+		free(fg->runs);
+	else if (fg->type == FGRP_BITMAP)
+		free(fg->bits);
+	memset(fg, 0, sizeof(*fg));
+}
+
+static
+uint32_t fgroup_bound(struct e2img *fs, dgrp_t g)
+{
+	struct e2img_fgroup *fg = &fs->freemap.grp[g];
+	if (fg->type == FGRP_UNLOADED)
+		return min(fs->gd[g].free_blocks, group_nbits(fs, g));
+	return fg->largest;
+}
+
+static
+void tree_update(struct e2img *fs, dgrp_t g)
+{
+	struct e2img_freemap *fm = &fs->freemap;
+	size_t i = fm->tree_leaves + g;
+
+	fm->tree[i] = fgroup_bound(fs, g);
+	for (i /= 2; i; i /= 2)
+		fm->tree[i] = max(fm->tree[2 * i], fm->tree[2 * i + 1]);
+}
+
+/* First group in [from, to) whose bound reaches minlen, to if there is none */
+static
+dgrp_t tree_find(struct e2img_freemap *fm, size_t node, size_t lo, size_t hi,
+		dgrp_t from, dgrp_t to, uint32_t minlen)
+{
+	if (hi <= from || lo >= to || fm->tree[node] < minlen)
+		return to;
+	if (hi - lo == 1)
+		return lo;
+
+	size_t mid = lo + (hi - lo) / 2;
+	dgrp_t g = tree_find(fm, 2 * node, lo, mid, from, to, minlen);
+	if (g != to)
+		return g;
+	return tree_find(fm, 2 * node + 1, mid, hi, from, to, minlen);
+}
+
+/*
+ * Groups never initialized on disk have no bitmap to read, mke2fs leaves
+ * their free space at the tail, after the metadata.
+ */
+static
+int fgroup_load(struct e2img *fs, dgrp_t g)
+{
+	int rc;
+	uint8_t *map;
+	struct e2img_fgroup *fg = &fs->freemap.grp[g];
+	uint32_t nbits = group_nbits(fs, g);
+	int csum = fs->sb->s_feature_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+			EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+
+	if (fg->type != FGRP_UNLOADED)
+		return 0;
+	if (csum && (fs->gd[g].flags & EXT2_BG_BLOCK_UNINIT)) {
+		uint32_t nfree = min(fs->gd[g].free_blocks, nbits);
+		fg->type = FGRP_RUNS;
+		if (nfree)
+			runs_insert(fg, 0, nbits - nfree, nfree);
+		fg->largest = nfree;
+		return 0;
+	}
+	if ((rc = e2img_bcache_access(fs, fs->gd[g].block_bitmap, (void **) &map)) < 0)
+		return rc;
+
+	fg->type = FGRP_RUNS;
+	for (uint32_t i = bm_next(map, 0, nbits, 0); i < nbits;) {
+		uint32_t end = bm_next(map, i, nbits, 1);
+		if (fg->nruns == fgroup_max_runs(fs)) {
+			free(fg->runs);
+			fg->bits = xmalloc(fs->blk_sz);
+			memcpy(fg->bits, map, fs->blk_sz);
+			bm_set(fg->bits, nbits, fs->blk_sz * 8 - nbits, 1);
+			fg->nruns = fg->cap = 0;
+			fg->type = FGRP_BITMAP;
+			break;
+		}
+		runs_insert(fg, fg->nruns, i, end - i);
+		i = bm_next(map, end, nbits, 0);
+	}
+	e2img_bcache_release(fs, map);
+
+	if (fg->type == FGRP_BITMAP)
+		bits_rescan(fg, nbits);
+	else
+		fg->largest = runs_largest(fg);
+	return 0;
+}
+
+/* Both return -1 if the container does not agree with the change */
+static
+int fgroup_take(struct e2img *fs, struct e2img_fgroup *fg, uint32_t off, uint32_t n)
+{
+	if (fg->type == FGRP_BITMAP) {
+		if (bm_next(fg->bits, off, off + n, 1) != off + n)
+			return -1;
+		bm_set(fg->bits, off, n, 1);
+		fg->stale = 1;
+		return 0;
+	}
+
+	uint32_t i = runs_search(fg, off);
+	if (i == fg->nruns)
+		return -1;
+	struct e2img_frun r = fg->runs[i];
+	if (r.start > off || r.start + r.len < off + n)
+		return -1;
+
+	runs_remove(fg, i);
+	if (off + n < r.start + r.len)
+		runs_insert(fg, i, off + n, r.start + r.len - off - n);
+	if (r.start < off)
+		runs_insert(fg, i, r.start, off - r.start);
+	if (r.len == fg->largest)
+		fg->largest = runs_largest(fg);
+	if (fg->nruns > fgroup_max_runs(fs))
+		fgroup_to_bitmap(fs, fg);
+	return 0;
+}
+
+static
+int fgroup_give(struct e2img *fs, struct e2img_fgroup *fg, uint32_t off, uint32_t n,
+		uint32_t nbits)
+{
+	if (fg->type == FGRP_BITMAP) {
+		if (bm_next(fg->bits, off, off + n, 0) != off + n)
+			return -1;
+		bm_set(fg->bits, off, n, 0);
+		/* merged runs are found by the rescan, until then anything fits */
+		fg->largest = nbits;
+		fg->stale = 1;
+		return 0;
+	}
+
+	uint32_t i = runs_search(fg, off);
+	struct e2img_frun *prev = i ? &fg->runs[i - 1] : NULL;
+	struct e2img_frun *next = i < fg->nruns ? &fg->runs[i] : NULL;
+	if (next && next->start < off + n)
+		return -1;
+
+	int join_prev = prev && prev->start + prev->len == off;
+	int join_next = next && next->start == off + n;
+	uint32_t len = n;
+	if (join_prev && join_next) {
+		len = prev->len += n + next->len;
+		runs_remove(fg, i);
+	} else if (join_prev) {
+		len = prev->len += n;
+	} else if (join_next) {
+		next->start = off;
+		len = next->len += n;
+	} else {
+		runs_insert(fg, i, off, n);
+	}
+	fg->largest = max(fg->largest, len);
+	if (fg->nruns > fgroup_max_runs(fs))
+		fgroup_to_bitmap(fs, fg);
+	return 0;
+}
+
+/* Looks in one group from bit from on, returns 1 if a run was found */
+static
+int fgroup_search(struct e2img *fs, dgrp_t g, uint32_t from, blk_t minlen,
+		blk64_t end, blk64_t *start, blk_t *len)
+{
+	int rc;
+	struct e2img_fgroup *fg = &fs->freemap.grp[g];
+	blk64_t base = group_first_block(fs, g);
+	uint32_t nbits = min((blk64_t) group_nbits(fs, g), end - base);
+	uint32_t s, l;
+
+	if ((rc = fgroup_load(fs, g)) < 0)
+		return rc;
+	if (fg->type == FGRP_BITMAP && fg->stale)
+		bits_rescan(fg, group_nbits(fs, g));
+	tree_update(fs, g);
+	if (fg->largest < minlen)
+		return 0;
+
+	if (fg->type == FGRP_RUNS) {
+		for (uint32_t i = runs_search(fg, from); i < fg->nruns; ++i) {
+			s = max(fg->runs[i].start, from);
+			if (s >= nbits)
+				break;
+			l = min(fg->runs[i].start + fg->runs[i].len, nbits) - s;
+			if (l >= minlen)
+				goto found;
+		}
+		return 0;
+	}
+	for (s = bm_next(fg->bits, from, nbits, 0); s < nbits;) {
+		l = bm_next(fg->bits, s, nbits, 1) - s;
+		if (l >= minlen)
+			goto found;
+		s = bm_next(fg->bits, s + l, nbits, 0);
+	}
+	return 0;
+found:
+	*start = base + s;
+	*len = l;
+	return 1;
+}
+
+/*
+ * First free run of at least minlen blocks at or after goal, wrapping
+ * around below end (0 for the whole image). Runs do not span groups, the
+ * one holding goal is reported from goal on. Groups are loaded as the
+ * search reaches them, the rest are skipped through the tree.
+ */
+int e2img_free_extent(struct e2img *fs, blk64_t goal, blk_t minlen, blk64_t end,
+		blk64_t *start, blk_t *len)
+{
+	int rc;
+	struct e2img_freemap *fm = &fs->freemap;
+	blk64_t first = fs->sb->s_first_data_block;
+	uint32_t bpg = EXT2_BLOCKS_PER_GROUP(fs->sb);
+
+	if (!end || end > fs->blocks_count)
+		end = fs->blocks_count;
+	if (end <= first)
+		return -ENOSPC;
+	if (!minlen)
+		minlen = 1;
+	if (goal < first || goal >= end)
+		goal = first;
+
+	dgrp_t ngroups = div_rup(end - first, (blk64_t) bpg);
+	dgrp_t g0 = (goal - first) / bpg;
+
+	pthread_mutex_lock(&fm->lock);
+	rc = fgroup_search(fs, g0, (goal - first) % bpg, minlen, end, start, len);
+
+	/* the groups after goal, then from the start up to goal's own again */
+	dgrp_t from = g0 + 1, to = ngroups;
+	for (int wrapped = 0; !rc;) {
+		dgrp_t g = tree_find(fm, 1, 0, fm->tree_leaves, from, to, minlen);
+		if (g < to) {
+			rc = fgroup_search(fs, g, 0, minlen, end, start, len);
+			from = g + 1;
+		} else if (!wrapped) {
+			wrapped = 1;
+			from = 0;
+			to = g0 + 1;
+		} else {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fm->lock);
+
+	if (rc < 0)
+		return rc;
+	return rc ? 0 : -ENOSPC;
+}
+
+/*
+ * Follows a bitmap change made by the allocator, after the group
+ * counters. A container that disagrees is dropped and read again.
+ */
+void e2img_freemap_update(struct e2img *fs, blk64_t start, blk_t n, int used)
+{
+	struct e2img_freemap *fm = &fs->freemap;
+	uint32_t bpg = EXT2_BLOCKS_PER_GROUP(fs->sb);
+
+	pthread_mutex_lock(&fm->lock);
+	fm->free_blocks = used ? fm->free_blocks - n : fm->free_blocks + n;
+	while (n) {
+		dgrp_t g = (start - fs->sb->s_first_data_block) / bpg;
+		uint32_t off = (start - fs->sb->s_first_data_block) % bpg;
+		uint32_t cnt = min(n, bpg - off);
+		struct e2img_fgroup *fg = &fm->grp[g];
+
+		if (fg->type != FGRP_UNLOADED) {
+			int rc = used ? fgroup_take(fs, fg, off, cnt) :
+				fgroup_give(fs, fg, off, cnt, group_nbits(fs, g));
+			if (rc < 0)
+				fgroup_reset(fg);
+		}
+		tree_update(fs, g);
+		start += cnt;
+		n -= cnt;
+	}
+	pthread_mutex_unlock(&fm->lock);
+}
+
+void e2img_freemap_count_inodes(struct e2img *fs, int delta)
+{
+	pthread_mutex_lock(&fs->freemap.lock);
+	fs->freemap.free_inodes += delta;
+	pthread_mutex_unlock(&fs->freemap.lock);
+}
+
+/* From the running totals, no bitmap is read */
+void e2img_statfs(struct e2img *fs, struct statvfs *st)
+{
+	struct ext2_super_block *sb = fs->sb;
+	uint64_t resv = sb->s_r_blocks_count;
+
+	if (sb->s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT)
+		resv |= (uint64_t) sb->s_r_blocks_count_hi << 32;
+
+	memset(st, 0, sizeof(*st));
+	pthread_mutex_lock(&fs->freemap.lock);
+	st->f_bfree = fs->freemap.free_blocks;
+	st->f_ffree = fs->freemap.free_inodes;
+	pthread_mutex_unlock(&fs->freemap.lock);
+
+	st->f_bsize = fs->blk_sz;
+	st->f_frsize = fs->blk_sz;
+	st->f_blocks = fs->blocks_count - sb->s_first_data_block;
+	st->f_bavail = st->f_bfree > resv ? st->f_bfree - resv : 0;
+	st->f_files = sb->s_inodes_count;
+	st->f_favail = st->f_ffree;
+	st->f_namemax = EXT2_NAME_LEN;
+	st->f_flag = fs->writable ? 0 : ST_RDONLY;
+}
+
+void e2img_freemap_init(struct e2img *fs)
+{
+	struct e2img_freemap *fm = &fs->freemap;
+
+	pthread_mutex_init(&fm->lock, NULL);
+	fm->grp = xmalloc(sizeof(*fm->grp) * fs->group_count);
+	memset(fm->grp, 0, sizeof(*fm->grp) * fs->group_count);
+
+	for (fm->tree_leaves = 1; fm->tree_leaves < fs->group_count;)
+		fm->tree_leaves <<= 1;
+	fm->tree = xmalloc(sizeof(*fm->tree) * 2 * fm->tree_leaves);
+	memset(fm->tree, 0, sizeof(*fm->tree) * 2 * fm->tree_leaves);
+
+	fm->free_blocks = 0;
+	fm->free_inodes = 0;
+	for (dgrp_t g = 0; g < fs->group_count; ++g) {
+		fm->free_blocks += fs->gd[g].free_blocks;
+		fm->free_inodes += fs->gd[g].free_inodes;
+		fm->tree[fm->tree_leaves + g] = fgroup_bound(fs, g);
+	}
+	for (size_t i = fm->tree_leaves - 1; i; --i)
+		fm->tree[i] = max(fm->tree[2 * i], fm->tree[2 * i + 1]);
+}
+
+void e2img_freemap_destroy(struct e2img *fs)
+{
+	struct e2img_freemap *fm = &fs->freemap;
+
+	for (dgrp_t g = 0; g < fs->group_count; ++g)
+		fgroup_reset(&fm->grp[g]);
+	free(fm->grp);
+	free(fm->tree);
+	pthread_mutex_destroy(&fm->lock);
+}
@@ -0,0 +1,211 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * HTree (dir_index) lookup. Block 0 holds "." and ".." followed by the root
+ * info and the first index level, interior nodes are fake empty dirents
+ * followed by entries. Leaves are plain dirent blocks.
+ *
+ * A damaged index is reported as -EOPNOTSUPP like a missing one, so the
+ * caller falls back to a linear scan as the kernel does. -EIO is left for
+ * reads that fail.
+ */
+
+#define HTREE_ROOT_INFO_OFF	24	/* after "." and ".." */
+#define HTREE_NODE_OFF		8	/* after a fake dirent header */
+#define HTREE_MAX_LEVELS	3
+#define HTREE_BLOCK_MASK	0x0fffffff
+
+struct htree_frame {
+	void			*blk;
+	struct ext2_dx_entry	*entries;
+	unsigned		count;
+	unsigned		at;
+};
+
+static
+int htree_read_block(struct e2img *fs, struct e2img_inode *dir, blk_t lblk, void **blk)
+{
+	int rc;
+	struct e2img_extent ext;
+
+	*blk = NULL;
+	if ((rc = e2img_inode_map(fs, dir, lblk, &ext)) < 0)
+		return rc;
+	if (!ext.len || !ext.pblk)
+		return -EOPNOTSUPP;	/* index points past the directory */
+	return e2img_bcache_access(fs, ext.pblk, blk);
+}
+
+/* Entry 0 carries the count/limit header in place of its hash */
+static
+int htree_frame_init(struct e2img *fs, struct htree_frame *f, size_t off)
+{
+	struct ext2_dx_countlimit *cl = ptr_add(f->blk, off);
+	size_t max = (fs->blk_sz - off) / sizeof(struct ext2_dx_entry);
+
+	if (!cl->count || cl->count > cl->limit || cl->limit > max)
+		return -EOPNOTSUPP;
+	f->entries = (struct ext2_dx_entry *) cl;
+	f->count = cl->count;
+	return 0;
+}
+
+/* Last entry whose hash is <= hash */
+static
+void htree_frame_search(struct htree_frame *f, ext2_dirhash_t hash)
+{
+	unsigned lo = 1, hi = f->count;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (f->entries[mid].hash > hash)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	f->at = lo - 1;
+}
+
+static inline
+blk_t htree_frame_block(struct htree_frame *f)
+{
+	return f->entries[f->at].block & HTREE_BLOCK_MASK;
+}
+
+/* Fill frames below lvl, following hash (or the leftmost entry if first) */
+static
+int htree_descend(struct e2img *fs, struct e2img_inode *dir, struct htree_frame *frames,
+		int lvl, int levels, ext2_dirhash_t hash, int first)
+{
+	int rc;
+	for (; lvl < levels; ++lvl) {
+		struct htree_frame *f = &frames[lvl + 1];
+		if ((rc = htree_read_block(fs, dir, htree_frame_block(&frames[lvl]),
+				&f->blk)) < 0)
+			return rc;
+		if ((rc = htree_frame_init(fs, f, HTREE_NODE_OFF)) < 0)
+			return rc;
+		if (first)
+			f->at = 0;
+		else
+			htree_frame_search(f, hash);
+	}
+	return 0;
+}
+
+static
+int htree_leaf_search(struct e2img *fs, void *blk, char const *name, size_t len,
+		ext2_ino_t *ino)
+{
+	for (size_t off = 0; off < fs->blk_sz;) {
+		struct ext2_dir_entry *dirent = ptr_add(blk, off);
+		if (dirent->rec_len < EXT2_DIR_REC_LEN(0) ||
+				off + dirent->rec_len > fs->blk_sz)
+			return -EOPNOTSUPP;
+		if (dirent->inode && ext2fs_dirent_name_len(dirent) == len &&
+				!memcmp(dirent->name, name, len)) {
+			*ino = dirent->inode;
+			return 1;
+		}
+		off += dirent->rec_len;
+	}
+	return 0;
+}
+
+/*
+ * Step to the next leaf if it may continue the same hash (collision bit
+ * set in the following entry at some level). Returns 1 if advanced.
+ */
+static
+int htree_next_leaf(struct e2img *fs, struct e2img_inode *dir, struct htree_frame *frames,
+		int levels, ext2_dirhash_t hash)
+{
+	int lvl = levels;
+	while (lvl >= 0 && frames[lvl].at + 1 >= frames[lvl].count)
+		lvl--;
+	if (lvl < 0)
+		return 0;
+	if ((frames[lvl].entries[frames[lvl].at + 1].hash & ~1u) != hash)
+		return 0;
+
+	for (int i = lvl + 1; i <= levels; ++i) {
+		e2img_bcache_release(fs, frames[i].blk);
+		frames[i].blk = NULL;
+	}
+	frames[lvl].at++;
+	int rc = htree_descend(fs, dir, frames, lvl, levels, hash, 1);
+	return rc < 0 ? rc : 1;
+}
+
+/* -EOPNOTSUPP if dir has no usable or a damaged index, the caller scans linearly then */
+int e2img_htree_lookup(struct e2img *fs, struct e2img_inode *dir,
+		char const *name, size_t len, ext2_ino_t *ino)
+{
+	int rc;
+	struct htree_frame frames[HTREE_MAX_LEVELS] = { { NULL } };
+	void *leaf = NULL;
+	int levels = 0;
+
+	if (!(fs->sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) ||
+			!(dir->i.i_flags & EXT2_INDEX_FL))
+		return -EOPNOTSUPP;
+
+	if ((rc = htree_read_block(fs, dir, 0, &frames[0].blk)) < 0)
+		return rc;
+
+	struct ext2_dx_root_info *info = ptr_add(frames[0].blk, HTREE_ROOT_INFO_OFF);
+	int version = info->hash_version;
+	if (info->reserved_zero || info->info_length < sizeof(*info) ||
+			info->indirect_levels >= HTREE_MAX_LEVELS ||
+			version > EXT2_HASH_TEA) {
+		rc = -EOPNOTSUPP;
+		goto out;
+	}
+	levels = info->indirect_levels;
+	if (fs->sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+		version += EXT2_HASH_LEGACY_UNSIGNED;
+
+	ext2_dirhash_t hash;
+	if (ext2fs_dirhash(version, name, len, fs->sb->s_hash_seed, &hash, NULL)) {
+		rc = -EOPNOTSUPP;
+		goto out;
+	}
+
+	if ((rc = htree_frame_init(fs, &frames[0],
+			HTREE_ROOT_INFO_OFF + info->info_length)) < 0)
+		goto out;
+	htree_frame_search(&frames[0], hash);
+	if ((rc = htree_descend(fs, dir, frames, 0, levels, hash, 0)) < 0)
+		goto out;
+
+	while (1) {
+		if ((rc = htree_read_block(fs, dir, htree_frame_block(&frames[levels]),
+				&leaf)) < 0) {
+			leaf = NULL;
+			goto out;
+		}
+		rc = htree_leaf_search(fs, leaf, name, len, ino);
+		e2img_bcache_release(fs, leaf);
+		leaf = NULL;
+		if (rc)
+			break;
+		if ((rc = htree_next_leaf(fs, dir, frames, levels, hash)) <= 0) {
+			if (!rc)
+				rc = -ENOENT;
+			break;
+		}
+	}
+	if (rc > 0)
+		rc = 0;
+out:
+	for (int i = 0; i < HTREE_MAX_LEVELS; ++i) {
+		if (frames[i].blk)
+			e2img_bcache_release(fs, frames[i].blk);
+	}
+	return rc;
+}
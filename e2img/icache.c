@@ -0,0 +1,371 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "e2img.h"
+#include "common.h"
+
+#define ICACHE_MIN_ENTRIES 64
+
+static inline
+struct e2img_icache_shard *icache_shard(struct e2img_icache *ic, ext2_ino_t ino)
+{
+	return &ic->shards[ino % E2IMG_CACHE_SHARDS];
+}
+
+static inline
+size_t icache_hash(struct e2img_icache_shard *sh, ext2_ino_t ino)
+{
+	return ((uint32_t) (ino / E2IMG_CACHE_SHARDS) * 2654435761u) & sh->hmask;
+}
+
+static inline
+void icache_lru_del(struct e2img_inode *ip)
+{
+	ip->lru.prev->next = ip->lru.next;
+	ip->lru.next->prev = ip->lru.prev;
+	ip->lru.prev = ip->lru.next = &ip->lru;
+}
+
+static inline
+void icache_lru_add(struct e2img_icache_shard *sh, struct e2img_inode *ip)
+{
+	ip->lru.next = sh->lru.next;
+	ip->lru.prev = &sh->lru;
+	sh->lru.next->prev = &ip->lru;
+	sh->lru.next = &ip->lru;
+}
+
+static
+struct e2img_inode *icache_lookup(struct e2img_icache_shard *sh, ext2_ino_t ino)
+{
+	struct e2img_inode *ip = sh->htab[icache_hash(sh, ino)];
+	for (; ip; ip = ip->hnext) {
+		if (ip->ino == ino)
+			return ip;
+	}
+	return NULL;
+}
+
+static
+void icache_hash_remove(struct e2img_icache_shard *sh, struct e2img_inode *ip)
+{
+	struct e2img_inode **pos = &sh->htab[icache_hash(sh, ip->ino)];
+	while (*pos != ip) {
+		release_assert(*pos);
+		pos = &(*pos)->hnext;
+	}
+	*pos = ip->hnext;
+}
+
+static
+void icache_free_inode(struct e2img_inode *ip)
+{
+	if (ip->wb) {
+		for (size_t i = 0; i < ip->wb->len; ++i)
+			free(ip->wb->blk[i].data);
+		free(ip->wb->blk);
+		free(ip->wb);
+	}
+	free(ip->bmap);
+	free(ip->idata);
+	free(ip);
+}
+
+/* Memory held by a cached inode, its run list and inline copy included */
+static
+size_t icache_inode_bytes(struct e2img_inode *ip)
+{
+	size_t bytes = sizeof(*ip) + ip->idata_len;
+	struct e2img_bmap *map = __atomic_load_n(&ip->bmap, __ATOMIC_ACQUIRE);
+	if (map)
+		bytes += sizeof(*map) + sizeof(map->ext[0]) * map->len;
+	return bytes;
+}
+
+/* Drop least recently used unreferenced inodes beyond the byte budget */
+static
+void icache_shrink(struct e2img_icache_shard *sh)
+{
+	while (sh->bytes > sh->max && sh->lru.prev != &sh->lru) {
+		struct e2img_inode *ip = container_of(sh->lru.prev,
+				struct e2img_inode, lru);
+		icache_lru_del(ip);
+		icache_hash_remove(sh, ip);
+		sh->bytes -= ip->charge;
+		icache_free_inode(ip);
+		sh->stats.evictions++;
+	}
+}
+
+/* Called by the holder of a reference once ip->bmap was set or dropped */
+void e2img_icache_charge(struct e2img *fs, struct e2img_inode *ip)
+{
+	struct e2img_icache_shard *sh = icache_shard(&fs->icache, ip->ino);
+
+	pthread_mutex_lock(&sh->lock);
+	size_t bytes = icache_inode_bytes(ip);
+	sh->bytes = sh->bytes - ip->charge + bytes;
+	ip->charge = bytes;
+	icache_shrink(sh);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/* Writers only, the map is rebuilt on next use */
+void e2img_inode_drop_bmap(struct e2img *fs, struct e2img_inode *ip)
+{
+	if (!ip->bmap)
+		return;
+	free(ip->bmap);
+	ip->bmap = NULL;
+	e2img_icache_charge(fs, ip);
+}
+
+void e2img_icache_init(struct e2img_icache *ic, size_t mem)
+{
+	size_t max = mem / E2IMG_CACHE_SHARDS;
+	if (max < ICACHE_MIN_ENTRIES * sizeof(struct e2img_inode))
+		max = ICACHE_MIN_ENTRIES * sizeof(struct e2img_inode);
+
+	/* sized for bare inodes, chains get longer with large run lists */
+	size_t hsize = 1;
+	while (hsize < max / sizeof(struct e2img_inode))
+		hsize <<= 1;
+
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_icache_shard *sh = &ic->shards[s];
+		sh->htab = xmalloc(sizeof(*sh->htab) * hsize);
+		for (size_t i = 0; i < hsize; ++i)
+			sh->htab[i] = NULL;
+		sh->hmask = hsize - 1;
+		sh->bytes = 0;
+		sh->max = max;
+		sh->lru.prev = sh->lru.next = &sh->lru;
+		memset(&sh->stats, 0, sizeof(sh->stats));
+		pthread_mutex_init(&sh->lock, NULL);
+	}
+}
+
+void e2img_icache_destroy(struct e2img_icache *ic)
+{
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_icache_shard *sh = &ic->shards[s];
+		for (size_t i = 0; i <= sh->hmask; ++i) {
+			struct e2img_inode *ip = sh->htab[i];
+			while (ip) {
+				struct e2img_inode *next = ip->hnext;
+				icache_free_inode(ip);
+				ip = next;
+			}
+		}
+		free(sh->htab);
+		pthread_mutex_destroy(&sh->lock);
+	}
+}
+
+static
+int inode_loc(struct e2img *fs, ext2_ino_t ino, blk64_t *blkno, ext2_off_t *blkoff)
+{
+	if (!ino || ino > fs->sb->s_inodes_count)
+		return -EINVAL;
+	--ino;
+	dgrp_t grpno = ino / EXT2_INODES_PER_GROUP(fs->sb);
+
+	*blkno = fs->gd[grpno].inode_table +
+		(ino % EXT2_INODES_PER_GROUP(fs->sb)) / EXT2_INODES_PER_BLOCK(fs->sb);
+
+	*blkoff = (ino % EXT2_INODES_PER_BLOCK(fs->sb)) * EXT2_INODE_SIZE(fs->sb);
+	return 0;
+}
+
+/* Inline data is picked up from the same block, never read separately */
+static
+int __read_inode_raw(struct e2img *fs, ext2_ino_t ino, struct e2img_inode *ip)
+{
+	int rc;
+	void *blk;
+	blk64_t blkno;
+	ext2_off_t blkoff;
+
+	if ((rc = inode_loc(fs, ino, &blkno, &blkoff)) < 0)
+		return rc;
+	if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
+		return rc;
+
+	memcpy(&ip->i, ptr_add(blk, blkoff), sizeof(ip->i));
+	e2img_inline_load(fs, ip, ptr_add(blk, blkoff));
+	e2img_bcache_release(fs, blk);
+
+	return 0;
+}
+
+/*
+ * Stores the in-memory inode back into the inode table. A fresh slot has
+ * its large inode part reset as well, dropping whatever a previous owner
+ * left there.
+ */
+int e2img_inode_write(struct e2img *fs, struct e2img_inode *ip, int fresh)
+{
+	int rc;
+	void *blk;
+	blk64_t blkno;
+	ext2_off_t blkoff;
+	size_t isz = EXT2_INODE_SIZE(fs->sb);
+
+	if (!fs->writable)
+		return -EROFS;
+	if ((rc = inode_loc(fs, ip->ino, &blkno, &blkoff)) < 0)
+		return rc;
+	if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
+		return rc;
+
+	struct ext2_inode_large *raw = ptr_add(blk, blkoff);
+	if (fresh) {
+		memset(raw, 0, isz);
+		if (isz > EXT2_GOOD_OLD_INODE_SIZE)
+			raw->i_extra_isize = min(isz, sizeof(*raw)) - EXT2_GOOD_OLD_INODE_SIZE;
+	}
+	memcpy(raw, &ip->i, sizeof(ip->i));
+	rc = e2img_bcache_dirty(fs, blkno, blk);
+	e2img_bcache_release(fs, blk);
+	return rc;
+}
+
+int e2img_iget(struct e2img *fs, ext2_ino_t ino, struct e2img_inode **ipp)
+{
+	int rc;
+	struct e2img_icache_shard *sh = icache_shard(&fs->icache, ino);
+	struct e2img_inode *ip;
+
+	pthread_mutex_lock(&sh->lock);
+	if ((ip = icache_lookup(sh, ino))) {
+		if (!ip->refcnt++)
+			icache_lru_del(ip);
+		sh->stats.hits++;
+		pthread_mutex_unlock(&sh->lock);
+		*ipp = ip;
+		return 0;
+	}
+	sh->stats.misses++;
+	pthread_mutex_unlock(&sh->lock);
+
+	/* writers are exclusive, a racing loader reads the same data */
+	ip = xmalloc(sizeof(*ip));
+	if ((rc = __read_inode_raw(fs, ino, ip)) < 0) {
+		free(ip);
+		return rc;
+	}
+	ip->ino = ino;
+	ip->bmap = NULL;
+	ip->wb = NULL;
+	ip->unlinked = 0;
+	ip->refcnt = 1;
+	ip->lru.prev = ip->lru.next = &ip->lru;
+
+	pthread_mutex_lock(&sh->lock);
+	struct e2img_inode *old;
+	if ((old = icache_lookup(sh, ino))) {
+		if (!old->refcnt++)
+			icache_lru_del(old);
+		pthread_mutex_unlock(&sh->lock);
+		icache_free_inode(ip);
+		*ipp = old;
+		return 0;
+	}
+	struct e2img_inode **head = &sh->htab[icache_hash(sh, ino)];
+	ip->hnext = *head;
+	*head = ip;
+	ip->charge = icache_inode_bytes(ip);
+	sh->bytes += ip->charge;
+	icache_shrink(sh);
+	pthread_mutex_unlock(&sh->lock);
+
+	*ipp = ip;
+	return 0;
+}
+
+struct iget_batch_ent {
+	ext2_ino_t	ino;
+	size_t		idx;
+};
+
+static
+int iget_batch_cmp(void const *a, void const *b)
+{
+	ext2_ino_t x = ((struct iget_batch_ent const *) a)->ino;
+	ext2_ino_t y = ((struct iget_batch_ent const *) b)->ino;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Load in inode number order, so inodes sharing an inode table block are
+ * fetched back to back with one block read. Failed slots are set to NULL.
+ */
+void e2img_iget_batch(struct e2img *fs, ext2_ino_t const *inos, size_t n,
+		struct e2img_inode **ips)
+{
+	struct iget_batch_ent *order = xmalloc(sizeof(*order) * n);
+	for (size_t i = 0; i < n; ++i) {
+		order[i].ino = inos[i];
+		order[i].idx = i;
+	}
+	qsort(order, n, sizeof(*order), iget_batch_cmp);
+
+	for (size_t i = 0; i < n; ++i) {
+		if (e2img_iget(fs, order[i].ino, &ips[order[i].idx]) < 0)
+			ips[order[i].idx] = NULL;
+	}
+	free(order);
+}
+
+struct e2img_inode *e2img_igrab(struct e2img *fs, struct e2img_inode *ip)
+{
+	struct e2img_icache_shard *sh = icache_shard(&fs->icache, ip->ino);
+
+	pthread_mutex_lock(&sh->lock);
+	release_assert(ip->refcnt);
+	ip->refcnt++;
+	pthread_mutex_unlock(&sh->lock);
+	return ip;
+}
+
+void e2img_iput(struct e2img *fs, struct e2img_inode *ip)
+{
+	struct e2img_icache_shard *sh = icache_shard(&fs->icache, ip->ino);
+
+	pthread_mutex_lock(&sh->lock);
+	release_assert(ip->refcnt);
+	if (--ip->refcnt) {
+		pthread_mutex_unlock(&sh->lock);
+		return;
+	}
+	if (ip->unlinked) {
+		/* last user of a removed inode gives it back on disk */
+		icache_hash_remove(sh, ip);
+		pthread_mutex_unlock(&sh->lock);
+		/* stays charged, evict may still rebuild or drop the run list */
+		e2img_inode_evict(fs, ip);
+		pthread_mutex_lock(&sh->lock);
+		sh->bytes -= ip->charge;
+		pthread_mutex_unlock(&sh->lock);
+		icache_free_inode(ip);
+		return;
+	}
+	icache_lru_add(sh, ip);
+	icache_shrink(sh);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void e2img_icache_get_stats(struct e2img *fs, struct e2img_icache_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	for (int s = 0; s < E2IMG_CACHE_SHARDS; ++s) {
+		struct e2img_icache_shard *sh = &fs->icache.shards[s];
+		pthread_mutex_lock(&sh->lock);
+		st->hits += sh->stats.hits;
+		st->misses += sh->stats.misses;
+		st->evictions += sh->stats.evictions;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
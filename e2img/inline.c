@@ -0,0 +1,159 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * inline_data files and directories keep their first 60 bytes in i_block
+ * and the rest in the system.data attribute in the large inode body. Both
+ * are copied out while the inode table block is held, reads are then
+ * served from the cached inode. Inline directories start with the parent
+ * inode number, "." and ".." are not stored.
+ */
+
+#define INLINE_DOTDOT_SIZE	4
+#define XATTR_INDEX_SYSTEM	7
+#define XATTR_INLINE_NAME	"data"
+
+/* system.data value inside the inode body, NULL if there is none */
+static
+void const *inline_xattr(struct e2img *fs, void const *raw, size_t *len)
+{
+	struct ext2_inode_large const *large = raw;
+	size_t isz = EXT2_INODE_SIZE(fs->sb);
+	size_t off = EXT2_GOOD_OLD_INODE_SIZE + large->i_extra_isize;
+	size_t name_len = strlen(XATTR_INLINE_NAME);
+
+	if (isz <= EXT2_GOOD_OLD_INODE_SIZE || off + sizeof(uint32_t) > isz ||
+			*(uint32_t const *) ptr_add(raw, off) != EXT2_EXT_ATTR_MAGIC)
+		return NULL;
+
+	/* value offsets count from the first entry, right after the magic */
+	uint8_t const *first = ptr_add(raw, off + sizeof(uint32_t));
+	uint8_t const *end = ptr_add(raw, isz);
+	uint8_t const *pos = first;
+	while (pos + sizeof(uint32_t) <= end &&
+			!EXT2_EXT_IS_LAST_ENTRY((struct ext2_ext_attr_entry const *) pos)) {
+		struct ext2_ext_attr_entry const *e = (void const *) pos;
+		if (pos + sizeof(*e) > end || pos + EXT2_EXT_ATTR_LEN(e->e_name_len) > end)
+			return NULL;
+		if (e->e_name_index == XATTR_INDEX_SYSTEM && e->e_name_len == name_len &&
+				!memcmp(e + 1, XATTR_INLINE_NAME, name_len)) {
+			if (e->e_value_inum ||
+					first + e->e_value_offs + e->e_value_size > end)
+				return NULL;
+			*len = e->e_value_size;
+			return first + e->e_value_offs;
+		}
+		pos += EXT2_EXT_ATTR_LEN(e->e_name_len);
+	}
+	return NULL;
+}
+
+/* Called by the inode cache with the on-disk inode, ip->i already filled */
+void e2img_inline_load(struct e2img *fs, struct e2img_inode *ip, void const *raw)
+{
+	size_t xlen = 0;
+	void const *xval = NULL;
+
+	ip->idata = NULL;
+	ip->idata_len = 0;
+	if (!EXT2_HAS_INCOMPAT_FEATURE(fs->sb, EXT4_FEATURE_INCOMPAT_INLINE_DATA) ||
+			!(ip->i.i_flags & EXT4_INLINE_DATA_FL))
+		return;
+
+	xval = inline_xattr(fs, raw, &xlen);
+	ip->idata_len = sizeof(ip->i.i_block) + (xval ? xlen : 0);
+	ip->idata = xmalloc(ip->idata_len);
+	memcpy(ip->idata, ip->i.i_block, sizeof(ip->i.i_block));
+	if (xval)
+		memcpy(ip->idata + sizeof(ip->i.i_block), xval, xlen);
+}
+
+static
+void inline_fake_dirent(struct ext2_dir_entry *dirent, ext2_ino_t ino, int len)
+{
+	dirent->inode = ino;
+	dirent->rec_len = EXT2_DIR_REC_LEN(len);
+	dirent->name_len = 0;
+	ext2fs_dirent_set_name_len(dirent, len);
+	ext2fs_dirent_set_file_type(dirent, EXT2_FT_DIR);
+	memcpy(dirent->name, "..", len);
+}
+
+/*
+ * Same contract as e2img_iterate_dir_at. "." is at offset 0 and ".." at 1,
+ * stored entries at their offset in the inline data, past the parent
+ * number. Entries in i_block end at its end, the rest are in the attribute.
+ */
+int e2img_inline_iterate_dir(struct e2img *fs, struct e2img_inode *dir, ext2_off64_t off,
+		int (*func)(struct ext2_dir_entry *dirent, ext2_off64_t next, void *priv),
+		void *priv)
+{
+	int rc;
+	struct ext2_dir_entry dot;
+	uint32_t parent;
+	size_t iblock_end = sizeof(dir->i.i_block);
+
+	memcpy(&parent, dir->idata, sizeof(parent));
+	if (off < 1) {
+		inline_fake_dirent(&dot, dir->ino, 1);
+		if ((rc = func(&dot, 1, priv)))
+			return rc;
+	}
+	if (off < INLINE_DOTDOT_SIZE) {
+		inline_fake_dirent(&dot, parent, 2);
+		if ((rc = func(&dot, INLINE_DOTDOT_SIZE, priv)))
+			return rc;
+	}
+
+	for (size_t pos = INLINE_DOTDOT_SIZE; pos < dir->idata_len;) {
+		size_t end = pos < iblock_end ? iblock_end : dir->idata_len;
+		struct ext2_dir_entry *dirent = (void *) (dir->idata + pos);
+		if (pos + EXT2_DIR_REC_LEN(0) > end ||
+				dirent->rec_len < EXT2_DIR_REC_LEN(0) ||
+				pos + dirent->rec_len > end ||
+				EXT2_DIR_REC_LEN(ext2fs_dirent_name_len(dirent)) > dirent->rec_len)
+			return -EIO;
+		size_t cur = pos;
+		pos += dirent->rec_len;
+		if (cur < off || !dirent->inode)
+			continue;
+		if ((rc = func(dirent, pos, priv)))
+			return rc;
+	}
+	return 0;
+}
+
+/* Target in i_block: no data blocks besides a possible xattr block */
+int e2img_is_fast_symlink(struct e2img *fs, struct ext2_inode *inode)
+{
+	return LINUX_S_ISLNK(inode->i_mode) && !(inode->i_flags & EXT4_INLINE_DATA_FL) &&
+		EXT2_I_NBLOCKS(fs->sb, inode) <= !!inode->i_file_acl;
+}
+
+/*
+ * Like readlink(2): up to size bytes of the target, not terminated. Fast
+ * and inline targets come from the cached inode, others are one block.
+ */
+ssize_t e2img_readlink(struct e2img *fs, struct e2img_inode *ip, char *buf, size_t size)
+{
+	ext2_off64_t len = EXT2_I_SIZE(&ip->i);
+
+	if (!LINUX_S_ISLNK(ip->i.i_mode))
+		return -EINVAL;
+	if (!len || len >= fs->blk_sz)
+		return -EIO;
+	size = min(size, (size_t) len);
+
+	if (e2img_is_fast_symlink(fs, &ip->i)) {
+		if (len >= sizeof(ip->i.i_block))
+			return -EIO;
+		memcpy(buf, ip->i.i_block, size);
+		return size;
+	}
+	return e2img_file_read(fs, ip, buf, size, 0);
+}
@@ -0,0 +1,101 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/* first window, grows x2 on each sequential trigger up to fs->ra_max */
+#define RA_INIT_SZ (32 << 10)
+
+void e2img_ra_init(struct e2img_ra *ra)
+{
+	pthread_mutex_init(&ra->lock, NULL);
+	ra->next = 0;
+	ra->size = 0;
+	ra->ahead = 0;
+}
+
+void e2img_ra_destroy(struct e2img_ra *ra)
+{
+	pthread_mutex_destroy(&ra->lock);
+}
+
+/* Async hint only, the data lands in the page cache under the image */
+void e2img_prefetch(struct e2img *fs, blk64_t blkno, blk_t len)
+{
+	off_t off = blkno * fs->blk_sz;
+	size_t sz = (size_t) len * fs->blk_sz;
+
+	if (!fs->map) {
+		posix_fadvise(fs->fd, off, sz, POSIX_FADV_WILLNEED);
+		return;
+	}
+	if ((size_t) off >= fs->map_sz)
+		return;
+	sz = min(sz, fs->map_sz - off);
+	size_t pg = sysconf(_SC_PAGESIZE);
+	size_t start = off & ~(pg - 1);
+	madvise(fs->map + start, off + sz - start, MADV_WILLNEED);
+}
+
+static
+void ra_submit(struct e2img *fs, struct e2img_inode *ip, uint64_t from, uint64_t to)
+{
+	while (from < to) {
+		struct e2img_extent ext;
+		if (e2img_inode_map(fs, ip, from, &ext) < 0 || !ext.len)
+			return;
+		blk_t n = min((uint64_t) ext.len, to - from);
+		if (ext.pblk)
+			e2img_prefetch(fs, ext.pblk, n);
+		from += n;
+	}
+}
+
+/*
+ * Called before reading [off, off + size). A read starting where the last
+ * one ended (or inside its last block) is sequential: the window is
+ * started or doubled and the next one is issued once the reader gets
+ * within half a window of the readahead mark. Anything else collapses it.
+ */
+void e2img_readahead(struct e2img *fs, struct e2img_inode *ip, struct e2img_ra *ra,
+		ext2_off64_t off, size_t size)
+{
+	uint64_t nblocks = div_rup(EXT2_I_SIZE(&ip->i), fs->blk_sz);
+	uint64_t lblk = off / fs->blk_sz;
+	uint64_t end = min(div_rup(off + size, fs->blk_sz), nblocks);
+	uint64_t from = 0, to = 0;
+
+	if (!fs->ra_max || !size || lblk >= nblocks || ip->idata)
+		return;
+
+	pthread_mutex_lock(&ra->lock);
+	if (lblk == ra->next || lblk + 1 == ra->next) {
+		if (!ra->size) {
+			/* first window also covers the request itself */
+			ra->size = max(2 * (end - lblk), (uint64_t) RA_INIT_SZ / fs->blk_sz);
+			ra->size = min(ra->size, (uint64_t) fs->ra_max);
+			ra->ahead = lblk;
+		} else if (end + ra->size / 2 >= ra->ahead) {
+			ra->size = min(2 * ra->size, (uint64_t) fs->ra_max);
+		}
+		if (end + ra->size / 2 >= ra->ahead) {
+			from = ra->ahead;
+			to = min(end + ra->size, nblocks);
+			ra->ahead = to;
+		}
+	} else {
+		ra->size = 0;
+		ra->ahead = 0;
+	}
+	ra->next = end;
+	pthread_mutex_unlock(&ra->lock);
+
+	if (from < to)
+		ra_submit(fs, ip, from, to);
+}
@@ -0,0 +1,243 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * Whole-image inode scan. Workers claim block groups one at a time, read
+ * the inode bitmap, then stream the inode table in large chunks through
+ * e2img_aio, skipping chunks with no inodes in use.
+ */
+
+#define SCAN_CHUNK_SZ (1 << 20)
+#define SCAN_DEPTH 4		/* chunk reads in flight per worker */
+
+struct scan_io {
+	struct e2img_aio_req	req;
+	uint32_t		first;	/* group-relative inode range */
+	uint32_t		last;
+};
+
+struct scan_worker {
+	struct e2img_aio	*aio;
+	uint8_t			*bitmap;
+	struct scan_io		io[SCAN_DEPTH];
+};
+
+struct scan_ctx {
+	struct e2img	*fs;
+	e2img_scan_fn	fn;
+	void		*priv;
+	dgrp_t		next_grp;
+	int		rc;		/* first error or callback stop value */
+};
+
+static inline
+int scan_stopped(struct scan_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->rc, __ATOMIC_RELAXED) != 0;
+}
+
+static inline
+void scan_stop(struct scan_ctx *ctx, int rc)
+{
+	int zero = 0;
+	__atomic_compare_exchange_n(&ctx->rc, &zero, rc, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static inline
+int bitmap_test(uint8_t const *map, uint32_t bit)
+{
+	return map[bit >> 3] & (1 << (bit & 7));
+}
+
+static
+int bitmap_any(uint8_t const *map, uint32_t from, uint32_t to)
+{
+	for (uint32_t i = from; i < to; ++i) {
+		if (!(i & 7) && i + 8 <= to && !map[i >> 3]) {
+			i += 7;
+			continue;
+		}
+		if (bitmap_test(map, i))
+			return 1;
+	}
+	return 0;
+}
+
+/* Number of leading inodes of the group that may be in use */
+static
+uint32_t scan_group_limit(struct e2img *fs, struct e2img_group *grp)
+{
+	struct ext2_super_block *sb = fs->sb;
+	uint32_t ipg = EXT2_INODES_PER_GROUP(sb);
+	int csum = sb->s_feature_ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM |
+			EXT4_FEATURE_RO_COMPAT_METADATA_CSUM);
+
+	if (grp->free_inodes >= ipg)
+		return 0;
+	if (!csum)
+		return ipg;
+	if (grp->flags & EXT2_BG_INODE_UNINIT)
+		return 0;
+	return grp->itable_unused < ipg ? ipg - grp->itable_unused : ipg;
+}
+
+static
+int scan_chunk(struct scan_ctx *ctx, dgrp_t g, uint8_t const *bitmap,
+		struct scan_io *io)
+{
+	int rc;
+	struct e2img *fs = ctx->fs;
+	size_t isz = EXT2_INODE_SIZE(fs->sb);
+	ext2_ino_t base = g * EXT2_INODES_PER_GROUP(fs->sb) + 1;
+
+	for (uint32_t i = io->first; i < io->last; ++i) {
+		if (!bitmap_test(bitmap, i))
+			continue;
+		struct ext2_inode *inode = ptr_add(io->req.buf, (size_t) (i - io->first) * isz);
+		if ((rc = ctx->fn(fs, base + i, inode, ctx->priv)))
+			return rc;
+	}
+	return 0;
+}
+
+/*
+ * Keeps up to SCAN_DEPTH chunk reads of the group in flight and handles
+ * them in completion order. On error everything queued is still reaped,
+ * the buffers are reused for the next group.
+ */
+static
+int scan_group(struct scan_ctx *ctx, dgrp_t g, struct scan_worker *w)
+{
+	int rc = 0, n;
+	struct e2img *fs = ctx->fs;
+	struct e2img_group *grp = &fs->gd[g];
+	uint32_t per_blk = fs->blk_sz / EXT2_INODE_SIZE(fs->sb);
+	uint32_t per_chunk = SCAN_CHUNK_SZ / fs->blk_sz * per_blk;
+	uint32_t limit = scan_group_limit(fs, grp);
+	ext2_ino_t base = g * EXT2_INODES_PER_GROUP(fs->sb) + 1;
+	struct scan_io *idle[SCAN_DEPTH];
+	struct e2img_aio_req *done[SCAN_DEPTH];
+	unsigned nidle = SCAN_DEPTH;
+	uint32_t first = 0;
+
+	limit = min(limit, fs->sb->s_inodes_count - (base - 1));
+	if (!limit)
+		return 0;
+	if ((rc = e2img_blk_read(fs, w->bitmap, 1, grp->inode_bitmap)) < 0)
+		return rc;
+
+	for (unsigned i = 0; i < SCAN_DEPTH; ++i)
+		idle[i] = &w->io[i];
+
+	while (1) {
+		while (!rc && nidle && first < limit && !scan_stopped(ctx)) {
+			uint32_t last = min(first + per_chunk, limit);
+			if (!bitmap_any(w->bitmap, first, last)) {
+				first = last;
+				continue;
+			}
+			struct scan_io *io = idle[nidle - 1];
+			struct e2img_aio_req *req = &io->req;
+			io->first = first;
+			io->last = last;
+			req->blkno = grp->inode_table + first / per_blk;
+			req->nblocks = div_rup(last - first, per_blk);
+			if ((n = e2img_aio_submit(w->aio, &req, 1)) < 0) {
+				rc = n;
+				break;
+			}
+			nidle--;
+			first = last;
+		}
+		if (!e2img_aio_inflight(w->aio))
+			break;
+
+		/* a failing ring still owns the buffers, there is no way back */
+		n = e2img_aio_reap(w->aio, done, SCAN_DEPTH, 1);
+		release_assert(n >= 0);
+		for (int i = 0; i < n; ++i) {
+			struct scan_io *io = done[i]->priv;
+			if (!rc && done[i]->res < 0)
+				rc = done[i]->res;
+			else if (!rc && !scan_stopped(ctx))
+				rc = scan_chunk(ctx, g, w->bitmap, io);
+			idle[nidle++] = io;
+		}
+	}
+	return rc;
+}
+
+static
+void *scan_worker(void *arg)
+{
+	int rc;
+	struct scan_ctx *ctx = arg;
+	struct e2img *fs = ctx->fs;
+	struct scan_worker w;
+
+	if ((rc = e2img_aio_init(fs, &w.aio, SCAN_DEPTH)) < 0) {
+		scan_stop(ctx, rc);
+		return NULL;
+	}
+	w.bitmap = xmemalign(fs->blk_sz, fs->blk_sz);
+	for (int i = 0; i < SCAN_DEPTH; ++i) {
+		w.io[i].req.buf = xmemalign(fs->blk_sz, SCAN_CHUNK_SZ);
+		w.io[i].req.priv = &w.io[i];
+	}
+
+	while (!scan_stopped(ctx)) {
+		dgrp_t g = __atomic_fetch_add(&ctx->next_grp, 1, __ATOMIC_RELAXED);
+		if (g >= fs->group_count)
+			break;
+		if ((rc = scan_group(ctx, g, &w)))
+			scan_stop(ctx, rc);
+	}
+	for (int i = 0; i < SCAN_DEPTH; ++i)
+		free(w.io[i].req.buf);
+	free(w.bitmap);
+	e2img_aio_destroy(w.aio);
+	return NULL;
+}
+
+/*
+ * Calls fn for every inode marked in use, reserved ones included, from
+ * nthreads threads at once (0: one per CPU), in no particular order. The
+ * inode pointer is only valid during the call. A non-zero return from fn
+ * stops the scan and is returned, as is the first I/O error.
+ */
+int e2img_scan_inodes(struct e2img *fs, unsigned nthreads, e2img_scan_fn fn, void *priv)
+{
+	struct scan_ctx ctx = {
+		.fs = fs,
+		.fn = fn,
+		.priv = priv,
+		.next_grp = 0,
+		.rc = 0,
+	};
+
+	if (!nthreads) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? ncpu : 1;
+	}
+	nthreads = min(nthreads, fs->group_count);
+
+	pthread_t *tids = xmalloc(sizeof(*tids) * nthreads);
+	unsigned started = 0;
+	for (; started < nthreads; ++started) {
+		if (pthread_create(&tids[started], NULL, scan_worker, &ctx))
+			break;
+	}
+	if (!started)
+		scan_worker(&ctx);
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	return ctx.rc;
+}
@@ -0,0 +1,409 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * Parallel tree walk. Every worker owns a deque of directories still to be
+ * listed: it pushes and pops at the tail (depth first, warm caches) while
+ * idle workers steal from the head, where the oldest and usually largest
+ * subtrees are. Entries of a directory are collected in batches and their
+ * inodes loaded with e2img_iget_batch, in inode table order.
+ */
+
+#define WALK_BATCH	256
+#define WALK_MAX_DEPTH	4096	/* deeper than this means a directory loop */
+
+struct walk_dir {
+	ext2_ino_t	ino;
+	unsigned	depth;
+	size_t		path_len;
+	char		path[];
+};
+
+struct walk_deque {
+	pthread_mutex_t	lock;
+	struct walk_dir	**items;
+	size_t		head;		/* thieves take from here */
+	size_t		tail;		/* owner pushes and pops here */
+	size_t		cap;
+} __cacheline_aligned;
+
+struct walk_ctx;
+
+struct walk_worker {
+	struct walk_ctx		*ctx;
+	unsigned		id;
+	pthread_t		tid;
+	struct walk_deque	dq;
+
+	struct walk_dir		*cur;
+	struct e2img_ra		ra;
+	char			*path;
+	size_t			path_cap;
+
+	size_t			nbatch;
+	size_t			names_len;
+	ext2_ino_t		inos[WALK_BATCH];
+	struct e2img_inode	*ips[WALK_BATCH];
+	size_t			name_off[WALK_BATCH];
+	uint8_t			name_len[WALK_BATCH];
+	char			names[WALK_BATCH * EXT2_NAME_LEN];
+};
+
+struct walk_ctx {
+	struct e2img		*fs;
+	e2img_walk_fn		fn;
+	void			*priv;
+	unsigned		nworkers;
+	struct walk_worker	*workers;
+
+	size_t			pending;	/* directories queued or being listed */
+	unsigned		gen;		/* bumped on every push */
+	unsigned		nidle;
+	int			rc;
+	pthread_mutex_t		idle_lock;
+	pthread_cond_t		idle_wait;
+};
+
+static inline
+int walk_stopped(struct walk_ctx *ctx)
+{
+	return __atomic_load_n(&ctx->rc, __ATOMIC_RELAXED) != 0;
+}
+
+static
+void walk_wake_all(struct walk_ctx *ctx)
+{
+	pthread_mutex_lock(&ctx->idle_lock);
+	pthread_cond_broadcast(&ctx->idle_wait);
+	pthread_mutex_unlock(&ctx->idle_lock);
+}
+
+static
+void walk_stop(struct walk_ctx *ctx, int rc)
+{
+	int zero = 0;
+	__atomic_compare_exchange_n(&ctx->rc, &zero, rc, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	walk_wake_all(ctx);
+}
+
+static
+struct walk_dir *walk_dir_new(ext2_ino_t ino, unsigned depth, char const *path, size_t len)
+{
+	struct walk_dir *d = xmalloc(sizeof(*d) + len + 1);
+	d->ino = ino;
+	d->depth = depth;
+	d->path_len = len;
+	memcpy(d->path, path, len);
+	d->path[len] = '\0';
+	return d;
+}
+
+static
+void walk_push(struct walk_worker *w, struct walk_dir *d)
+{
+	struct walk_ctx *ctx = w->ctx;
+	struct walk_deque *dq = &w->dq;
+
+	__atomic_fetch_add(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->cap) {
+		if (dq->head) {
+			memmove(dq->items, dq->items + dq->head,
+					sizeof(*dq->items) * (dq->tail - dq->head));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			dq->cap = dq->cap ? 2 * dq->cap : 64;
+			dq->items = realloc(dq->items, sizeof(*dq->items) * dq->cap);
+			release_assert(dq->items);
+		}
+	}
+	dq->items[dq->tail++] = d;
+	pthread_mutex_unlock(&dq->lock);
+
+	/* pairs with the nidle/gen check in walk_get */
+	__atomic_fetch_add(&ctx->gen, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ctx->nidle, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&ctx->idle_lock);
+		pthread_cond_signal(&ctx->idle_wait);
+		pthread_mutex_unlock(&ctx->idle_lock);
+	}
+}
+
+static
+struct walk_dir *walk_take(struct walk_deque *dq, int steal)
+{
+	struct walk_dir *d = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->head < dq->tail)
+		d = steal ? dq->items[dq->head++] : dq->items[--dq->tail];
+	if (dq->head == dq->tail)
+		dq->head = dq->tail = 0;
+	pthread_mutex_unlock(&dq->lock);
+	return d;
+}
+
+/* Own deque first, then steal round robin, sleep while others are busy */
+static
+struct walk_dir *walk_get(struct walk_worker *w)
+{
+	struct walk_ctx *ctx = w->ctx;
+	struct walk_dir *d;
+
+	while (!walk_stopped(ctx)) {
+		unsigned gen = __atomic_load_n(&ctx->gen, __ATOMIC_SEQ_CST);
+		if ((d = walk_take(&w->dq, 0)))
+			return d;
+		for (unsigned i = 1; i < ctx->nworkers; ++i) {
+			struct walk_worker *v = &ctx->workers[(w->id + i) % ctx->nworkers];
+			if ((d = walk_take(&v->dq, 1)))
+				return d;
+		}
+
+		pthread_mutex_lock(&ctx->idle_lock);
+		__atomic_fetch_add(&ctx->nidle, 1, __ATOMIC_SEQ_CST);
+		while (!walk_stopped(ctx) &&
+				__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) &&
+				__atomic_load_n(&ctx->gen, __ATOMIC_SEQ_CST) == gen)
+			pthread_cond_wait(&ctx->idle_wait, &ctx->idle_lock);
+		__atomic_fetch_sub(&ctx->nidle, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&ctx->idle_lock);
+
+		if (!__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST))
+			break;
+	}
+	return NULL;
+}
+
+static
+void walk_done(struct walk_worker *w)
+{
+	if (__atomic_sub_fetch(&w->ctx->pending, 1, __ATOMIC_SEQ_CST) == 0)
+		walk_wake_all(w->ctx);
+}
+
+/* Path of batch entry i in w->path, "name" under the root, "dir/name" below */
+static
+size_t walk_path(struct walk_worker *w, size_t i)
+{
+	struct walk_dir *cur = w->cur;
+	size_t len = cur->path_len + !!cur->path_len + w->name_len[i];
+
+	if (len + 1 > w->path_cap) {
+		w->path_cap = max(2 * w->path_cap, len + 1);
+		w->path = realloc(w->path, w->path_cap);
+		release_assert(w->path);
+	}
+	char *p = w->path;
+	memcpy(p, cur->path, cur->path_len);
+	p += cur->path_len;
+	if (cur->path_len)
+		*p++ = '/';
+	memcpy(p, w->names + w->name_off[i], w->name_len[i]);
+	w->path[len] = '\0';
+	return len;
+}
+
+static
+int walk_visit(struct walk_worker *w, size_t i, struct e2img_inode *ip)
+{
+	int rc;
+	struct walk_ctx *ctx = w->ctx;
+	struct e2img_walk_ent ent = {
+		.parent = w->cur->ino,
+		.ip = ip,
+		.depth = w->cur->depth + 1,
+	};
+
+	ent.path_len = walk_path(w, i);
+	ent.path = w->path;
+	if ((rc = ctx->fn(ctx->fs, &ent, ctx->priv)))
+		return rc;
+	if (!LINUX_S_ISDIR(ip->i.i_mode))
+		return 0;
+	if (ent.depth >= WALK_MAX_DEPTH)
+		return -ELOOP;
+	walk_push(w, walk_dir_new(ip->ino, ent.depth, ent.path, ent.path_len));
+	return 0;
+}
+
+static
+int walk_flush(struct walk_worker *w)
+{
+	int rc = 0;
+	struct e2img *fs = w->ctx->fs;
+
+	e2img_iget_batch(fs, w->inos, w->nbatch, w->ips);
+	for (size_t i = 0; i < w->nbatch; ++i) {
+		struct e2img_inode *ip = w->ips[i];
+		if (!rc && !ip)
+			rc = -EIO;
+		if (!rc && walk_stopped(w->ctx))
+			rc = -ECANCELED;
+		if (!rc)
+			rc = walk_visit(w, i, ip);
+		if (ip)
+			e2img_iput(fs, ip);
+	}
+	w->nbatch = 0;
+	w->names_len = 0;
+	return rc;
+}
+
+static
+int walk_dirent(struct ext2_dir_entry *dirent, ext2_off64_t next, void *priv)
+{
+	struct walk_worker *w = priv;
+	size_t len = ext2fs_dirent_name_len(dirent);
+
+	if (dirent->name[0] == '.' && (len == 1 || (len == 2 && dirent->name[1] == '.')))
+		return 0;
+
+	size_t i = w->nbatch++;
+	w->inos[i] = dirent->inode;
+	w->name_off[i] = w->names_len;
+	w->name_len[i] = len;
+	memcpy(w->names + w->names_len, dirent->name, len);
+	w->names_len += len;
+
+	return w->nbatch == WALK_BATCH ? walk_flush(w) : 0;
+}
+
+static
+int walk_list(struct walk_worker *w)
+{
+	int rc;
+	struct e2img *fs = w->ctx->fs;
+	struct e2img_inode *dir;
+
+	if ((rc = e2img_iget(fs, w->cur->ino, &dir)) < 0)
+		return rc;
+	e2img_ra_init(&w->ra);
+	rc = e2img_iterate_dir_at(fs, dir, 0, &w->ra, walk_dirent, w);
+	if (!rc && w->nbatch)
+		rc = walk_flush(w);
+	w->nbatch = 0;
+	w->names_len = 0;
+	e2img_ra_destroy(&w->ra);
+	e2img_iput(fs, dir);
+	return rc;
+}
+
+static
+void *walk_worker(void *arg)
+{
+	int rc;
+	struct walk_worker *w = arg;
+
+	while ((w->cur = walk_get(w))) {
+		if (!walk_stopped(w->ctx) && (rc = walk_list(w)))
+			walk_stop(w->ctx, rc);
+		free(w->cur);
+		walk_done(w);
+	}
+	return NULL;
+}
+
+static
+int walk_root(struct walk_ctx *ctx, ext2_ino_t root)
+{
+	int rc;
+	struct e2img_inode *ip;
+	struct e2img_walk_ent ent = {
+		.parent = 0,
+		.path = "",
+		.path_len = 0,
+		.depth = 0,
+	};
+
+	if ((rc = e2img_iget(ctx->fs, root, &ip)) < 0)
+		return rc;
+	ent.ip = ip;
+	rc = ctx->fn(ctx->fs, &ent, ctx->priv);
+	if (!rc && LINUX_S_ISDIR(ip->i.i_mode))
+		walk_push(&ctx->workers[0], walk_dir_new(root, 0, "", 0));
+	e2img_iput(ctx->fs, ip);
+	return rc;
+}
+
+/*
+ * Calls fn for root and everything below it from nthreads threads at once
+ * (0: one per CPU). Parents are reported before their children, otherwise
+ * the order is arbitrary. A non-zero return from fn stops the walk and is
+ * returned, as is the first error reading the tree.
+ */
+int e2img_walk(struct e2img *fs, ext2_ino_t root, unsigned nthreads,
+		e2img_walk_fn fn, void *priv)
+{
+	int rc;
+	struct walk_ctx ctx = {
+		.fs = fs,
+		.fn = fn,
+		.priv = priv,
+		.pending = 0,
+		.gen = 0,
+		.nidle = 0,
+		.rc = 0,
+	};
+
+	if (!nthreads) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpu > 0 ? ncpu : 1;
+	}
+	ctx.nworkers = nthreads;
+	ctx.workers = xmemalign(64, sizeof(*ctx.workers) * nthreads);
+	pthread_mutex_init(&ctx.idle_lock, NULL);
+	pthread_cond_init(&ctx.idle_wait, NULL);
+	for (unsigned i = 0; i < nthreads; ++i) {
+		struct walk_worker *w = &ctx.workers[i];
+		w->ctx = &ctx;
+		w->id = i;
+		w->path = NULL;
+		w->path_cap = 0;
+		w->nbatch = 0;
+		w->names_len = 0;
+		pthread_mutex_init(&w->dq.lock, NULL);
+		w->dq.items = NULL;
+		w->dq.head = w->dq.tail = w->dq.cap = 0;
+	}
+
+	if ((rc = walk_root(&ctx, root)))
+		goto out;
+
+	unsigned started = 0;
+	for (; started < nthreads; ++started) {
+		struct walk_worker *w = &ctx.workers[started];
+		if (pthread_create(&w->tid, NULL, walk_worker, w))
+			break;
+	}
+	/* work only lands in deques of running workers, idle ones are harmless */
+	if (!started)
+		walk_worker(&ctx.workers[0]);
+	for (unsigned i = 0; i < started; ++i)
+		pthread_join(ctx.workers[i].tid, NULL);
+	rc = ctx.rc;
+
+out:
+	for (unsigned i = 0; i < nthreads; ++i) {
+		struct walk_worker *w = &ctx.workers[i];
+		struct walk_dir *d;
+		while ((d = walk_take(&w->dq, 0)))
+			free(d);
+		free(w->dq.items);
+		pthread_mutex_destroy(&w->dq.lock);
+		free(w->path);
+	}
+	pthread_cond_destroy(&ctx.idle_wait);
+	pthread_mutex_destroy(&ctx.idle_lock);
+	free(ctx.workers);
+	return rc;
+}
@@ -0,0 +1,986 @@
+#include <ext2fs/ext2fs.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "e2img.h"
+#include "common.h"
+
+/*
+ * Write path. File data is held per inode and only given blocks when the
+ * inode is flushed, so a file written front to back gets one contiguous
+ * allocation and goes out in a few large writes. Directory, map and
+ * inode table blocks are modified in the block cache, e2img_bcache_flush
+ * writes them back sorted.
+ */
+
+#define WB_MEM_MAX (64 << 20)	/* delayed data held before everything is flushed */
+
+static inline
+void dlink_add_tail(struct e2img_dlink *head, struct e2img_dlink *l)
+{
+	l->prev = head->prev;
+	l->next = head;
+	head->prev->next = l;
+	head->prev = l;
+}
+
+static inline
+void dlink_del(struct e2img_dlink *l)
+{
+	l->prev->next = l->next;
+	l->next->prev = l->prev;
+	l->prev = l->next = l;
+}
+
+static
+void inode_touch(struct e2img_inode *ip, int modified)
+{
+	uint32_t now = time(NULL);
+
+	ip->i.i_ctime = now;
+	if (modified)
+		ip->i.i_mtime = now;
+}
+
+/* The block map covers i_size, it is rebuilt on next use */
+static
+void inode_set_size(struct e2img *fs, struct e2img_inode *ip, ext2_off64_t size)
+{
+	ip->i.i_size = size;
+	ip->i.i_size_high = size >> 32;
+	e2img_inode_drop_bmap(fs, ip);
+}
+
+static inline
+void inode_add_blocks(struct e2img *fs, struct e2img_inode *ip, int64_t n)
+{
+	ip->i.i_blocks += n * (int64_t) (fs->blk_sz / 512);
+}
+
+static inline
+blk64_t inode_goal(struct e2img *fs, struct e2img_inode *ip)
+{
+	dgrp_t g = (ip->ino - 1) / EXT2_INODES_PER_GROUP(fs->sb);
+	return fs->sb->s_first_data_block + (blk64_t) g * EXT2_BLOCKS_PER_GROUP(fs->sb);
+}
+
+static
+ext2_off64_t file_max_size(struct e2img *fs)
+{
+	uint64_t per_blk = EXT2_ADDR_PER_BLOCK(fs->sb);
+	uint64_t nblocks = EXT2_NDIR_BLOCKS + per_blk + per_blk * per_blk +
+		per_blk * per_blk * per_blk;
+
+	nblocks = min(nblocks, (uint64_t) UINT32_MAX);
+	if (!(fs->sb->s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_LARGE_FILE))
+		return min(nblocks * fs->blk_sz, (uint64_t) INT32_MAX);
+	return nblocks * fs->blk_sz;
+}
+
+/*
+ * Points file block lblk at pblk, allocating missing indirect blocks near
+ * it. *nmeta is increased by the number of those.
+ */
+static
+int map_set(struct e2img *fs, struct e2img_inode *ip, blk_t lblk, blk_t pblk,
+		blk_t *nmeta)
+{
+	int rc = 0;
+	blk_t per_blk = EXT2_ADDR_PER_BLOCK(fs->sb);
+	blk_t level[3];
+	int depth = 0;
+
+	if (lblk < EXT2_NDIR_BLOCKS) {
+		ip->i.i_block[lblk] = pblk;
+		return 0;
+	}
+	lblk -= EXT2_NDIR_BLOCKS - 1;
+	for (; depth < ARRAY_SIZE(level) && lblk; ++depth) {
+		level[depth] = --lblk % per_blk;
+		lblk /= per_blk;
+	}
+	if (lblk)
+		return -EFBIG;
+
+	void *parent = NULL;
+	blk_t parent_no = 0;
+	blk_t *slot = &ip->i.i_block[EXT2_IND_BLOCK - 1 + depth];
+	for (int i = depth; i > 0; --i) {
+		void *blk;
+		blk_t no = *slot;
+
+		if (!no) {
+			blk64_t start;
+			blk_t got;
+			if ((rc = e2img_alloc_blocks(fs, pblk, 1, &start, &got)) < 0)
+				goto out;
+			if ((rc = e2img_bcache_access(fs, start, &blk)) < 0) {
+				e2img_free_blocks(fs, start, 1);
+				goto out;
+			}
+			memset(blk, 0, fs->blk_sz);
+			no = *slot = start;
+			(*nmeta)++;
+			if (parent && (rc = e2img_bcache_dirty(fs, parent_no, parent)) < 0) {
+				e2img_bcache_release(fs, blk);
+				goto out;
+			}
+		} else if ((rc = e2img_bcache_access(fs, no, &blk)) < 0) {
+			goto out;
+		}
+		if (parent)
+			e2img_bcache_release(fs, parent);
+		parent = blk;
+		parent_no = no;
+		slot = &((blk_t *) blk)[level[i - 1]];
+	}
+	*slot = pblk;
+	rc = e2img_bcache_dirty(fs, parent_no, parent);
+out:
+	if (parent)
+		e2img_bcache_release(fs, parent);
+	return rc;
+}
+
+/* Freed blocks are gathered into runs, one bitmap update per run */
+struct free_run {
+	blk64_t	start;
+	blk_t	len;
+	blk_t	total;
+};
+
+static
+int free_run_flush(struct e2img *fs, struct free_run *run)
+{
+	if (!run->len)
+		return 0;
+	run->total += run->len;
+	blk_t len = run->len;
+	run->len = 0;
+	return e2img_free_blocks(fs, run->start, len);
+}
+
+static
+int free_run_add(struct e2img *fs, struct free_run *run, blk64_t blkno)
+{
+	if (run->len && run->start + run->len == blkno) {
+		run->len++;
+		return 0;
+	}
+	int rc = free_run_flush(fs, run);
+	run->start = blkno;
+	run->len = 1;
+	return rc;
+}
+
+/*
+ * Frees whatever the tree under *slot maps at or past file block keep,
+ * base is the first file block it covers. Returns 1 if *slot was cleared.
+ */
+static
+int trunc_indir(struct e2img *fs, struct free_run *run, blk_t *slot, int depth,
+		uint64_t base, uint64_t span, uint64_t keep)
+{
+	int rc = 0, changed = 0;
+	blk_t per_blk = EXT2_ADDR_PER_BLOCK(fs->sb);
+	blk_t no = *slot;
+
+	if (!no || base + span <= keep)
+		return 0;
+	if (depth) {
+		void *blk;
+		uint64_t sub = span / per_blk;
+
+		if ((rc = e2img_bcache_access(fs, no, &blk)) < 0)
+			return rc;
+		for (blk_t i = 0; i < per_blk; ++i) {
+			if ((rc = trunc_indir(fs, run, &((blk_t *) blk)[i], depth - 1,
+					base + i * sub, sub, keep)) < 0)
+				break;
+			changed |= rc;
+		}
+		if (rc >= 0 && changed && base < keep)
+			rc = e2img_bcache_dirty(fs, no, blk);
+		e2img_bcache_release(fs, blk);
+		if (rc < 0)
+			return rc;
+		if (base < keep)
+			return 0;
+	}
+	*slot = 0;
+	return (rc = free_run_add(fs, run, no)) < 0 ? rc : 1;
+}
+
+/* Frees data and map blocks from file block keep on */
+static
+int inode_free_blocks(struct e2img *fs, struct e2img_inode *ip, uint64_t keep)
+{
+	int rc = 0;
+	struct free_run run = { 0 };
+	blk_t per_blk = EXT2_ADDR_PER_BLOCK(fs->sb);
+
+	for (uint64_t i = keep; i < EXT2_NDIR_BLOCKS && rc >= 0; ++i) {
+		if (!ip->i.i_block[i])
+			continue;
+		rc = free_run_add(fs, &run, ip->i.i_block[i]);
+		ip->i.i_block[i] = 0;
+	}
+	uint64_t base = EXT2_NDIR_BLOCKS, span = per_blk;
+	for (int depth = 1; depth <= 3 && rc >= 0; ++depth) {
+		rc = trunc_indir(fs, &run, &ip->i.i_block[EXT2_IND_BLOCK + depth - 1],
+				depth, base, span, keep);
+		base += span;
+		span *= per_blk;
+	}
+	int frc = free_run_flush(fs, &run);
+	inode_add_blocks(fs, ip, -(int64_t) run.total);
+	e2img_inode_drop_bmap(fs, ip);
+	return rc < 0 ? rc : frc;
+}
+
+/* Index of the first pending block at or after lblk */
+static
+size_t wb_find(struct e2img_wbuf *wb, blk_t lblk)
+{
+	size_t lo = 0, hi = wb->len;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (wb->blk[mid].lblk < lblk)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static inline
+int wb_has(struct e2img_wbuf *wb, blk_t lblk)
+{
+	size_t i;
+	return wb && (i = wb_find(wb, lblk)) < wb->len && wb->blk[i].lblk == lblk;
+}
+
+static
+void wb_attach(struct e2img *fs, struct e2img_inode *ip)
+{
+	struct e2img_wbuf *wb = xmalloc(sizeof(*wb));
+
+	wb->ip = e2img_igrab(fs, ip);
+	wb->len = 0;
+	wb->cap = 16;
+	wb->blk = xmalloc(sizeof(*wb->blk) * wb->cap);
+	dlink_add_tail(&fs->wb_list, &wb->link);
+	ip->wb = wb;
+}
+
+/* Drops pending blocks from lblk on */
+static
+void wb_drop_from(struct e2img *fs, struct e2img_wbuf *wb, blk_t lblk)
+{
+	size_t first = wb_find(wb, lblk);
+	for (size_t i = first; i < wb->len; ++i) {
+		free(wb->blk[i].data);
+		fs->wb_mem -= fs->blk_sz;
+	}
+	wb->len = first;
+}
+
+/* Throws the pending data away and drops its reference, ip may be gone after */
+static
+void wb_detach(struct e2img *fs, struct e2img_inode *ip)
+{
+	struct e2img_wbuf *wb = ip->wb;
+
+	if (!wb)
+		return;
+	wb_drop_from(fs, wb, 0);
+	free(wb->blk);
+	dlink_del(&wb->link);
+	ip->wb = NULL;
+	free(wb);
+	e2img_iput(fs, ip);
+}
+
+/*
+ * Pending buffer for file block lblk. A new one starts out with the
+ * current contents if fill is set, the caller overwrites all of it
+ * otherwise.
+ */
+static
+int wb_get(struct e2img *fs, struct e2img_inode *ip, blk_t lblk, int fill, void **data)
+{
+	ssize_t rc;
+
+	if (!ip->wb)
+		wb_attach(fs, ip);
+	struct e2img_wbuf *wb = ip->wb;
+	size_t i = wb_find(wb, lblk);
+	if (i < wb->len && wb->blk[i].lblk == lblk) {
+		*data = wb->blk[i].data;
+		return 0;
+	}
+
+	void *buf = xmemalign(fs->blk_sz, fs->blk_sz);
+	if (fill) {
+		rc = e2img_file_read(fs, ip, buf, fs->blk_sz, (ext2_off64_t) lblk * fs->blk_sz);
+		if (rc < 0) {
+			free(buf);
+			return rc;
+		}
+		memset(ptr_add(buf, rc), 0, fs->blk_sz - rc);
+	}
+	if (wb->len == wb->cap) {
+		wb->cap *= 2;
+		wb->blk = realloc(wb->blk, sizeof(*wb->blk) * wb->cap);
+		release_assert(wb->blk);
+	}
+	memmove(&wb->blk[i + 1], &wb->blk[i], sizeof(*wb->blk) * (wb->len - i));
+	wb->blk[i].lblk = lblk;
+	wb->blk[i].data = buf;
+	wb->len++;
+	fs->wb_mem += fs->blk_sz;
+	*data = buf;
+	return 0;
+}
+
+/* Copies pending blocks over what e2img_file_read got from disk */
+void e2img_wbuf_overlay(struct e2img_inode *ip, size_t blk_sz, void *buf,
+		size_t size, ext2_off64_t off)
+{
+	struct e2img_wbuf *wb = ip->wb;
+
+	if (!wb || !size)
+		return;
+	for (size_t i = wb_find(wb, off / blk_sz); i < wb->len; ++i) {
+		ext2_off64_t start = (ext2_off64_t) wb->blk[i].lblk * blk_sz;
+		if (start >= off + size)
+			break;
+		ext2_off64_t from = max(start, off);
+		ext2_off64_t to = min(start + blk_sz, off + size);
+		memcpy(ptr_add(buf, from - off), ptr_add(wb->blk[i].data, from - start),
+				to - from);
+	}
+}
+
+static
+int wb_flush_all(struct e2img *fs)
+{
+	int rc;
+
+	while (fs->wb_list.next != &fs->wb_list) {
+		struct e2img_wbuf *wb = container_of(fs->wb_list.next,
+				struct e2img_wbuf, link);
+		if ((rc = e2img_inode_flush(fs, wb->ip)) < 0)
+			return rc;
+	}
+	return 0;
+}
+
+ssize_t e2img_file_write(struct e2img *fs, struct e2img_inode *ip,
+		void const *buf, size_t size, ext2_off64_t off)
+{
+	ssize_t rc = 0;
+	size_t done = 0;
+	ext2_off64_t fsize = EXT2_I_SIZE(&ip->i), max_size = file_max_size(fs);
+
+	if (!fs->writable)
+		return -EROFS;
+	if (LINUX_S_ISDIR(ip->i.i_mode))
+		return -EISDIR;
+	if (!LINUX_S_ISREG(ip->i.i_mode))
+		return -EINVAL;
+	if (!size)
+		return 0;
+	if (off >= max_size)
+		return -EFBIG;
+	size = min(size, max_size - off);
+
+	while (done < size) {
+		void *data;
+		ext2_off64_t pos = off + done;
+		size_t boff = pos % fs->blk_sz;
+		size_t len = min(fs->blk_sz - boff, size - done);
+		int partial = boff || len < fs->blk_sz;
+
+		if ((rc = wb_get(fs, ip, pos / fs->blk_sz, partial, &data)) < 0)
+			break;
+		memcpy(ptr_add(data, boff), ptr_add(buf, done), len);
+		done += len;
+	}
+	if (!done)
+		return rc;
+	if (off + done > fsize)
+		inode_set_size(fs, ip, off + done);
+	inode_touch(ip, 1);
+	if (fs->wb_mem > WB_MEM_MAX && (rc = wb_flush_all(fs)) < 0)
+		return rc;
+	return done;
+}
+
+/*
+ * Delayed allocation: unmapped pending blocks get blocks in runs as long
+ * as their file offsets are contiguous, placed after the previous block
+ * of the file. Data then goes out in one write per physical run.
+ */
+int e2img_inode_flush(struct e2img *fs, struct e2img_inode *ip)
+{
+	int rc = 0;
+	struct e2img_wbuf *wb = ip->wb;
+	blk_t nalloc = 0;
+
+	if (!wb)
+		return 0;
+	if (ip->unlinked) {
+		wb_detach(fs, ip);
+		return 0;
+	}
+
+	blk64_t *pblk = xmalloc(sizeof(*pblk) * wb->len);
+	void **run = xmalloc(sizeof(*run) * wb->len);
+	blk64_t goal = inode_goal(fs, ip);
+
+	for (size_t i = 0; i < wb->len;) {
+		blk_t cur;
+		if (!(rc = e2img_inode_get_blkno(fs, &ip->i, wb->blk[i].lblk, &cur))) {
+			pblk[i++] = cur;
+			goal = cur + 1;
+			continue;
+		}
+		if (rc != -ENODATA)
+			goto out;
+
+		size_t end = i + 1;
+		while (end < wb->len && wb->blk[end].lblk == wb->blk[end - 1].lblk + 1 &&
+				e2img_inode_get_blkno(fs, &ip->i, wb->blk[end].lblk,
+					&cur) == -ENODATA)
+			end++;
+		while (i < end) {
+			blk64_t start;
+			blk_t got;
+			if ((rc = e2img_alloc_blocks(fs, goal, end - i, &start, &got)) < 0)
+				goto out;
+			for (blk_t n = 0; n < got; ++n, ++i) {
+				pblk[i] = start + n;
+				if ((rc = map_set(fs, ip, wb->blk[i].lblk, start + n, &nalloc)) < 0) {
+					e2img_free_blocks(fs, start + n, got - n);
+					goto out;
+				}
+				nalloc++;
+			}
+			goal = start + got;
+		}
+	}
+	rc = 0;
+
+	for (size_t i = 0; i < wb->len;) {
+		size_t n = 0;
+		while (i + n < wb->len && pblk[i + n] == pblk[i] + n) {
+			run[n] = wb->blk[i + n].data;
+			n++;
+		}
+		if ((rc = e2img_blk_writev(fs, pblk[i], run, n)) < 0)
+			goto out;
+		i += n;
+	}
+out:
+	free(run);
+	free(pblk);
+	inode_add_blocks(fs, ip, nalloc);
+	e2img_inode_drop_bmap(fs, ip);
+	int wrc = e2img_inode_write(fs, ip, 0);
+	if (!rc)
+		rc = wrc;
+	if (!rc)
+		wb_detach(fs, ip);
+	return rc;
+}
+
+int e2img_truncate(struct e2img *fs, struct e2img_inode *ip, ext2_off64_t size)
+{
+	int rc;
+	ext2_off64_t fsize = EXT2_I_SIZE(&ip->i);
+
+	if (!fs->writable)
+		return -EROFS;
+	if (LINUX_S_ISDIR(ip->i.i_mode))
+		return -EISDIR;
+	if (!LINUX_S_ISREG(ip->i.i_mode))
+		return -EINVAL;
+	if (size > file_max_size(fs))
+		return -EFBIG;
+
+	if (size < fsize) {
+		blk_t keep = div_rup(size, fs->blk_sz);
+		blk_t tail = size / fs->blk_sz, cur;
+		size_t boff = size % fs->blk_sz;
+
+		/* the cut off part of the last block must read back as zeros */
+		if (boff && (wb_has(ip->wb, tail) ||
+				!e2img_inode_get_blkno(fs, &ip->i, tail, &cur))) {
+			void *data;
+			if ((rc = wb_get(fs, ip, tail, 1, &data)) < 0)
+				return rc;
+			memset(ptr_add(data, boff), 0, fs->blk_sz - boff);
+		}
+		if (ip->wb)
+			wb_drop_from(fs, ip->wb, keep);
+		if ((rc = inode_free_blocks(fs, ip, keep)) < 0)
+			return rc;
+	}
+	inode_set_size(fs, ip, size);
+	inode_touch(ip, 1);
+	return e2img_inode_write(fs, ip, 0);
+}
+
+/* Fast symlinks and device inodes keep no block numbers in i_block */
+static
+int inode_has_blocks(struct e2img *fs, struct e2img_inode *ip)
+{
+	uint16_t mode = ip->i.i_mode;
+
+	if (LINUX_S_ISREG(mode) || LINUX_S_ISDIR(mode))
+		return 1;
+	if (LINUX_S_ISLNK(mode))
+		return !e2img_is_fast_symlink(fs, &ip->i);
+	return 0;
+}
+
+static
+int xattr_block_put(struct e2img *fs, blk_t blkno)
+{
+	int rc;
+	void *blk;
+
+	if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
+		return rc;
+	struct ext2_ext_attr_header *hdr = blk;
+	if (hdr->h_magic != EXT2_EXT_ATTR_MAGIC) {
+		e2img_bcache_release(fs, blk);
+		return -EIO;
+	}
+	if (hdr->h_refcount > 1) {
+		hdr->h_refcount--;
+		rc = e2img_bcache_dirty(fs, blkno, blk);
+		e2img_bcache_release(fs, blk);
+		return rc;
+	}
+	e2img_bcache_release(fs, blk);
+	return e2img_free_blocks(fs, blkno, 1);
+}
+
+/*
+ * Called by the last e2img_iput of an inode with no links left: gives its
+ * blocks and the inode itself back. Errors leave leaked space only.
+ */
+void e2img_inode_evict(struct e2img *fs, struct e2img_inode *ip)
+{
+	wb_detach(fs, ip);
+	if (inode_has_blocks(fs, ip))
+		inode_free_blocks(fs, ip, 0);
+	if (ip->i.i_file_acl && !xattr_block_put(fs, ip->i.i_file_acl))
+		ip->i.i_file_acl = 0;
+	ip->i.i_dtime = time(NULL);
+	if (e2img_inode_write(fs, ip, 0) < 0)
+		return;
+	e2img_free_inode(fs, ip->ino, LINUX_S_ISDIR(ip->i.i_mode));
+}
+
+static
+int mode_ftype(uint16_t mode)
+{
+	switch (mode & LINUX_S_IFMT) {
+	case LINUX_S_IFREG:	return EXT2_FT_REG_FILE;
+	case LINUX_S_IFDIR:	return EXT2_FT_DIR;
+	case LINUX_S_IFCHR:	return EXT2_FT_CHRDEV;
+	case LINUX_S_IFBLK:	return EXT2_FT_BLKDEV;
+	case LINUX_S_IFIFO:	return EXT2_FT_FIFO;
+	case LINUX_S_IFSOCK:	return EXT2_FT_SOCK;
+	case LINUX_S_IFLNK:	return EXT2_FT_SYMLINK;
+	}
+	return EXT2_FT_UNKNOWN;
+}
+
+static
+void dirent_fill(struct e2img *fs, struct ext2_dir_entry *d, char const *name,
+		size_t len, ext2_ino_t ino, uint16_t mode)
+{
+	d->inode = ino;
+	d->name_len = 0;
+	ext2fs_dirent_set_name_len(d, len);
+	if (fs->sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE)
+		ext2fs_dirent_set_file_type(d, mode_ftype(mode));
+	memcpy(d->name, name, len);
+}
+
+/* Slot for an entry of rec_len need, split off the slack of a live entry */
+static
+struct ext2_dir_entry *dirent_make_room(struct e2img *fs, void *blk, size_t need)
+{
+	for (size_t off = 0; off < fs->blk_sz;) {
+		struct ext2_dir_entry *d = ptr_add(blk, off);
+		if (d->rec_len < EXT2_DIR_REC_LEN(0) || off + d->rec_len > fs->blk_sz)
+			return NULL;
+		size_t used = d->inode ? EXT2_DIR_REC_LEN(ext2fs_dirent_name_len(d)) : 0;
+		if (d->rec_len - used >= need) {
+			if (!used)
+				return d;
+			struct ext2_dir_entry *n = ptr_add(d, used);
+			n->rec_len = d->rec_len - used;
+			d->rec_len = used;
+			return n;
+		}
+		off += d->rec_len;
+	}
+	return NULL;
+}
+
+/* Allocates and maps file block lblk of a directory, returned zeroed and held */
+static
+int dir_new_block(struct e2img *fs, struct e2img_inode *dir, blk_t lblk, blk64_t goal,
+		blk64_t *pblk, void **blk)
+{
+	int rc;
+	blk_t got, nmeta = 0;
+
+	if ((rc = e2img_alloc_blocks(fs, goal, 1, pblk, &got)) < 0)
+		return rc;
+	rc = map_set(fs, dir, lblk, *pblk, &nmeta);
+	inode_add_blocks(fs, dir, nmeta);
+	if (rc < 0 || (rc = e2img_bcache_access(fs, *pblk, blk)) < 0) {
+		map_set(fs, dir, lblk, 0, &nmeta);
+		e2img_free_blocks(fs, *pblk, 1);
+		return rc;
+	}
+	inode_add_blocks(fs, dir, 1);
+	memset(*blk, 0, fs->blk_sz);
+	return 0;
+}
+
+/*
+ * First fit over the existing blocks, else a new block at the end. A
+ * hashed index would not know about the entry, the directory turns back
+ * into a plain linear one.
+ */
+static
+int dir_add(struct e2img *fs, struct e2img_inode *dir, char const *name, size_t len,
+		ext2_ino_t ino, uint16_t mode)
+{
+	int rc;
+	void *blk;
+	blk_t cur;
+	blk64_t pblk, goal = inode_goal(fs, dir);
+	size_t need = EXT2_DIR_REC_LEN(len);
+	blk_t nblocks = EXT2_I_SIZE(&dir->i) / fs->blk_sz;
+
+	for (blk_t lblk = 0; lblk < nblocks; ++lblk) {
+		if ((rc = e2img_inode_get_blkno(fs, &dir->i, lblk, &cur)) == -ENODATA)
+			continue;
+		if (rc < 0)
+			return rc;
+		goal = cur + 1;
+		if ((rc = e2img_bcache_access(fs, cur, &blk)) < 0)
+			return rc;
+		struct ext2_dir_entry *d = dirent_make_room(fs, blk, need);
+		if (d) {
+			dirent_fill(fs, d, name, len, ino, mode);
+			rc = e2img_bcache_dirty(fs, cur, blk);
+			e2img_bcache_release(fs, blk);
+			if (rc < 0)
+				return rc;
+			goto done;
+		}
+		e2img_bcache_release(fs, blk);
+	}
+
+	if ((rc = dir_new_block(fs, dir, nblocks, goal, &pblk, &blk)) < 0)
+		return rc;
+	struct ext2_dir_entry *d = blk;
+	d->rec_len = fs->blk_sz;
+	dirent_fill(fs, d, name, len, ino, mode);
+	rc = e2img_bcache_dirty(fs, pblk, blk);
+	e2img_bcache_release(fs, blk);
+	if (rc < 0)
+		return rc;
+	inode_set_size(fs, dir, (ext2_off64_t) (nblocks + 1) * fs->blk_sz);
+done:
+	dir->i.i_flags &= ~EXT2_INDEX_FL;
+	inode_touch(dir, 1);
+	return e2img_inode_write(fs, dir, 0);
+}
+
+/* Removed entries are merged into the previous one in their block */
+static
+int dir_remove(struct e2img *fs, struct e2img_inode *dir, char const *name, size_t len)
+{
+	int rc;
+	void *blk;
+	blk_t cur;
+	blk_t nblocks = EXT2_I_SIZE(&dir->i) / fs->blk_sz;
+
+	for (blk_t lblk = 0; lblk < nblocks; ++lblk) {
+		if ((rc = e2img_inode_get_blkno(fs, &dir->i, lblk, &cur)) == -ENODATA)
+			continue;
+		if (rc < 0)
+			return rc;
+		if ((rc = e2img_bcache_access(fs, cur, &blk)) < 0)
+			return rc;
+
+		struct ext2_dir_entry *prev = NULL;
+		for (size_t off = 0; off < fs->blk_sz;) {
+			struct ext2_dir_entry *d = ptr_add(blk, off);
+			if (d->rec_len < EXT2_DIR_REC_LEN(0) || off + d->rec_len > fs->blk_sz) {
+				e2img_bcache_release(fs, blk);
+				return -EIO;
+			}
+			if (d->inode && ext2fs_dirent_name_len(d) == len &&
+					!memcmp(d->name, name, len)) {
+				if (prev)
+					prev->rec_len += d->rec_len;
+				else
+					d->inode = 0;
+				rc = e2img_bcache_dirty(fs, cur, blk);
+				e2img_bcache_release(fs, blk);
+				if (rc < 0)
+					return rc;
+				inode_touch(dir, 1);
+				return e2img_inode_write(fs, dir, 0);
+			}
+			prev = d;
+			off += d->rec_len;
+		}
+		e2img_bcache_release(fs, blk);
+	}
+	return -ENOENT;
+}
+
+/* First block of a new directory, with "." and ".." */
+static
+int dir_init(struct e2img *fs, struct e2img_inode *ip, ext2_ino_t parent)
+{
+	int rc;
+	void *blk;
+	blk64_t pblk;
+
+	if ((rc = dir_new_block(fs, ip, 0, inode_goal(fs, ip), &pblk, &blk)) < 0)
+		return rc;
+	struct ext2_dir_entry *d = blk;
+	d->rec_len = EXT2_DIR_REC_LEN(1);
+	dirent_fill(fs, d, ".", 1, ip->ino, LINUX_S_IFDIR);
+	d = ptr_add(d, d->rec_len);
+	d->rec_len = fs->blk_sz - EXT2_DIR_REC_LEN(1);
+	dirent_fill(fs, d, "..", 2, parent, LINUX_S_IFDIR);
+	rc = e2img_bcache_dirty(fs, pblk, blk);
+	e2img_bcache_release(fs, blk);
+	inode_set_size(fs, ip, fs->blk_sz);
+	return rc;
+}
+
+static
+int dir_check_name(struct e2img_inode *dir, char const *name, size_t len)
+{
+	if (!LINUX_S_ISDIR(dir->i.i_mode))
+		return -ENOTDIR;
+	if (!len)
+		return -EINVAL;
+	if (len > EXT2_NAME_LEN)
+		return -ENAMETOOLONG;
+	return 0;
+}
+
+/*
+ * Creates a regular file or, for LINUX_S_IFDIR, an empty directory named
+ * name in dir. The new inode is returned referenced.
+ */
+int e2img_create(struct e2img *fs, struct e2img_inode *dir, char const *name,
+		size_t len, uint16_t mode, uid_t uid, gid_t gid,
+		struct e2img_inode **ipp)
+{
+	int rc;
+	ext2_ino_t ino;
+	struct e2img_inode *ip;
+	int is_dir = LINUX_S_ISDIR(mode);
+
+	if (!fs->writable)
+		return -EROFS;
+	if ((rc = dir_check_name(dir, name, len)) < 0)
+		return rc;
+	if (!is_dir && !LINUX_S_ISREG(mode))
+		return -EOPNOTSUPP;
+	if (is_dir && dir->i.i_links_count >= EXT2_LINK_MAX)
+		return -EMLINK;
+	if (!(rc = e2img_dir_lookup(fs, dir, name, len, &ino)))
+		return -EEXIST;
+	if (rc != -ENOENT)
+		return rc;
+
+	if ((rc = e2img_alloc_inode(fs, dir->ino, is_dir, &ino)) < 0)
+		return rc;
+	if ((rc = e2img_iget(fs, ino, &ip)) < 0) {
+		e2img_free_inode(fs, ino, is_dir);
+		return rc;
+	}
+
+	uint32_t now = time(NULL);
+	memset(&ip->i, 0, sizeof(ip->i));
+	ip->i.i_mode = mode;
+	ip->i.i_uid = uid;
+	ip->i.osd2.linux2.l_i_uid_high = uid >> 16;
+	ip->i.i_gid = gid;
+	ip->i.osd2.linux2.l_i_gid_high = gid >> 16;
+	ip->i.i_atime = ip->i.i_ctime = ip->i.i_mtime = now;
+	ip->i.i_links_count = is_dir ? 2 : 1;
+	e2img_inode_drop_bmap(fs, ip);
+
+	if ((rc = e2img_inode_write(fs, ip, 1)) < 0)
+		goto errout;
+	if (is_dir && (rc = dir_init(fs, ip, dir->ino)) < 0)
+		goto errout;
+	if ((rc = e2img_inode_write(fs, ip, 0)) < 0)
+		goto errout;
+	if ((rc = dir_add(fs, dir, name, len, ino, mode)) < 0)
+		goto errout;
+	e2img_dcache_invalidate(&fs->dcache, dir->ino, name, len);
+	if (is_dir) {
+		dir->i.i_links_count++;
+		if ((rc = e2img_inode_write(fs, dir, 0)) < 0) {
+			e2img_iput(fs, ip);
+			return rc;
+		}
+	}
+	*ipp = ip;
+	return 0;
+errout:
+	/* the last put gives back what was allocated so far */
+	ip->i.i_links_count = 0;
+	ip->unlinked = 1;
+	e2img_iput(fs, ip);
+	return rc;
+}
+
+/* Drops one link, the inode goes away with its last reference */
+static
+int inode_unlink(struct e2img *fs, struct e2img_inode *ip)
+{
+	if (ip->i.i_links_count)
+		ip->i.i_links_count--;
+	inode_touch(ip, 0);
+	if (!ip->i.i_links_count) {
+		ip->unlinked = 1;
+		wb_detach(fs, ip);
+	}
+	return e2img_inode_write(fs, ip, 0);
+}
+
+int e2img_unlink(struct e2img *fs, struct e2img_inode *dir, char const *name,
+		size_t len)
+{
+	int rc;
+	ext2_ino_t ino;
+	struct e2img_inode *ip;
+
+	if (!fs->writable)
+		return -EROFS;
+	if ((rc = dir_check_name(dir, name, len)) < 0)
+		return rc;
+	if ((rc = e2img_dir_lookup(fs, dir, name, len, &ino)) < 0)
+		return rc;
+	if ((rc = e2img_iget(fs, ino, &ip)) < 0)
+		return rc;
+	if (LINUX_S_ISDIR(ip->i.i_mode)) {
+		rc = -EISDIR;
+		goto out;
+	}
+	if ((rc = dir_remove(fs, dir, name, len)) < 0)
+		goto out;
+	e2img_dcache_invalidate(&fs->dcache, dir->ino, name, len);
+	rc = inode_unlink(fs, ip);
+out:
+	e2img_iput(fs, ip);
+	return rc;
+}
+
+struct dir_empty_data {
+	int	nentries;
+};
+
+static
+int dir_count_entry(struct ext2_dir_entry *dirent, void *priv)
+{
+	struct dir_empty_data *d = priv;
+	size_t len = ext2fs_dirent_name_len(dirent);
+
+	if ((len == 1 && dirent->name[0] == '.') ||
+			(len == 2 && dirent->name[0] == '.' && dirent->name[1] == '.'))
+		return 0;
+	d->nentries++;
+	return 1;
+}
+
+int e2img_rmdir(struct e2img *fs, struct e2img_inode *dir, char const *name,
+		size_t len)
+{
+	int rc;
+	ext2_ino_t ino;
+	struct e2img_inode *ip;
+	struct dir_empty_data data = { 0 };
+
+	if (!fs->writable)
+		return -EROFS;
+	if ((rc = dir_check_name(dir, name, len)) < 0)
+		return rc;
+	if (len == 1 && name[0] == '.')
+		return -EINVAL;
+	if (len == 2 && name[0] == '.' && name[1] == '.')
+		return -ENOTEMPTY;
+	if ((rc = e2img_dir_lookup(fs, dir, name, len, &ino)) < 0)
+		return rc;
+	if ((rc = e2img_iget(fs, ino, &ip)) < 0)
+		return rc;
+	if (!LINUX_S_ISDIR(ip->i.i_mode)) {
+		rc = -ENOTDIR;
+		goto out;
+	}
+	if ((rc = e2img_iterate_dir(fs, ip, dir_count_entry, &data)) < 0)
+		goto out;
+	if (data.nentries) {
+		rc = -ENOTEMPTY;
+		goto out;
+	}
+	if ((rc = dir_remove(fs, dir, name, len)) < 0)
+		goto out;
+	e2img_dcache_invalidate(&fs->dcache, dir->ino, name, len);
+	e2img_dcache_invalidate_dir(&fs->dcache, ino);
+
+	ip->i.i_links_count = 1;
+	if ((rc = inode_unlink(fs, ip)) < 0)
+		goto out;
+	if (dir->i.i_links_count > 2)
+		dir->i.i_links_count--;
+	rc = e2img_inode_write(fs, dir, 0);
+out:
+	e2img_iput(fs, ip);
+	return rc;
+}
+
+/*
+ * Makes the image consistent on disk: delayed data gets its blocks,
+ * descriptors and superblock are updated, then all dirty metadata goes
+ * out in block order.
+ */
+int e2img_sync(struct e2img *fs)
+{
+	int rc;
+
+	if (!fs->writable)
+		return 0;
+	if ((rc = wb_flush_all(fs)) < 0)
+		return rc;
+	if ((rc = e2img_sync_meta(fs)) < 0)
+		return rc;
+	if ((rc = e2img_bcache_flush(fs)) < 0)
+		return rc;
+	return fsync(fs->fd) < 0 ? -errno : 0;
+}
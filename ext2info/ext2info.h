@@ -0,0 +1,10 @@
+#ifndef _EXT2INFO_H
+#define _EXT2INFO_H
+
+#include <ext2fs/ext2fs.h>
+
+#include "e2img.h"
+
+int ext2info_extract(struct e2img *fs, ext2_ino_t ino, char const *dest, unsigned nthreads);
+
+#endif /* _EXT2INFO_H */
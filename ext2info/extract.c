@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <ext2fs/ext2fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <search.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/limits.h>
+
+#include "common.h"
+#include "e2img.h"
+#include "ext2info.h"
+
+/*
+ * Copy-out of a subtree to the host. Runs on e2img_walk threads: files are
+ * written as they are reported, physical run by physical run, holes are
+ * left unwritten. Directory modes and times are applied at the end, deepest
+ * first, so filling a directory doesn't undo them.
+ */
+
+#define EXTRACT_IO_SIZE (1 << 20)
+
+struct extract_link {
+	ext2_ino_t	ino;
+	char		path[];
+};
+
+struct extract_dir {
+	unsigned	depth;
+	uint16_t	mode;
+	uid_t		uid;
+	gid_t		gid;
+	uint32_t	atime;
+	uint32_t	mtime;
+	char		*path;
+};
+
+struct extract_ctx {
+	char const		*dest;
+	int			dirfd;		/* dest, once the root is created */
+	int			no_cfr;		/* copy_file_range can't be used */
+	int			chown;
+	int			failed;		/* an entry failed, already reported */
+	pthread_mutex_t		lock;
+	void			*links;		/* tsearch tree, inodes with nlink > 1 */
+	struct extract_dir	*dirs;
+	size_t			ndirs;
+	size_t			dirs_cap;
+	uint64_t		nfiles;
+	uint64_t		nsymlinks;
+	uint64_t		nbytes;
+	uint64_t		nskipped;
+};
+
+static
+int extract_link_cmp(void const *a, void const *b)
+{
+	ext2_ino_t x = ((struct extract_link const *) a)->ino;
+	ext2_ino_t y = ((struct extract_link const *) b)->ino;
+	return (x > y) - (x < y);
+}
+
+/* Where an entry goes: the root maps onto dest itself */
+static inline
+int extract_at(struct extract_ctx *x, char const **path)
+{
+	if (!**path) {
+		*path = x->dest;
+		return AT_FDCWD;
+	}
+	return x->dirfd;
+}
+
+static
+int extract_meta(struct extract_ctx *x, int fd, struct ext2_inode *inode)
+{
+	struct timespec ts[2] = {
+		{ .tv_sec = inode->i_atime },
+		{ .tv_sec = inode->i_mtime },
+	};
+
+	if (x->chown && fchown(fd, inode_uid(*inode), inode_gid(*inode)) < 0)
+		return -errno;
+	/* after chown, which drops suid/sgid */
+	if (fchmod(fd, inode->i_mode & 07777) < 0)
+		return -errno;
+	if (futimens(fd, ts) < 0)
+		return -errno;
+	return 0;
+}
+
+static
+ssize_t extract_write(int fd, void const *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	while (done < len) {
+		ssize_t rc = pwrite(fd, ptr_add(buf, done), len - done, off + done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += rc;
+	}
+	return done;
+}
+
+/* Kernel side copy, 0 if the caller should fall back to read + write */
+static
+ssize_t extract_cfr(struct extract_ctx *x, struct e2img *fs, int fd,
+		off_t in, off_t out, size_t len)
+{
+	ssize_t rc;
+	size_t done = 0;
+
+	if (fs->map || __atomic_load_n(&x->no_cfr, __ATOMIC_RELAXED))
+		return 0;
+	while (done < len) {
+		loff_t ioff = in + done, ooff = out + done;
+		rc = copy_file_range(fs->fd, &ioff, fd, &ooff, len - done, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc < 0 && !done && (errno == EXDEV || errno == EINVAL ||
+				errno == ENOSYS || errno == EOPNOTSUPP)) {
+			__atomic_store_n(&x->no_cfr, 1, __ATOMIC_RELAXED);
+			return 0;
+		}
+		if (rc < 0)
+			return -errno;
+		if (!rc)
+			return -EIO;	/* image shorter than the fs */
+		done += rc;
+	}
+	return done;
+}
+
+static
+int extract_data(struct extract_ctx *x, struct e2img *fs, struct e2img_inode *ip, int fd)
+{
+	ssize_t rc = 0;
+	ext2_off64_t fsize = EXT2_I_SIZE(&ip->i);
+	uint64_t nblocks = div_rup(fsize, fs->blk_sz);
+	size_t bufsz = min((uint64_t) EXTRACT_IO_SIZE, nblocks * fs->blk_sz);
+	void *buf = NULL;
+	struct e2img_ra ra;
+
+	/* inline data is in the cached inode, no blocks behind it */
+	if (ip->idata) {
+		if (fsize > ip->idata_len)
+			return -EIO;
+		rc = extract_write(fd, ip->idata, fsize, 0);
+		return rc < 0 ? rc : 0;
+	}
+	e2img_ra_init(&ra);
+	for (uint64_t lblk = 0; lblk < nblocks;) {
+		struct e2img_extent ext;
+		if ((rc = e2img_inode_map(fs, ip, lblk, &ext)) < 0)
+			goto out;
+		if (!ext.len) {
+			rc = -EIO;
+			goto out;
+		}
+		blk_t len = min((uint64_t) ext.len, nblocks - lblk);
+		ext2_off64_t off = lblk * fs->blk_sz;
+		size_t run = min((uint64_t) len * fs->blk_sz, fsize - off);
+
+		for (size_t done = 0; ext.pblk && done < run;) {
+			size_t n = min(run - done, (size_t) EXTRACT_IO_SIZE);
+			off_t in = ext.pblk * fs->blk_sz + done;
+
+			e2img_readahead(fs, ip, &ra, off + done, n);
+			if ((rc = extract_cfr(x, fs, fd, in, off + done, n)) < 0)
+				goto out;
+			if (!rc) {
+				if (!buf)
+					buf = xmemalign(fs->blk_sz, bufsz);
+				if ((rc = e2img_blk_read(fs, buf, div_rup(n, fs->blk_sz),
+						ext.pblk + done / fs->blk_sz)) < 0)
+					goto out;
+				if ((rc = extract_write(fd, buf, n, off + done)) < 0)
+					goto out;
+			}
+			done += n;
+		}
+		lblk += len;
+	}
+	/* trailing hole, and the exact size */
+	rc = ftruncate(fd, fsize) < 0 ? -errno : 0;
+out:
+	e2img_ra_destroy(&ra);
+	free(buf);
+	return rc;
+}
+
+/*
+ * The first name seen for a multiply linked inode is registered and
+ * created under the lock, later names become hard links to it.
+ * Returns 1 if path was linked and there is nothing left to do.
+ */
+static
+int extract_link_or_create(struct extract_ctx *x, struct e2img_walk_ent const *ent,
+		int dfd, char const *path, int *fd)
+{
+	int rc = 0;
+	struct extract_link key = { .ino = ent->ip->ino };
+
+	pthread_mutex_lock(&x->lock);
+	struct extract_link **found = tfind(&key, &x->links, extract_link_cmp);
+	if (found) {
+		if (linkat(x->dirfd, (*found)->path, dfd, path, 0) < 0)
+			rc = -errno;
+		else
+			rc = 1;
+		goto out;
+	}
+	if ((*fd = openat(dfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+		rc = -errno;
+		goto out;
+	}
+	if (dfd == x->dirfd) {
+		struct extract_link *l = xmalloc(sizeof(*l) + ent->path_len + 1);
+		l->ino = ent->ip->ino;
+		memcpy(l->path, ent->path, ent->path_len + 1);
+		release_assert(tsearch(l, &x->links, extract_link_cmp));
+	}
+out:
+	pthread_mutex_unlock(&x->lock);
+	return rc;
+}
+
+static
+int extract_regfile(struct extract_ctx *x, struct e2img *fs, struct e2img_walk_ent const *ent)
+{
+	int rc, fd = -1;
+	char const *path = ent->path;
+	int dfd = extract_at(x, &path);
+	struct ext2_inode *inode = &ent->ip->i;
+
+	if (inode->i_links_count > 1) {
+		if ((rc = extract_link_or_create(x, ent, dfd, path, &fd)))
+			return rc < 0 ? rc : 0;
+	} else if ((fd = openat(dfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			0600)) < 0) {
+		return -errno;
+	}
+
+	if ((rc = extract_data(x, fs, ent->ip, fd)) < 0)
+		goto out;
+	if ((rc = extract_meta(x, fd, inode)) < 0)
+		goto out;
+	__atomic_fetch_add(&x->nfiles, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&x->nbytes, EXT2_I_SIZE(inode), __ATOMIC_RELAXED);
+out:
+	if (close(fd) < 0 && !rc)
+		rc = -errno;
+	return rc;
+}
+
+/* Mode bits of a link mean nothing, owner and times are kept */
+static
+int extract_symlink(struct extract_ctx *x, struct e2img *fs, struct e2img_walk_ent const *ent)
+{
+	ssize_t rc;
+	char target[PATH_MAX];
+	char const *path = ent->path;
+	int dfd = extract_at(x, &path);
+	struct ext2_inode *inode = &ent->ip->i;
+	struct timespec ts[2] = {
+		{ .tv_sec = inode->i_atime },
+		{ .tv_sec = inode->i_mtime },
+	};
+
+	if ((rc = e2img_readlink(fs, ent->ip, target, sizeof(target) - 1)) < 0)
+		return rc;
+	target[rc] = '\0';
+	if (symlinkat(target, dfd, path) < 0)
+		return -errno;
+	if ((x->chown && fchownat(dfd, path, inode_uid(*inode), inode_gid(*inode),
+			AT_SYMLINK_NOFOLLOW) < 0) ||
+			utimensat(dfd, path, ts, AT_SYMLINK_NOFOLLOW) < 0)
+		return -errno;
+	__atomic_fetch_add(&x->nsymlinks, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static
+int extract_dir(struct extract_ctx *x, struct e2img_walk_ent const *ent)
+{
+	char const *path = ent->path;
+	int dfd = extract_at(x, &path);
+	struct ext2_inode *inode = &ent->ip->i;
+
+	if (mkdirat(dfd, path, 0700) < 0 && (errno != EEXIST || ent->depth))
+		return -errno;
+	if (!ent->depth && (x->dirfd = open(x->dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -errno;
+
+	pthread_mutex_lock(&x->lock);
+	if (x->ndirs == x->dirs_cap) {
+		x->dirs_cap = x->dirs_cap ? 2 * x->dirs_cap : 64;
+		x->dirs = realloc(x->dirs, sizeof(*x->dirs) * x->dirs_cap);
+		release_assert(x->dirs);
+	}
+	struct extract_dir *d = &x->dirs[x->ndirs++];
+	d->depth = ent->depth;
+	d->mode = inode->i_mode;
+	d->uid = inode_uid(*inode);
+	d->gid = inode_gid(*inode);
+	d->atime = inode->i_atime;
+	d->mtime = inode->i_mtime;
+	d->path = strdup(ent->path);
+	release_assert(d->path);
+	pthread_mutex_unlock(&x->lock);
+	return 0;
+}
+
+static
+int extract_ent(struct e2img *fs, struct e2img_walk_ent const *ent, void *priv)
+{
+	int rc = 0;
+	struct extract_ctx *x = priv;
+	uint16_t mode = ent->ip->i.i_mode;
+
+	if (LINUX_S_ISDIR(mode))
+		rc = extract_dir(x, ent);
+	else if (LINUX_S_ISREG(mode))
+		rc = extract_regfile(x, fs, ent);
+	else if (LINUX_S_ISLNK(mode))
+		rc = extract_symlink(x, fs, ent);
+	else
+		__atomic_fetch_add(&x->nskipped, 1, __ATOMIC_RELAXED);
+	if (rc < 0) {
+		__atomic_store_n(&x->failed, 1, __ATOMIC_RELAXED);
+		err_display(-rc, "%s/%s", x->dest, ent->path);
+	}
+	return rc;
+}
+
+static
+int extract_dir_cmp(void const *a, void const *b)
+{
+	unsigned x = ((struct extract_dir const *) a)->depth;
+	unsigned y = ((struct extract_dir const *) b)->depth;
+	return (x < y) - (x > y);
+}
+
+static
+int extract_dirs_fixup(struct extract_ctx *x)
+{
+	int rc = 0;
+
+	qsort(x->dirs, x->ndirs, sizeof(*x->dirs), extract_dir_cmp);
+	for (size_t i = 0; i < x->ndirs; ++i) {
+		struct extract_dir *d = &x->dirs[i];
+		char const *path = d->path;
+		int dfd = extract_at(x, &path);
+		struct timespec ts[2] = {
+			{ .tv_sec = d->atime },
+			{ .tv_sec = d->mtime },
+		};
+
+		if ((x->chown && fchownat(dfd, path, d->uid, d->gid, 0) < 0) ||
+				fchmodat(dfd, path, d->mode & 07777, 0) < 0 ||
+				utimensat(dfd, path, ts, 0) < 0) {
+			rc = -errno;
+			err_display(-rc, "%s/%s", x->dest, d->path);
+			break;
+		}
+	}
+	return rc;
+}
+
+/*
+ * Recreates the tree under ino at dest. Owners are only restored when
+ * running as root, everything else the image can express is.
+ */
+int ext2info_extract(struct e2img *fs, ext2_ino_t ino, char const *dest, unsigned nthreads)
+{
+	int rc;
+	struct extract_ctx x = {
+		.dest = dest,
+		.dirfd = -1,
+		.no_cfr = 0,
+		.chown = !geteuid(),
+		.failed = 0,
+		.links = NULL,
+		.dirs = NULL,
+		.ndirs = 0,
+		.dirs_cap = 0,
+	};
+
+	pthread_mutex_init(&x.lock, NULL);
+	rc = e2img_walk(fs, ino, nthreads, extract_ent, &x);
+	if (rc < 0 && !x.failed)
+		err_display(-rc, "e2img_walk");
+	if (!rc)
+		rc = extract_dirs_fixup(&x);
+	if (!rc)
+		fprintf(stderr, "extracted %zu dirs %lu files %lu symlinks %lu bytes, skipped %lu\n",
+			x.ndirs, x.nfiles, x.nsymlinks, x.nbytes, x.nskipped);
+
+	for (size_t i = 0; i < x.ndirs; ++i)
+		free(x.dirs[i].path);
+	free(x.dirs);
+	tdestroy(x.links, free);
+	if (x.dirfd >= 0)
+		close(x.dirfd);
+	pthread_mutex_destroy(&x.lock);
+	return rc;
+}
@@ -2,14 +2,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <linux/limits.h>
 
 #include "common.h"
 #include "e2img.h"
+#include "ext2info.h"
 
 static
 int print_dirent_info(struct ext2_dir_entry *dirent, void *priv)
@@ -36,71 +39,189 @@ int get_strtoul(char const *str, unsigned long *val)
 	return 0;
 }
 
-int ext2info_print_regfile(struct e2img *fs, struct ext2_inode *inode)
+#define EXT2INFO_IO_SIZE (1 << 20)
+
+int ext2info_print_regfile(struct e2img *fs, struct e2img_inode *ip)
 {
 	ssize_t rc = 0;
-	void *blk = NULL;
-	ssize_t file_sz = EXT2_I_SIZE(inode);
-	for (ssize_t i = 0; i < file_sz; i += fs->blk_sz) {
-		blk_t blkno;
-		if ((rc = e2img_inode_get_blkno(fs, inode, i / fs->blk_sz, &blkno)) < 0)
-			goto out;
-		if (blk && (rc = e2img_bcache_release(fs, blk)) < 0) {
-			blk = NULL;
-			goto out;
-		}
-		if ((rc = e2img_bcache_access(fs, blkno, &blk)) < 0)
-			goto out;
+	ext2_off64_t off = 0;
+	struct e2img_ra ra;
+	void *buf = xmemalign(fs->blk_sz, EXT2INFO_IO_SIZE);
+
+	e2img_ra_init(&ra);
+	for (;;) {
+		e2img_readahead(fs, ip, &ra, off, EXT2INFO_IO_SIZE);
+		if ((rc = e2img_file_read(fs, ip, buf, EXT2INFO_IO_SIZE, off)) <= 0)
+			break;
 		errno = 0;
-		fwrite(blk, 1, min(fs->blk_sz, file_sz - i), stdout);
-		if ((rc = -errno))
-			goto out;
+		fwrite(buf, 1, rc, stdout);
+		if (errno) {
+			rc = -errno;
+			break;
+		}
+		off += rc;
 	}
-out:
-	if (blk)
-		e2img_bcache_release(fs, blk);
+	e2img_ra_destroy(&ra);
+	free(buf);
 	return rc;
 }
 
 int ext2info_process_ino(struct e2img *fs, ext2_ino_t ino)
 {
 	int rc;
-	struct ext2_inode inode;
-	if ((rc = e2img_read_inode(fs, ino, &inode)) < 0) {
-		err_display(-rc, "e2img_read_inode");
+	struct e2img_inode *ip;
+	if ((rc = e2img_iget(fs, ino, &ip)) < 0) {
+		err_display(-rc, "e2img_iget");
 		return rc;
 	}
 
-	if (LINUX_S_ISDIR(inode.i_mode)) {
-		if ((rc = e2img_iterate_dir(fs, &inode, print_dirent_info, fs)) < 0) {
+	if (LINUX_S_ISDIR(ip->i.i_mode)) {
+		if ((rc = e2img_iterate_dir(fs, ip, print_dirent_info, fs)) < 0)
 			err_display(-rc, "e2img_iterate_dir");
-			return rc;
-		}
-		return 0;
+		goto out;
 	}
-	if (LINUX_S_ISREG(inode.i_mode)) {
-		if ((rc = ext2info_print_regfile(fs, &inode)) < 0) {
+	if (LINUX_S_ISREG(ip->i.i_mode)) {
+		if ((rc = ext2info_print_regfile(fs, ip)) < 0)
 			err_display(-rc, "ext2info_print_file");
-			return rc;
+		goto out;
+	}
+	if (LINUX_S_ISLNK(ip->i.i_mode)) {
+		char target[PATH_MAX];
+		ssize_t len = e2img_readlink(fs, ip, target, sizeof(target));
+		if (len < 0) {
+			rc = len;
+			err_display(-rc, "e2img_readlink");
+		} else {
+			printf("%.*s\n", (int) len, target);
+			rc = 0;
 		}
-		return 0;
+		goto out;
 	}
 
 	fprintf(stderr, "can't read this type of file\n");
+	rc = 0;
+out:
+	e2img_iput(fs, ip);
+	return rc;
+}
+
+struct walk_report {
+	char const	*prefix;
+	uint64_t	dirs;
+	uint64_t	files;
+	uint64_t	bytes;
+	uint64_t	blocks;		/* 512 byte units, as i_blocks */
+};
+
+static
+char mode_type_char(uint16_t mode)
+{
+	switch (mode & LINUX_S_IFMT) {
+	case LINUX_S_IFDIR:	return 'd';
+	case LINUX_S_IFREG:	return '-';
+	case LINUX_S_IFLNK:	return 'l';
+	case LINUX_S_IFCHR:	return 'c';
+	case LINUX_S_IFBLK:	return 'b';
+	case LINUX_S_IFIFO:	return 'p';
+	case LINUX_S_IFSOCK:	return 's';
+	}
+	return '?';
+}
+
+/* Runs on the walker threads, one printf per line keeps lines whole */
+static
+int print_walk_ent(struct e2img *fs, struct e2img_walk_ent const *ent, void *priv)
+{
+	struct walk_report *rep = priv;
+	struct ext2_inode *inode = &ent->ip->i;
+	int slash = ent->path_len && rep->prefix[strlen(rep->prefix) - 1] != '/';
+
+	printf("%10u %c %12llu %s%s%s\n", ent->ip->ino, mode_type_char(inode->i_mode),
+		(unsigned long long) EXT2_I_SIZE(inode), rep->prefix,
+		slash ? "/" : "", ent->path);
+
+	__atomic_fetch_add(LINUX_S_ISDIR(inode->i_mode) ? &rep->dirs : &rep->files,
+			1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&rep->bytes, EXT2_I_SIZE(inode), __ATOMIC_RELAXED);
+	__atomic_fetch_add(&rep->blocks, inode->i_blocks, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int ext2info_walk(struct e2img *fs, ext2_ino_t ino, char const *prefix, unsigned nthreads)
+{
+	int rc;
+	struct walk_report rep = {
+		.prefix = prefix,
+	};
+
+	if ((rc = e2img_walk(fs, ino, nthreads, print_walk_ent, &rep)) < 0) {
+		err_display(-rc, "e2img_walk");
+		return rc;
+	}
+	fprintf(stderr, "dirs %lu files %lu bytes %lu allocated %lu KiB\n",
+		rep.dirs, rep.files, rep.bytes, rep.blocks / 2);
+	return 0;
+}
+
+/* Decoded descriptor as one colon separated line, for scripts */
+static
+int print_group(struct e2img *fs, dgrp_t g)
+{
+	int rc;
+	struct e2img_group grp;
+
+	if ((rc = e2img_read_group(fs, g, &grp)) < 0) {
+		err_display(-rc, "e2img_read_group");
+		return rc;
+	}
+	printf("%u:%llu:%llu:%llu:%u:%u:%u:%u:0x%x\n", g,
+		(unsigned long long) grp.block_bitmap,
+		(unsigned long long) grp.inode_bitmap,
+		(unsigned long long) grp.inode_table,
+		grp.free_blocks, grp.free_inodes, grp.used_dirs,
+		grp.itable_unused, grp.flags);
 	return 0;
 }
 
+static
+void print_cache_stats(struct e2img *fs)
+{
+	struct e2img_bcache_stats bst;
+	struct e2img_icache_stats ist;
+	struct e2img_dcache_stats dst;
+	struct e2img_io_stats io;
+	e2img_bcache_get_stats(fs, &bst);
+	e2img_icache_get_stats(fs, &ist);
+	e2img_dcache_get_stats(fs, &dst);
+	e2img_io_get_stats(fs, &io);
+	fprintf(stderr, "bcache: hits %lu misses %lu evictions %lu uncached %lu\n",
+		bst.hits, bst.misses, bst.evictions, bst.uncached);
+	fprintf(stderr, "icache: hits %lu misses %lu evictions %lu\n",
+		ist.hits, ist.misses, ist.evictions);
+	fprintf(stderr, "dcache: hits %lu neg_hits %lu misses %lu evictions %lu\n",
+		dst.hits, dst.neg_hits, dst.misses, dst.evictions);
+	fprintf(stderr, "image: reads %lu read_bytes %lu writes %lu write_bytes %lu\n",
+		io.reads, io.read_bytes, io.writes, io.write_bytes);
+}
+
 int main(int argc, char **argv)
 {
 	ssize_t rc;
 	struct e2img img;
+	struct e2img_conf conf = e2img_default_conf;
+	int show_stats = 0;
+	int recursive = 0;
+	char *extract_dir = NULL;
+	unsigned nthreads = 0;
 	char *imgpath = NULL;
 	char *inopath = NULL;
 	int ino_present = 0;
 	ext2_ino_t ino;
+	long group = -1;
+	unsigned long tmp;
 	int c;
 	opterr = 0;
-	while ((c = getopt(argc, argv, "hf:i:p:")) != -1) switch (c) {
+	while ((c = getopt(argc, argv, "hsmrt:x:f:i:p:c:g:")) != -1) switch (c) {
 		case 'f':
 			imgpath = optarg;
 			break;
@@ -116,29 +237,70 @@ int main(int argc, char **argv)
 				fprintf(stderr, "ino already presented\n");
 				return 1;
 			}
-			unsigned long tmp;
 			if ((rc = get_strtoul(optarg, &tmp)) < 0) {
 				err_display(-rc, "wrong ino");
 				return 1;
 			}
 			ino = tmp;
 			break;
+		case 'c':
+			if ((rc = get_strtoul(optarg, &tmp)) < 0) {
+				err_display(-rc, "wrong cache size");
+				return 1;
+			}
+			conf.bcache_sz = tmp << 20;
+			break;
+		case 's':
+			show_stats = 1;
+			break;
+		case 'm':
+			conf.backend = E2IMG_BACKEND_MMAP;
+			break;
+		case 'r':
+			recursive = 1;
+			break;
+		case 'x':
+			extract_dir = optarg;
+			break;
+		case 't':
+			if ((rc = get_strtoul(optarg, &tmp)) < 0) {
+				err_display(-rc, "wrong thread count");
+				return 1;
+			}
+			nthreads = tmp;
+			break;
+		case 'g':
+			if ((rc = get_strtoul(optarg, &tmp)) < 0 || tmp > UINT32_MAX) {
+				err_display(rc < 0 ? -rc : ERANGE, "wrong group");
+				return 1;
+			}
+			group = tmp;
+			break;
 		case 'h':
 		default:
 			fprintf(stderr, "usage: %s "
-				"-f <ext2-image> [-i <ino>|-p <path>]\n", argv[0]);
+				"-f <ext2-image> [-i <ino>|-p <path>] "
+				"[-r|-x <dest-dir>] [-t <threads>] "
+				"[-c <cache-MiB>] [-m] [-s]\n"
+				"\t%s -f <ext2-image> -g <group>: "
+				"group:block_bitmap:inode_bitmap:inode_table:"
+				"free_blocks:free_inodes:used_dirs:itable_unused:flags\n",
+				argv[0], argv[0]);
 			return 1;
 	}
 	if (!imgpath) {
 		fprintf(stderr, "no <ext2-image> presented\n");
 		return 1;
 	}
-	if (!ino_present) {
-		fprintf(stderr, "no ino presented\n");
-		return 1;
+	if (!ino_present && group < 0) {
+		if (!recursive && !extract_dir) {
+			fprintf(stderr, "no ino presented\n");
+			return 1;
+		}
+		ino = EXT2_ROOT_INO;
 	}
 
-	if ((rc = e2img_open(&img, imgpath)) < 0) {
+	if ((rc = e2img_open_conf(&img, imgpath, &conf)) < 0) {
 		err_display(-rc, "e2img_open");
 		return 1;
 	}
@@ -150,8 +312,20 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if (ext2info_process_ino(&img, ino) < 0)
+	if (group >= 0) {
+		if (print_group(&img, group) < 0)
+			goto out_close;
+	} else if (extract_dir) {
+		if (ext2info_extract(&img, ino, extract_dir, nthreads) < 0)
+			goto out_close;
+	} else if (recursive) {
+		if (ext2info_walk(&img, ino, inopath ? inopath : ".", nthreads) < 0)
+			goto out_close;
+	} else if (ext2info_process_ino(&img, ino) < 0) {
 		goto out_close;
+	}
+	if (show_stats)
+		print_cache_stats(&img);
 
 	if ((rc = e2img_close(&img)) < 0) {
 		err_display(-rc, "e2img_close");
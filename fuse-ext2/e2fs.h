@@ -0,0 +1,79 @@
+#ifndef _E2FS_H
+#define _E2FS_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "e2img.h"
+
+struct fuse_args;
+struct fuse_bufvec;
+
+/* The image is immutable, the kernel may cache for long */
+#define E2FS_DEFAULT_TIMEOUT 3600.0
+
+/* Virtual read-only counters file at the mount root, not listed */
+#define E2FS_STATS_NAME ".e2stats"
+/* its node id and st_ino, above any ext2 inode number */
+#define E2FS_STATS_INO ((uint64_t) 1 << 32)
+
+/* open file or directory, kept in fi->fh */
+struct e2fs_file {
+	struct e2img_inode	*ip;	/* NULL for the stats file */
+	struct e2img_ra		ra;
+	char			*snap;	/* stats text taken at open */
+	size_t			snap_len;
+};
+
+#define E2FS_READDIR_BATCH 64
+
+/* Entries are buffered so their inodes can be loaded in table order */
+struct e2fs_dirent_batch {
+	size_t n;
+	struct {
+		ext2_ino_t	ino;
+		uint8_t		ftype;
+		ext2_off64_t	next;
+		char		name[EXT2_NAME_LEN + 1];
+	} ent[E2FS_READDIR_BATCH];
+};
+
+enum e2fs_op {
+	E2FS_OP_LOOKUP,
+	E2FS_OP_GETATTR,
+	E2FS_OP_OPEN,
+	E2FS_OP_READ,
+	E2FS_OP_READDIR,
+	E2FS_OP_READLINK,
+	E2FS_OP_WRITE,
+	E2FS_OP_NR,
+};
+
+extern struct e2img g_img;
+extern double g_entry_timeout;
+extern double g_attr_timeout;
+
+struct e2fs_file *e2fs_file_new(struct e2img_inode *ip);
+void e2fs_file_free(struct e2fs_file *f);
+
+mode_t e2fs_dirent_mode(uint8_t ftype);
+int e2fs_batch_dirent(struct ext2_dir_entry *dirent, ext2_off64_t next,
+		      void *priv);
+void e2fs_fill_stat(struct e2img_inode *ip, struct stat *stbuf);
+int e2fs_map_bufvec(struct e2img_inode *ip, size_t size, off_t offset,
+		    int own_mem, struct fuse_bufvec **bufp);
+
+int e2fs_ll_main(struct fuse_args *args);
+
+uint64_t e2fs_op_begin(void);
+void e2fs_op_end(enum e2fs_op op, uint64_t t0, long rc);
+void e2fs_count_served(size_t bytes, size_t spliced);
+char *e2fs_stats_report(size_t *len);
+void e2fs_stats_fill_stat(struct stat *stbuf);
+struct e2fs_file *e2fs_stats_open(void);
+size_t e2fs_stats_read(struct e2fs_file *f, char *buf, size_t size, off_t off);
+int e2fs_stats_set_file(const char *path);
+void e2fs_stats_block_signal(void);
+void e2fs_stats_start_signal_thread(void);
+
+#endif /* _E2FS_H */
@@ -0,0 +1,471 @@
+#define FUSE_USE_VERSION 30
+
+#include <fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stddef.h>
+#include <sys/statvfs.h>
+
+#include "common.h"
+#include "e2fs.h"
+
+/*
+ * Low-level interface: FUSE node ids are ext2 inode numbers (the root is
+ * remapped), every lookup count the kernel holds pins the inode in icache.
+ */
+
+static inline ext2_ino_t ll_ext2_ino(fuse_ino_t ino)
+{
+	return ino == FUSE_ROOT_ID ? EXT2_ROOT_INO : ino;
+}
+
+static inline fuse_ino_t ll_fuse_ino(ext2_ino_t ino)
+{
+	return ino == EXT2_ROOT_INO ? FUSE_ROOT_ID : ino;
+}
+
+static void ll_fill_entry(struct e2img_inode *ip, struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = ll_fuse_ino(ip->ino);
+	e->generation = ip->i.i_generation;
+	e->attr_timeout = g_attr_timeout;
+	e->entry_timeout = g_entry_timeout;
+	e2fs_fill_stat(ip, &e->attr);
+	e->attr.st_ino = e->ino;
+}
+
+/* Reference is kept on success, dropped by forget */
+static int ll_lookup_pin(fuse_ino_t parent, const char *name,
+			 struct e2img_inode **ip)
+{
+	int rc;
+	ext2_ino_t ino;
+	struct e2img_inode *dir;
+
+	if ((rc = e2img_iget(&g_img, ll_ext2_ino(parent), &dir)) < 0)
+		return rc;
+	rc = e2img_dir_lookup(&g_img, dir, name, strlen(name), &ino);
+	e2img_iput(&g_img, dir);
+	if (rc < 0)
+		return rc;
+	return e2img_iget(&g_img, ino, ip);
+}
+
+static inline int ll_is_stats(fuse_ino_t parent, const char *name)
+{
+	return parent == FUSE_ROOT_ID && !strcmp(name, E2FS_STATS_NAME);
+}
+
+/* Not cached by the kernel, every stat sees fresh counters */
+static void ll_stats_entry(struct fuse_entry_param *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->ino = E2FS_STATS_INO;
+	e2fs_stats_fill_stat(&e->attr);
+}
+
+static void e2fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int rc;
+	struct e2img_inode *ip;
+	struct fuse_entry_param e;
+	uint64_t t0 = e2fs_op_begin();
+
+	if (ll_is_stats(parent, name)) {
+		ll_stats_entry(&e);
+		fuse_reply_entry(req, &e);
+		rc = 0;
+		goto out;
+	}
+	if ((rc = ll_lookup_pin(parent, name, &ip)) < 0) {
+		if (rc == -ENOENT) {
+			/* negative entry, cached by the kernel */
+			memset(&e, 0, sizeof(e));
+			e.entry_timeout = g_entry_timeout;
+			fuse_reply_entry(req, &e);
+			goto out;
+		}
+		fuse_reply_err(req, -rc);
+		goto out;
+	}
+	ll_fill_entry(ip, &e);
+	if (fuse_reply_entry(req, &e))
+		e2img_iput(&g_img, ip);
+out:
+	e2fs_op_end(E2FS_OP_LOOKUP, t0, rc);
+}
+
+static void ll_forget_one(fuse_ino_t ino, uint64_t nlookup)
+{
+	struct e2img_inode *ip;
+	if (ino == E2FS_STATS_INO || e2img_iget(&g_img, ll_ext2_ino(ino), &ip) < 0)
+		return;
+	while (nlookup--)
+		e2img_iput(&g_img, ip);
+	e2img_iput(&g_img, ip);
+}
+
+static void e2fs_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	ll_forget_one(ino, nlookup);
+	fuse_reply_none(req);
+}
+
+static void e2fs_ll_forget_multi(fuse_req_t req, size_t count,
+				 struct fuse_forget_data *forgets)
+{
+	for (size_t i = 0; i < count; ++i)
+		ll_forget_one(forgets[i].ino, forgets[i].nlookup);
+	fuse_reply_none(req);
+}
+
+static void e2fs_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+			    struct fuse_file_info *fi)
+{
+	int rc = 0;
+	struct stat st;
+	struct e2img_inode *ip;
+	uint64_t t0 = e2fs_op_begin();
+
+	if (ino == E2FS_STATS_INO) {
+		e2fs_stats_fill_stat(&st);
+		fuse_reply_attr(req, &st, 0);
+		goto out;
+	}
+	if ((rc = e2img_iget(&g_img, ll_ext2_ino(ino), &ip)) < 0) {
+		fuse_reply_err(req, -rc);
+		goto out;
+	}
+	e2fs_fill_stat(ip, &st);
+	st.st_ino = ino;
+	e2img_iput(&g_img, ip);
+	fuse_reply_attr(req, &st, g_attr_timeout);
+out:
+	e2fs_op_end(E2FS_OP_GETATTR, t0, rc);
+}
+
+static void e2fs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+	ssize_t rc = -EINVAL;
+	char buf[PATH_MAX];
+	struct e2img_inode *ip;
+	uint64_t t0 = e2fs_op_begin();
+
+	if (ino == E2FS_STATS_INO || (rc = e2img_iget(&g_img, ll_ext2_ino(ino), &ip)) < 0)
+		goto out;
+	if ((rc = e2img_readlink(&g_img, ip, buf, sizeof(buf) - 1)) >= 0) {
+		buf[rc] = '\0';
+		fuse_reply_readlink(req, buf);
+	}
+	e2img_iput(&g_img, ip);
+out:
+	if (rc < 0)
+		fuse_reply_err(req, -rc);
+	e2fs_op_end(E2FS_OP_READLINK, t0, rc);
+}
+
+/* The stats text is not known in advance, direct_io reads it to the end */
+static int ll_open_stats(fuse_req_t req, struct fuse_file_info *fi, int is_dir)
+{
+	if (is_dir)
+		return -ENOTDIR;
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	struct e2fs_file *f = e2fs_stats_open();
+	fi->fh = (uintptr_t) f;
+	fi->direct_io = 1;
+	if (fuse_reply_open(req, fi))
+		e2fs_file_free(f);
+	return 0;
+}
+
+static int ll_open_inode(fuse_req_t req, fuse_ino_t ino,
+			 struct fuse_file_info *fi, int is_dir)
+{
+	int rc;
+	struct e2img_inode *ip;
+
+	if ((rc = e2img_iget(&g_img, ll_ext2_ino(ino), &ip)) < 0)
+		return rc;
+	if (is_dir ? !LINUX_S_ISDIR(ip->i.i_mode) : !LINUX_S_ISREG(ip->i.i_mode))
+		rc = is_dir ? -ENOTDIR : -EISDIR;
+	else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		rc = -EACCES;
+	if (rc < 0) {
+		e2img_iput(&g_img, ip);
+		return rc;
+	}
+	struct e2fs_file *f = e2fs_file_new(ip);
+	fi->fh = (uintptr_t) f;
+	fi->keep_cache = 1;
+	if (fuse_reply_open(req, fi))
+		e2fs_file_free(f);
+	return 0;
+}
+
+static void ll_open_common(fuse_req_t req, fuse_ino_t ino,
+			   struct fuse_file_info *fi, int is_dir)
+{
+	int rc;
+	uint64_t t0 = e2fs_op_begin();
+
+	if (ino == E2FS_STATS_INO)
+		rc = ll_open_stats(req, fi, is_dir);
+	else
+		rc = ll_open_inode(req, ino, fi, is_dir);
+	if (rc < 0)
+		fuse_reply_err(req, -rc);
+	if (!is_dir)
+		e2fs_op_end(E2FS_OP_OPEN, t0, rc);
+}
+
+static void e2fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	ll_open_common(req, ino, fi, 0);
+}
+
+static void e2fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	ll_open_common(req, ino, fi, 1);
+}
+
+static void e2fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	e2fs_file_free((struct e2fs_file *) fi->fh);
+	fuse_reply_err(req, 0);
+}
+
+static void e2fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+			 struct fuse_file_info *fi)
+{
+	int rc = 0;
+	struct fuse_bufvec *bv;
+	struct e2fs_file *f = (struct e2fs_file *) fi->fh;
+	uint64_t t0 = e2fs_op_begin();
+
+	if (f->snap) {
+		char *buf = xmalloc(size ? size : 1);
+		size_t len = e2fs_stats_read(f, buf, size, off);
+		e2fs_count_served(len, 0);
+		fuse_reply_buf(req, buf, len);
+		free(buf);
+		goto out;
+	}
+	e2img_readahead(&g_img, f->ip, &f->ra, off, size);
+	if ((rc = e2fs_map_bufvec(f->ip, size, off, 0, &bv)) < 0) {
+		fuse_reply_err(req, -rc);
+		goto out;
+	}
+	fuse_reply_data(req, bv, FUSE_BUF_SPLICE_MOVE);
+	free(bv);
+out:
+	e2fs_op_end(E2FS_OP_READ, t0, rc);
+}
+
+static void e2fs_ll_lseek(fuse_req_t req, fuse_ino_t ino, off_t off, int whence,
+			  struct fuse_file_info *fi)
+{
+	struct e2fs_file *f = (struct e2fs_file *) fi->fh;
+	off_t rc = f->ip ? e2img_lseek(&g_img, f->ip, off, whence) : -EINVAL;
+
+	if (rc < 0)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_lseek(req, rc);
+}
+
+static void e2fs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	struct statvfs st;
+
+	e2img_statfs(&g_img, &st);
+	fuse_reply_statfs(req, &st);
+}
+
+struct ll_dirbuf {
+	fuse_req_t	req;
+	char		*buf;
+	size_t		size;
+	size_t		pos;
+	int		plus;
+};
+
+static int ll_is_dot_or_dotdot(const char *name)
+{
+	return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/*
+ * Emits the batch, returns 1 once the reply buffer is full. Inodes of a
+ * readdirplus batch are loaded together in table order; the reference of
+ * each entry that made it into the buffer is kept for the kernel's lookup
+ * count, the rest are dropped.
+ */
+static int ll_flush_batch(struct ll_dirbuf *db, struct e2fs_dirent_batch *b)
+{
+	int rc = 0;
+	size_t i, len;
+	struct fuse_entry_param e;
+	struct e2img_inode *ips[E2FS_READDIR_BATCH] = { NULL };
+
+	if (db->plus) {
+		ext2_ino_t inos[E2FS_READDIR_BATCH];
+		struct e2img_inode *loaded[E2FS_READDIR_BATCH];
+		size_t idx[E2FS_READDIR_BATCH], n = 0;
+		for (i = 0; i < b->n; ++i) {
+			if (ll_is_dot_or_dotdot(b->ent[i].name))
+				continue;
+			idx[n] = i;
+			inos[n++] = b->ent[i].ino;
+		}
+		e2img_iget_batch(&g_img, inos, n, loaded);
+		for (i = 0; i < n; ++i)
+			ips[idx[i]] = loaded[i];
+	}
+
+	for (i = 0; i < b->n; ++i) {
+		if (ips[i]) {
+			ll_fill_entry(ips[i], &e);
+		} else {
+			memset(&e, 0, sizeof(e));
+			e.attr.st_ino = ll_fuse_ino(b->ent[i].ino);
+			e.attr.st_mode = e2fs_dirent_mode(b->ent[i].ftype);
+		}
+		if (!db->plus)
+			len = fuse_add_direntry(db->req, db->buf + db->pos,
+					db->size - db->pos, b->ent[i].name,
+					&e.attr, b->ent[i].next);
+		else
+			len = fuse_add_direntry_plus(db->req, db->buf + db->pos,
+					db->size - db->pos, b->ent[i].name,
+					&e, b->ent[i].next);
+		if (len > db->size - db->pos) {
+			/* does not fit, the kernel comes back for it */
+			rc = 1;
+			break;
+		}
+		db->pos += len;
+	}
+
+	for (; i < b->n; ++i) {
+		if (ips[i])
+			e2img_iput(&g_img, ips[i]);
+	}
+	return rc;
+}
+
+static void ll_readdir_common(fuse_req_t req, fuse_ino_t ino, size_t size,
+			      off_t off, struct fuse_file_info *fi, int plus)
+{
+	int rc;
+	struct ll_dirbuf db = {
+		.req	= req,
+		.buf	= xmalloc(size),
+		.size	= size,
+		.pos	= 0,
+		.plus	= plus,
+	};
+	struct e2fs_dirent_batch *batch = xmalloc(sizeof(*batch));
+	ext2_off64_t pos = off;
+
+	uint64_t t0 = e2fs_op_begin();
+	struct e2fs_file *f = (struct e2fs_file *) fi->fh;
+	for (;;) {
+		batch->n = 0;
+		int more = e2img_iterate_dir_at(&g_img, f->ip, pos, &f->ra,
+				e2fs_batch_dirent, batch);
+		if (more < 0) {
+			rc = more;
+			break;
+		}
+		if (ll_flush_batch(&db, batch) || !more) {
+			rc = 0;
+			break;
+		}
+		pos = batch->ent[batch->n - 1].next;
+	}
+	if (rc < 0 && !db.pos)
+		fuse_reply_err(req, -rc);
+	else
+		fuse_reply_buf(req, db.buf, db.pos);
+	free(batch);
+	free(db.buf);
+	e2fs_op_end(E2FS_OP_READDIR, t0, rc);
+}
+
+static void e2fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+			    off_t off, struct fuse_file_info *fi)
+{
+	ll_readdir_common(req, ino, size, off, fi, 0);
+}
+
+static void e2fs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+				off_t off, struct fuse_file_info *fi)
+{
+	ll_readdir_common(req, ino, size, off, fi, 1);
+}
+
+static const struct fuse_lowlevel_ops e2fs_ll_oper = {
+	.lookup		= e2fs_ll_lookup,
+	.forget		= e2fs_ll_forget,
+	.forget_multi	= e2fs_ll_forget_multi,
+	.getattr	= e2fs_ll_getattr,
+	.readlink	= e2fs_ll_readlink,
+	.open		= e2fs_ll_open,
+	.read		= e2fs_ll_read,
+	.lseek		= e2fs_ll_lseek,
+	.release	= e2fs_ll_release,
+	.opendir	= e2fs_ll_opendir,
+	.readdir	= e2fs_ll_readdir,
+	.readdirplus	= e2fs_ll_readdirplus,
+	.releasedir	= e2fs_ll_release,
+	.statfs		= e2fs_ll_statfs,
+};
+
+int e2fs_ll_main(struct fuse_args *args)
+{
+	int ret = 1;
+	struct fuse_cmdline_opts opts;
+	struct fuse_session *se;
+
+	if (fuse_parse_cmdline(args, &opts) != 0)
+		return 1;
+	if (opts.show_help) {
+		fuse_cmdline_help();
+		fuse_lowlevel_help();
+		goto out_free;
+	}
+	if (!opts.mountpoint) {
+		fprintf(stderr, "No <mountpoint> specified\n");
+		goto out_free;
+	}
+
+	if (!(se = fuse_session_new(args, &e2fs_ll_oper, sizeof(e2fs_ll_oper), NULL)))
+		goto out_free;
+	if (fuse_set_signal_handlers(se) != 0)
+		goto out_destroy;
+	if (fuse_session_mount(se, opts.mountpoint) != 0)
+		goto out_signals;
+
+	fuse_daemonize(opts.foreground);
+	e2fs_stats_start_signal_thread();
+	if (opts.singlethread)
+		ret = fuse_session_loop(se);
+	else
+		ret = fuse_session_loop_mt(se, opts.clone_fd);
+	ret = ret ? 1 : 0;
+
+	fuse_session_unmount(se);
+out_signals:
+	fuse_remove_signal_handlers(se);
+out_destroy:
+	fuse_session_destroy(se);
+out_free:
+	free(opts.mountpoint);
+	return ret;
+}
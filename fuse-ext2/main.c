@@ -1,87 +1,247 @@
 #define FUSE_USE_VERSION 30
+#define _GNU_SOURCE
 
 #include <fuse.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <fcntl.h>
 #include <assert.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <time.h>
 #include <linux/limits.h>
 
 #include "common.h"
-#include "e2img.h"
+#include "e2fs.h"
 
 /* FUSE options: show_help */
 static struct options {
 	int show_help;
 	char *img_path;
+	unsigned long bcache_mb;
+	unsigned long icache_mb;
+	unsigned long dcache_mb;
+	int lowlevel;
+	int mmap;
+	unsigned long readahead_kb;
+	double entry_timeout;
+	double attr_timeout;
+	int rw;
+	char *stats_file;
 } g_options;
 
 struct e2img g_img;
+double g_entry_timeout;
+double g_attr_timeout;
 
 #define OPTION(t, p) { t, offsetof(struct options, p), 1 }
 static const struct fuse_opt g_option_spec[] = {
 	OPTION("-h", show_help),
 	OPTION("--help", show_help),
 	OPTION("--img=%s", img_path),
+	OPTION("--bcache=%lu", bcache_mb),
+	OPTION("--icache=%lu", icache_mb),
+	OPTION("--dcache=%lu", dcache_mb),
+	OPTION("--lowlevel", lowlevel),
+	OPTION("--mmap", mmap),
+	OPTION("--readahead=%lu", readahead_kb),
+	OPTION("--entry-timeout=%lf", entry_timeout),
+	OPTION("--attr-timeout=%lf", attr_timeout),
+	OPTION("--rw", rw),
+	OPTION("--stats-file=%s", stats_file),
 	FUSE_OPT_END,
 };
 #undef OPTION
 
+/* e2img writes need the image to themselves, reads may run together */
+static pthread_rwlock_t g_rw_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static inline void e2fs_lock(int excl)
+{
+	if (!g_img.writable)
+		return;
+	if (excl)
+		pthread_rwlock_wrlock(&g_rw_lock);
+	else
+		pthread_rwlock_rdlock(&g_rw_lock);
+}
+
+static inline void e2fs_unlock(void)
+{
+	if (g_img.writable)
+		pthread_rwlock_unlock(&g_rw_lock);
+}
+
 static void *e2fs_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
 	cfg->kernel_cache = 1; /* Data never changed externally */
+	cfg->use_ino = 1;
+	cfg->entry_timeout = g_entry_timeout;
+	cfg->negative_timeout = g_entry_timeout;
+	cfg->attr_timeout = g_attr_timeout;
+	e2fs_stats_start_signal_thread();
 	return NULL;
 }
 
-static int e2fs_obtain_ino(const char *path, struct fuse_file_info *fi, ext2_ino_t *ino)
+/* Consumes the inode reference */
+struct e2fs_file *e2fs_file_new(struct e2img_inode *ip)
 {
-	int rc;
-	if (fi)
-		*ino = fi->fh;
-	else if ((rc = e2img_path_lookup(&g_img, path, ino)) < 0)
-		return rc;
-	return 0;
+	struct e2fs_file *f = xmalloc(sizeof(*f));
+	f->ip = ip;
+	e2img_ra_init(&f->ra);
+	f->snap = NULL;
+	f->snap_len = 0;
+	return f;
 }
 
-static int e2fs_getattr(const char *path, struct stat *stbuf,
-			 struct fuse_file_info *fi)
+void e2fs_file_free(struct e2fs_file *f)
+{
+	e2img_ra_destroy(&f->ra);
+	if (f->ip)
+		e2img_iput(&g_img, f->ip);
+	free(f->snap);
+	free(f);
+}
+
+static inline int e2fs_is_stats(const char *path)
+{
+	return path && !strcmp(path, "/" E2FS_STATS_NAME);
+}
+
+static inline struct e2img_ra *e2fs_file_ra(struct fuse_file_info *fi)
+{
+	return fi && fi->fh ? &((struct e2fs_file *) fi->fh)->ra : NULL;
+}
+
+/*
+ * Takes a reference, open files keep their inode pinned in fi->fh. The
+ * stats file has no inode, ops that serve it check for it first.
+ */
+static int e2fs_obtain_inode(const char *path, struct fuse_file_info *fi,
+			     struct e2img_inode **ip)
 {
 	int rc;
 	ext2_ino_t ino;
-	struct ext2_inode inode;
-	if ((rc = e2fs_obtain_ino(path, fi, &ino)) < 0)
-		return rc;
-	if ((rc = e2img_read_inode(&g_img, ino, &inode)) < 0)
+	if (fi && fi->fh) {
+		struct e2fs_file *f = (struct e2fs_file *) fi->fh;
+		if (!f->ip)
+			return -EINVAL;
+		*ip = e2img_igrab(&g_img, f->ip);
+		return 0;
+	}
+	if (e2fs_is_stats(path))
+		return -EPERM;
+	uint64_t t0 = e2fs_op_begin();
+	rc = e2img_path_lookup(&g_img, path, &ino);
+	e2fs_op_end(E2FS_OP_LOOKUP, t0, rc);
+	if (rc < 0)
 		return rc;
+	return e2img_iget(&g_img, ino, ip);
+}
 
+void e2fs_fill_stat(struct e2img_inode *ip, struct stat *stbuf)
+{
 	memset(stbuf, 0, sizeof(*stbuf));
-	stbuf->st_mode  = inode.i_mode & ~0222;
-	stbuf->st_nlink = inode.i_links_count;
-	stbuf->st_uid   = inode.i_uid;
-	stbuf->st_gid   = inode.i_gid;
-	stbuf->st_size  = inode.i_size;
-	return rc;
+	stbuf->st_ino   = ip->ino;
+	stbuf->st_mode  = g_img.writable ? ip->i.i_mode : ip->i.i_mode & ~0222;
+	stbuf->st_nlink = ip->i.i_links_count;
+	stbuf->st_uid   = inode_uid(ip->i);
+	stbuf->st_gid   = inode_gid(ip->i);
+	stbuf->st_size  = EXT2_I_SIZE(&ip->i);
+	stbuf->st_blocks = ip->i.i_blocks;
+	stbuf->st_atime = ip->i.i_atime;
+	stbuf->st_mtime = ip->i.i_mtime;
+	stbuf->st_ctime = ip->i.i_ctime;
 }
 
-struct e2fs_apply_filler_info {
-	fuse_fill_dir_t filler;
-	void *buf;
-};
+static int e2fs_getattr(const char *path, struct stat *stbuf,
+			 struct fuse_file_info *fi)
+{
+	int rc = 0;
+	struct e2img_inode *ip;
+	uint64_t t0 = e2fs_op_begin();
+	e2fs_lock(0);
+	if (e2fs_is_stats(path)) {
+		e2fs_stats_fill_stat(stbuf);
+	} else if (!(rc = e2fs_obtain_inode(path, fi, &ip))) {
+		e2fs_fill_stat(ip, stbuf);
+		e2img_iput(&g_img, ip);
+	}
+	e2fs_unlock();
+	e2fs_op_end(E2FS_OP_GETATTR, t0, rc);
+	return rc;
+}
 
-static int e2fs_apply_filler(struct ext2_dir_entry *dirent, void *priv)
+/* ext2 dirent file type to the S_IFMT bits readdir reports */
+mode_t e2fs_dirent_mode(uint8_t ftype)
 {
-	struct e2fs_apply_filler_info *info = priv;
+	static const mode_t tab[EXT2_FT_MAX] = {
+		[EXT2_FT_REG_FILE]	= S_IFREG,
+		[EXT2_FT_DIR]		= S_IFDIR,
+		[EXT2_FT_CHRDEV]	= S_IFCHR,
+		[EXT2_FT_BLKDEV]	= S_IFBLK,
+		[EXT2_FT_FIFO]		= S_IFIFO,
+		[EXT2_FT_SOCK]		= S_IFSOCK,
+		[EXT2_FT_SYMLINK]	= S_IFLNK,
+	};
+	return ftype < EXT2_FT_MAX ? tab[ftype] : 0;
+}
 
-	char name[256];
+int e2fs_batch_dirent(struct ext2_dir_entry *dirent, ext2_off64_t next,
+		      void *priv)
+{
+	struct e2fs_dirent_batch *b = priv;
 	uint16_t len = ext2fs_dirent_name_len(dirent);
-	memcpy(name, dirent->name, len);
-	name[len] = 0;
-	info->filler(info->buf, name, NULL, 0, 0);
-	return 0;
+
+	b->ent[b->n].ino = dirent->inode;
+	b->ent[b->n].ftype = ext2fs_dirent_file_type(dirent);
+	b->ent[b->n].next = next;
+	memcpy(b->ent[b->n].name, dirent->name, len);
+	b->ent[b->n].name[len] = 0;
+	return ++b->n == E2FS_READDIR_BATCH;
+}
+
+/* Returns 1 once the filler buffer is full */
+static int e2fs_flush_batch(struct e2fs_dirent_batch *b, void *buf,
+			    fuse_fill_dir_t filler, int plus)
+{
+	int rc = 0;
+	struct stat st;
+	struct e2img_inode *ips[E2FS_READDIR_BATCH] = { NULL };
+
+	if (plus) {
+		ext2_ino_t inos[E2FS_READDIR_BATCH];
+		for (size_t i = 0; i < b->n; ++i)
+			inos[i] = b->ent[i].ino;
+		e2img_iget_batch(&g_img, inos, b->n, ips);
+	}
+
+	for (size_t i = 0; i < b->n; ++i) {
+		enum fuse_fill_dir_flags fill_flags = 0;
+		if (ips[i]) {
+			e2fs_fill_stat(ips[i], &st);
+			fill_flags = FUSE_FILL_DIR_PLUS;
+		} else {
+			memset(&st, 0, sizeof(st));
+			st.st_ino = b->ent[i].ino;
+			st.st_mode = e2fs_dirent_mode(b->ent[i].ftype);
+		}
+		if (filler(buf, b->ent[i].name, &st, b->ent[i].next, fill_flags)) {
+			rc = 1;
+			break;
+		}
+	}
+
+	for (size_t i = 0; i < b->n; ++i) {
+		if (ips[i])
+			e2img_iput(&g_img, ips[i]);
+	}
+	return rc;
 }
 
 static int e2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -89,111 +249,588 @@ static int e2fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 			 enum fuse_readdir_flags flags)
 {
 	int rc;
-	ext2_ino_t ino;
-	struct ext2_inode inode;
-	if ((rc = e2fs_obtain_ino(path, fi, &ino)) < 0)
-		return rc;
-	if ((rc = e2img_read_inode(&g_img, ino, &inode)) < 0)
+	struct e2img_inode *ip;
+	struct e2fs_dirent_batch *batch = NULL;
+	uint64_t t0 = e2fs_op_begin();
+	e2fs_lock(0);
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0) {
+		e2fs_unlock();
+		e2fs_op_end(E2FS_OP_READDIR, t0, rc);
 		return rc;
+	}
 
-	if (!LINUX_S_ISDIR(inode.i_mode))
-		return -ENOTDIR;
+	if (!LINUX_S_ISDIR(ip->i.i_mode)) {
+		rc = -ENOTDIR;
+		goto out;
+	}
 
-	struct e2fs_apply_filler_info info = {
-		.filler = filler,
-		.buf = buf,
-	};
+	/* Offsets handed to the filler are dirent positions, listing resumes there */
+	batch = xmalloc(sizeof(*batch));
+	ext2_off64_t pos = offset;
+	for (;;) {
+		batch->n = 0;
+		int more = e2img_iterate_dir_at(&g_img, ip, pos, e2fs_file_ra(fi),
+				e2fs_batch_dirent, batch);
+		if (more < 0) {
+			rc = more;
+			break;
+		}
+		if (e2fs_flush_batch(batch, buf, filler, flags & FUSE_READDIR_PLUS) || !more) {
+			rc = 0;
+			break;
+		}
+		pos = batch->ent[batch->n - 1].next;
+	}
+out:
+	free(batch);
+	e2img_iput(&g_img, ip);
+	e2fs_unlock();
+	e2fs_op_end(E2FS_OP_READDIR, t0, rc);
+	return rc;
+}
 
-	if ((rc = e2img_iterate_dir(&g_img, &inode, e2fs_apply_filler, &info)) < 0)
-		return rc;
+/* The stats text is not known in advance, direct_io reads it to the end */
+static int e2fs_open_stats(struct fuse_file_info *fi)
+{
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+	fi->fh = (uintptr_t) e2fs_stats_open();
+	fi->direct_io = 1;
 	return 0;
 }
 
 static int e2fs_open(const char *path, struct fuse_file_info *fi)
 {
 	int rc;
-	ext2_ino_t ino;
-	struct ext2_inode inode;
-	if ((rc = e2fs_obtain_ino(path, NULL, &ino)) < 0)
-		return rc;
-	if ((rc = e2img_read_inode(&g_img, ino, &inode)) < 0)
-		return rc;
+	struct e2img_inode *ip;
+	uint64_t t0 = e2fs_op_begin();
+	e2fs_lock(0);
+	if (e2fs_is_stats(path)) {
+		rc = e2fs_open_stats(fi);
+		goto out;
+	}
+	if ((rc = e2fs_obtain_inode(path, NULL, &ip)) < 0)
+		goto out;
 
-	if (!LINUX_S_ISREG(inode.i_mode))
-		return -ENOENT;
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
-		return -EACCES;
-	fi->fh = ino;
-	return 0;
+	if (!LINUX_S_ISREG(ip->i.i_mode)) {
+		rc = -ENOENT;
+		goto errout;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY && !g_img.writable) {
+		rc = -EACCES;
+		goto errout;
+	}
+	fi->fh = (uintptr_t) e2fs_file_new(ip);
+	goto out;
+errout:
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+	e2fs_op_end(E2FS_OP_OPEN, t0, rc);
+	return rc;
 }
 
 static int e2fs_opendir(const char *path, struct fuse_file_info *fi)
 {
 	int rc;
-	ext2_ino_t ino;
-	struct ext2_inode inode;
-	if ((rc = e2fs_obtain_ino(path, NULL, &ino)) < 0)
-		return rc;
-	if ((rc = e2img_read_inode(&g_img, ino, &inode)) < 0)
-		return rc;
+	struct e2img_inode *ip;
+	e2fs_lock(0);
+	if ((rc = e2fs_obtain_inode(path, NULL, &ip)) < 0)
+		goto out;
 
-	if (!LINUX_S_ISDIR(inode.i_mode))
-		return -ENOENT;
-	if ((fi->flags & O_ACCMODE) != O_RDONLY)
-		return -EACCES;
-	fi->fh = ino;
-	return 0;
+	if (!LINUX_S_ISDIR(ip->i.i_mode)) {
+		rc = -ENOENT;
+		goto errout;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+		rc = -EACCES;
+		goto errout;
+	}
+	fi->fh = (uintptr_t) e2fs_file_new(ip);
+	goto out;
+errout:
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+	return rc;
+}
+
+/* Delayed data of a closed file is given its blocks right away */
+static int e2fs_release(const char *path, struct fuse_file_info *fi)
+{
+	int rc = 0;
+	struct e2fs_file *f = (struct e2fs_file *) fi->fh;
+
+	e2fs_lock(1);
+	if (g_img.writable && f->ip)
+		rc = e2img_inode_flush(&g_img, f->ip);
+	e2fs_file_free(f);
+	e2fs_unlock();
+	return rc;
 }
 
 static int e2fs_read(const char *path, char *buf, size_t size, off_t offset,
 		      struct fuse_file_info *fi)
 {
-	ssize_t rc = 0;
+	ssize_t rc;
+	struct e2img_inode *ip;
+	struct e2fs_file *f = fi ? (struct e2fs_file *) fi->fh : NULL;
+	uint64_t t0 = e2fs_op_begin();
+	if (f && f->snap) {
+		rc = e2fs_stats_read(f, buf, size, offset);
+		goto done;
+	}
+	e2fs_lock(0);
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0)
+		goto out;
+
+	struct e2img_ra *ra;
+	if ((ra = e2fs_file_ra(fi)))
+		e2img_readahead(&g_img, ip, ra, offset, size);
+	rc = e2img_file_read(&g_img, ip, buf, size, offset);
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+done:
+	if (rc > 0)
+		e2fs_count_served(rc, 0);
+	e2fs_op_end(E2FS_OP_READ, t0, rc);
+	return rc;
+}
+
+static struct fuse_bufvec *e2fs_bufvec_alloc(size_t cap)
+{
+	struct fuse_bufvec *bv = xmalloc(sizeof(*bv) + (cap - 1) * sizeof(bv->buf[0]));
+	*bv = FUSE_BUFVEC_INIT(0);
+	bv->count = 0;
+	return bv;
+}
+
+/* Holes are served from here, never read from the image */
+static char e2fs_zeroes[64 << 10];
+
+/*
+ * Image fd segments, libfuse splices them into /dev/fuse. Holes become
+ * memory segments pointing at e2fs_zeroes, or zeroed allocations if
+ * own_mem is set: the high-level API frees every memory segment.
+ */
+int e2fs_map_bufvec(struct e2img_inode *ip, size_t size, off_t offset,
+		    int own_mem, struct fuse_bufvec **bufp)
+{
+	int rc;
+	size_t cap = 4;
+	struct fuse_bufvec *bv = e2fs_bufvec_alloc(cap);
+	ext2_off64_t fsize = EXT2_I_SIZE(&ip->i);
+	size_t done = 0;
+	size = offset < fsize ? min(size, fsize - offset) : 0;
+
+	/* inline data straight from the inode, which the caller pins */
+	if (ip->idata && size) {
+		if (offset + size > ip->idata_len) {
+			rc = -EIO;
+			goto errout;
+		}
+		void *mem = ip->idata + offset;
+		if (own_mem)
+			mem = memcpy(xmalloc(size), mem, size);
+		bv->buf[bv->count++] = (struct fuse_buf) {
+			.size	= size,
+			.mem	= mem,
+		};
+		done = size;
+	}
+	while (done < size) {
+		struct e2img_extent ext;
+		ext2_off64_t pos = offset + done;
+		size_t boff = pos % g_img.blk_sz;
+
+		if ((rc = e2img_inode_map(&g_img, ip, pos / g_img.blk_sz, &ext)) < 0)
+			goto errout;
+		if (!ext.len) {
+			rc = -EIO;
+			goto errout;
+		}
+		if (bv->count == cap) {
+			cap *= 2;
+			bv = realloc(bv, sizeof(*bv) + (cap - 1) * sizeof(bv->buf[0]));
+			release_assert(bv);
+		}
+		size_t len = min((size_t) ext.len * g_img.blk_sz - boff, size - done);
+		if (!ext.pblk) {
+			void *mem = e2fs_zeroes;
+			if (own_mem)
+				release_assert(mem = calloc(1, len));
+			else
+				len = min(len, sizeof(e2fs_zeroes));
+			bv->buf[bv->count++] = (struct fuse_buf) {
+				.size	= len,
+				.mem	= mem,
+			};
+		} else {
+			bv->buf[bv->count++] = (struct fuse_buf) {
+				.size	= len,
+				.flags	= FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+				.fd	= g_img.fd,
+				.pos	= (off_t) ext.pblk * g_img.blk_sz + boff,
+			};
+		}
+		done += len;
+	}
+	if (!bv->count)
+		bv->count = 1;
+	size_t spliced = 0;
+	for (size_t i = 0; i < bv->count; ++i) {
+		if (bv->buf[i].flags & FUSE_BUF_IS_FD)
+			spliced += bv->buf[i].size;
+	}
+	e2fs_count_served(fuse_buf_size(bv), spliced);
+	*bufp = bv;
+	return 0;
+errout:
+	for (size_t i = 0; own_mem && i < bv->count; ++i) {
+		if (!(bv->buf[i].flags & FUSE_BUF_IS_FD))
+			free(bv->buf[i].mem);
+	}
+	free(bv);
+	return rc;
+}
+
+static int e2fs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			 size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	int rc;
+	struct e2img_inode *ip;
+	struct e2fs_file *f = fi ? (struct e2fs_file *) fi->fh : NULL;
+	uint64_t t0 = e2fs_op_begin();
+	if (f && f->snap) {
+		struct fuse_bufvec *bv = e2fs_bufvec_alloc(1);
+		void *mem = xmalloc(size ? size : 1);
+		bv->buf[0] = (struct fuse_buf) {
+			.size	= e2fs_stats_read(f, mem, size, offset),
+			.mem	= mem,
+		};
+		bv->count = 1;
+		e2fs_count_served(bv->buf[0].size, 0);
+		*bufp = bv;
+		rc = 0;
+		goto out;
+	}
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0)
+		goto out;
+
+	struct e2img_ra *ra;
+	if ((ra = e2fs_file_ra(fi)))
+		e2img_readahead(&g_img, ip, ra, offset, size);
+	rc = e2fs_map_bufvec(ip, size, offset, 1, bufp);
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_op_end(E2FS_OP_READ, t0, rc);
+	return rc;
+}
+
+static off_t e2fs_lseek(const char *path, off_t off, int whence,
+			struct fuse_file_info *fi)
+{
+	off_t rc;
+	struct e2img_inode *ip;
+
+	if (whence != SEEK_DATA && whence != SEEK_HOLE)
+		return -EINVAL;	/* SEEK_SET/CUR/END never get here */
+	e2fs_lock(0);
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0)
+		goto out;
+	rc = e2img_lseek(&g_img, ip, off, whence);
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+	return rc;
+}
+
+static int e2fs_readlink(const char *path, char *buf, size_t size)
+{
+	ssize_t rc;
+	struct e2img_inode *ip;
+	uint64_t t0 = e2fs_op_begin();
+
+	if (!size)
+		return -EINVAL;
+	e2fs_lock(0);
+	if ((rc = e2fs_obtain_inode(path, NULL, &ip)) < 0)
+		goto out;
+	if ((rc = e2img_readlink(&g_img, ip, buf, size - 1)) >= 0) {
+		buf[rc] = '\0';
+		rc = 0;
+	}
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+	e2fs_op_end(E2FS_OP_READLINK, t0, rc);
+	return rc;
+}
+
+/* References the parent directory of path, *name points at the last component */
+static int e2fs_obtain_parent(const char *path, struct e2img_inode **dir,
+			      const char **name)
+{
+	int rc;
 	ext2_ino_t ino;
-	struct ext2_inode inode;
-	if ((rc = e2fs_obtain_ino(path, fi, &ino)) < 0)
+	char dpath[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+
+	if (!slash)
+		return -ENOENT;
+	size_t len = slash - path;
+	if (len >= sizeof(dpath))
+		return -ENAMETOOLONG;
+	memcpy(dpath, path, len);
+	dpath[len] = '\0';
+	if ((rc = e2img_path_lookup(&g_img, len ? dpath : "/", &ino)) < 0)
 		return rc;
-	if ((rc = e2img_read_inode(&g_img, ino, &inode)) < 0)
+	*name = slash + 1;
+	return e2img_iget(&g_img, ino, dir);
+}
+
+static int e2fs_mknode(const char *path, mode_t mode, struct e2img_inode **ip)
+{
+	int rc;
+	const char *name;
+	struct e2img_inode *dir;
+	struct fuse_context *ctx = fuse_get_context();
+
+	if (e2fs_is_stats(path))
+		return -EEXIST;
+	if ((rc = e2fs_obtain_parent(path, &dir, &name)) < 0)
 		return rc;
+	rc = e2img_create(&g_img, dir, name, strlen(name), mode, ctx->uid, ctx->gid, ip);
+	e2img_iput(&g_img, dir);
+	return rc;
+}
+
+static int e2fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	int rc;
+	struct e2img_inode *ip;
+
+	e2fs_lock(1);
+	if (!(rc = e2fs_mknode(path, S_IFREG | (mode & 07777), &ip)))
+		fi->fh = (uintptr_t) e2fs_file_new(ip);
+	e2fs_unlock();
+	return rc;
+}
 
-	void *blk = NULL;
-	ext2_off64_t file_sz = EXT2_I_SIZE(&inode);
-	size = min(size, file_sz - offset);
-	for (ext2_off64_t i = offset; i < offset + size; i += g_img.blk_sz) {
-		blk_t blkno;
-		if ((rc = e2img_inode_get_blkno(&g_img, &inode, i / g_img.blk_sz, &blkno)) < 0)
-			goto out;
-		if (blk && (rc = e2img_bcache_release(&g_img, blk)) < 0) {
-			blk = NULL;
-			goto out;
+static int e2fs_mkdir(const char *path, mode_t mode)
+{
+	int rc;
+	struct e2img_inode *ip;
+
+	e2fs_lock(1);
+	if (!(rc = e2fs_mknode(path, S_IFDIR | (mode & 07777), &ip)))
+		e2img_iput(&g_img, ip);
+	e2fs_unlock();
+	return rc;
+}
+
+static int e2fs_remove(const char *path, int is_dir)
+{
+	int rc;
+	const char *name;
+	struct e2img_inode *dir;
+
+	e2fs_lock(1);
+	if ((rc = e2fs_obtain_parent(path, &dir, &name)) < 0)
+		goto out;
+	if (is_dir)
+		rc = e2img_rmdir(&g_img, dir, name, strlen(name));
+	else
+		rc = e2img_unlink(&g_img, dir, name, strlen(name));
+	e2img_iput(&g_img, dir);
+out:
+	e2fs_unlock();
+	return rc;
+}
+
+static int e2fs_unlink(const char *path)
+{
+	return e2fs_remove(path, 0);
+}
+
+static int e2fs_rmdir(const char *path)
+{
+	return e2fs_remove(path, 1);
+}
+
+static int e2fs_write(const char *path, const char *buf, size_t size,
+		      off_t offset, struct fuse_file_info *fi)
+{
+	ssize_t rc;
+	struct e2img_inode *ip;
+	uint64_t t0 = e2fs_op_begin();
+
+	e2fs_lock(1);
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0)
+		goto out;
+	rc = e2img_file_write(&g_img, ip, buf, size, offset);
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+	e2fs_op_end(E2FS_OP_WRITE, t0, rc);
+	return rc;
+}
+
+static int e2fs_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+	int rc;
+	struct e2img_inode *ip;
+
+	e2fs_lock(1);
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0)
+		goto out;
+	rc = e2img_truncate(&g_img, ip, size);
+	e2img_iput(&g_img, ip);
+out:
+	e2fs_unlock();
+	return rc;
+}
+
+/* Attribute changes: the caller edits ip->i, the inode is written back */
+enum e2fs_setattr {
+	E2FS_SET_MODE,
+	E2FS_SET_OWNER,
+	E2FS_SET_TIMES,
+};
+
+struct e2fs_attr {
+	mode_t			mode;
+	uid_t			uid;
+	gid_t			gid;
+	const struct timespec	*tv;
+};
+
+static uint32_t e2fs_time(const struct timespec *ts, uint32_t old, time_t now)
+{
+	if (ts->tv_nsec == UTIME_OMIT)
+		return old;
+	return ts->tv_nsec == UTIME_NOW ? now : ts->tv_sec;
+}
+
+static int e2fs_setattr(const char *path, struct fuse_file_info *fi,
+			enum e2fs_setattr what, struct e2fs_attr const *a)
+{
+	int rc;
+	struct e2img_inode *ip;
+	time_t now = time(NULL);
+
+	e2fs_lock(1);
+	if ((rc = e2fs_obtain_inode(path, fi, &ip)) < 0)
+		goto out;
+	switch (what) {
+	case E2FS_SET_MODE:
+		ip->i.i_mode = (ip->i.i_mode & LINUX_S_IFMT) | (a->mode & 07777);
+		break;
+	case E2FS_SET_OWNER:
+		if (a->uid != (uid_t) -1) {
+			ip->i.i_uid = a->uid;
+			ip->i.osd2.linux2.l_i_uid_high = a->uid >> 16;
 		}
-		if ((rc = e2img_bcache_access(&g_img, blkno, &blk)) < 0)
-			goto out;
-		memcpy(buf, blk, min(g_img.blk_sz, offset + size - i));
+		if (a->gid != (gid_t) -1) {
+			ip->i.i_gid = a->gid;
+			ip->i.osd2.linux2.l_i_gid_high = a->gid >> 16;
+		}
+		break;
+	case E2FS_SET_TIMES:
+		ip->i.i_atime = e2fs_time(&a->tv[0], ip->i.i_atime, now);
+		ip->i.i_mtime = e2fs_time(&a->tv[1], ip->i.i_mtime, now);
+		break;
 	}
+	ip->i.i_ctime = now;
+	rc = e2img_inode_write(&g_img, ip, 0);
+	e2img_iput(&g_img, ip);
 out:
-	if (blk)
-		e2img_bcache_release(&g_img, blk);
-	return rc ? rc : size;
+	e2fs_unlock();
+	return rc;
+}
+
+static int e2fs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	struct e2fs_attr a = { .mode = mode };
+	return e2fs_setattr(path, fi, E2FS_SET_MODE, &a);
+}
+
+static int e2fs_chown(const char *path, uid_t uid, gid_t gid,
+		      struct fuse_file_info *fi)
+{
+	struct e2fs_attr a = { .uid = uid, .gid = gid };
+	return e2fs_setattr(path, fi, E2FS_SET_OWNER, &a);
+}
+
+static int e2fs_utimens(const char *path, const struct timespec tv[2],
+			struct fuse_file_info *fi)
+{
+	struct e2fs_attr a = { .tv = tv };
+	return e2fs_setattr(path, fi, E2FS_SET_TIMES, &a);
+}
+
+/* Whole image sync, allocation of delayed data included */
+static int e2fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	int rc;
+
+	e2fs_lock(1);
+	rc = e2img_sync(&g_img);
+	e2fs_unlock();
+	return rc;
+}
+
+/* Counters only, takes its own lock */
+static int e2fs_statfs(const char *path, struct statvfs *st)
+{
+	e2img_statfs(&g_img, st);
+	return 0;
 }
 
-static const struct fuse_operations hello_oper = {
+static struct fuse_operations hello_oper = {
 	.init		= e2fs_init,
 	.getattr	= e2fs_getattr,
+	.readlink	= e2fs_readlink,
 	.readdir	= e2fs_readdir,
 	.open		= e2fs_open,
 	.opendir	= e2fs_opendir,
 	.read		= e2fs_read,
+	.read_buf	= e2fs_read_buf,
+	.lseek		= e2fs_lseek,
+	.release	= e2fs_release,
+	.releasedir	= e2fs_release,
+	.create		= e2fs_create,
+	.mkdir		= e2fs_mkdir,
+	.unlink		= e2fs_unlink,
+	.rmdir		= e2fs_rmdir,
+	.write		= e2fs_write,
+	.truncate	= e2fs_truncate,
+	.chmod		= e2fs_chmod,
+	.chown		= e2fs_chown,
+	.utimens	= e2fs_utimens,
+	.fsync		= e2fs_fsync,
+	.statfs		= e2fs_statfs,
 };
 
 static void show_help(const char *name)
 {
-	printf("usage: %s --img=<img> <mountpoint>\n", name);
+	printf("usage: %s --img=<img> [--bcache=<MiB>] [--icache=<MiB>] [--dcache=<MiB>]\n"
+	       "\t[--mmap] [--readahead=<KiB>] [--lowlevel] [--entry-timeout=<sec>] [--attr-timeout=<sec>]\n"
+	       "\t[--rw] [--stats-file=<path>] <mountpoint>\n"
+	       "\ttimeouts default to %.0f sec, nothing but this mount may change the image\n"
+	       "\t--rw: writable, ext2 layouts only (no extents, no checksums), not with --lowlevel or --mmap\n"
+	       "\tcounters are in <mountpoint>/" E2FS_STATS_NAME ", on SIGUSR1 they replace the\n"
+	       "\t--stats-file, or go to stderr, which only foreground mode (-f) keeps\n",
+	       name, E2FS_DEFAULT_TIMEOUT);
 }
 
 int main(int argc, char **argv)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	g_options.entry_timeout = E2FS_DEFAULT_TIMEOUT;
+	g_options.attr_timeout = E2FS_DEFAULT_TIMEOUT;
+	g_options.readahead_kb = -1;
 	if (fuse_opt_parse(&args, &g_options, g_option_spec, NULL) == -1)
 		return 1;
 	if (g_options.show_help) {
@@ -205,12 +842,44 @@ int main(int argc, char **argv)
 		fprintf(stderr, "No --img=<img> specified\n");
 		return 1;
 	}
+	g_entry_timeout = g_options.entry_timeout;
+	g_attr_timeout = g_options.attr_timeout;
+
 	int rc;
-	if ((rc = e2img_open(&g_img, g_options.img_path)) < 0) {
+	if (g_options.stats_file && (rc = e2fs_stats_set_file(g_options.stats_file)) < 0) {
+		err_display(-rc, "--stats-file");
+		return 1;
+	}
+	struct e2img_conf conf = e2img_default_conf;
+	if (g_options.bcache_mb)
+		conf.bcache_sz = g_options.bcache_mb << 20;
+	if (g_options.icache_mb)
+		conf.icache_sz = g_options.icache_mb << 20;
+	if (g_options.dcache_mb)
+		conf.dcache_sz = g_options.dcache_mb << 20;
+	if (g_options.mmap)
+		conf.backend = E2IMG_BACKEND_MMAP;
+	if (g_options.readahead_kb != (unsigned long) -1)
+		conf.ra_max_sz = g_options.readahead_kb << 10;
+	if (g_options.rw && g_options.lowlevel) {
+		fprintf(stderr, "--rw is not supported with --lowlevel\n");
+		return 1;
+	}
+	conf.writable = g_options.rw;
+	if ((rc = e2img_open_conf(&g_img, g_options.img_path, &conf)) < 0) {
 		err_display(-rc, "e2img_open");
 		return 1;
 	}
-	int ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	int ret;
+	e2fs_stats_block_signal();
+	if (g_options.lowlevel)
+		ret = e2fs_ll_main(&args);
+	else {
+		/* spliced image ranges could be reallocated before they are sent */
+		if (g_img.writable)
+			hello_oper.read_buf = NULL;
+		ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	}
 	fuse_opt_free_args(&args);
 	if ((rc = e2img_close(&g_img)) < 0) {
 		err_display(-rc, "e2img_close");
@@ -0,0 +1,262 @@
+#define FUSE_USE_VERSION 30
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "e2fs.h"
+
+/*
+ * Per operation counters and latency histograms, bucket b counts calls
+ * that took less than 2^b microseconds (the last one everything slower).
+ * Updated with relaxed atomics from the FUSE worker threads.
+ */
+#define E2FS_LAT_BUCKETS 24
+
+struct e2fs_op_stats {
+	uint64_t	count;
+	uint64_t	errors;
+	uint64_t	ns;
+	uint64_t	hist[E2FS_LAT_BUCKETS];
+} __cacheline_aligned;
+
+static struct e2fs_op_stats g_op_stats[E2FS_OP_NR];
+
+static const char *const g_op_names[E2FS_OP_NR] = {
+	[E2FS_OP_LOOKUP]	= "lookup",
+	[E2FS_OP_GETATTR]	= "getattr",
+	[E2FS_OP_OPEN]		= "open",
+	[E2FS_OP_READ]		= "read",
+	[E2FS_OP_READDIR]	= "readdir",
+	[E2FS_OP_READLINK]	= "readlink",
+	[E2FS_OP_WRITE]		= "write",
+};
+
+/* bytes handed to the kernel by read, spliced straight from the image fd */
+static uint64_t g_served_bytes;
+static uint64_t g_spliced_bytes;
+
+uint64_t e2fs_op_begin(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void e2fs_op_end(enum e2fs_op op, uint64_t t0, long rc)
+{
+	struct e2fs_op_stats *st = &g_op_stats[op];
+	uint64_t ns = e2fs_op_begin() - t0;
+	uint64_t us = ns / 1000;
+	int b = us ? 64 - __builtin_clzll(us) : 0;
+
+	__atomic_add_fetch(&st->count, 1, __ATOMIC_RELAXED);
+	if (rc < 0)
+		__atomic_add_fetch(&st->errors, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->ns, ns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->hist[min(b, E2FS_LAT_BUCKETS - 1)], 1, __ATOMIC_RELAXED);
+}
+
+void e2fs_count_served(size_t bytes, size_t spliced)
+{
+	__atomic_add_fetch(&g_served_bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&g_spliced_bytes, spliced, __ATOMIC_RELAXED);
+}
+
+/* Upper bound in microseconds of the bucket holding the given quantile */
+static uint64_t hist_quantile(uint64_t const *hist, uint64_t count, double q)
+{
+	uint64_t seen = 0, want = count * q;
+	for (int b = 0; b < E2FS_LAT_BUCKETS; ++b) {
+		seen += hist[b];
+		if (seen > want)
+			return (uint64_t) 1 << b;
+	}
+	return (uint64_t) 1 << (E2FS_LAT_BUCKETS - 1);
+}
+
+static double ratio(uint64_t part, uint64_t total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+/* Text snapshot of all counters, the caller frees it */
+char *e2fs_stats_report(size_t *len)
+{
+	char *buf = NULL;
+	FILE *f = open_memstream(&buf, len);
+	release_assert(f);
+
+	fprintf(f, "%-8s %12s %8s %10s %10s %10s\n",
+		"op", "count", "errors", "avg_us", "p50_us", "p99_us");
+	for (int op = 0; op < E2FS_OP_NR; ++op) {
+		struct e2fs_op_stats *st = &g_op_stats[op];
+		uint64_t count = __atomic_load_n(&st->count, __ATOMIC_RELAXED);
+		uint64_t errors = __atomic_load_n(&st->errors, __ATOMIC_RELAXED);
+		uint64_t ns = __atomic_load_n(&st->ns, __ATOMIC_RELAXED);
+		/* buckets are read apart from count, quantiles go by their sum */
+		uint64_t hist[E2FS_LAT_BUCKETS], n = 0;
+		for (int b = 0; b < E2FS_LAT_BUCKETS; ++b)
+			n += hist[b] = __atomic_load_n(&st->hist[b], __ATOMIC_RELAXED);
+		fprintf(f, "%-8s %12lu %8lu %10.1f %10lu %10lu\n", g_op_names[op],
+			count, errors, count ? ns / 1e3 / count : 0.0,
+			n ? hist_quantile(hist, n, 0.5) : 0,
+			n ? hist_quantile(hist, n, 0.99) : 0);
+	}
+
+	fprintf(f, "\nlatency histograms, calls under <us>:\n");
+	for (int op = 0; op < E2FS_OP_NR; ++op) {
+		fprintf(f, "%-8s", g_op_names[op]);
+		for (int b = 0; b < E2FS_LAT_BUCKETS; ++b) {
+			uint64_t c = __atomic_load_n(&g_op_stats[op].hist[b], __ATOMIC_RELAXED);
+			if (c)
+				fprintf(f, " %s%lu:%lu", b == E2FS_LAT_BUCKETS - 1 ? ">=" : "<",
+					(uint64_t) 1 << (b == E2FS_LAT_BUCKETS - 1 ? b - 1 : b), c);
+		}
+		fputc('\n', f);
+	}
+
+	struct e2img_bcache_stats bst;
+	struct e2img_icache_stats ist;
+	struct e2img_dcache_stats dst;
+	struct e2img_io_stats io;
+	e2img_bcache_get_stats(&g_img, &bst);
+	e2img_icache_get_stats(&g_img, &ist);
+	e2img_dcache_get_stats(&g_img, &dst);
+	e2img_io_get_stats(&g_img, &io);
+
+	fprintf(f, "\nbcache: hits %lu misses %lu evictions %lu uncached %lu hit %.1f%%\n",
+		bst.hits, bst.misses, bst.evictions, bst.uncached,
+		ratio(bst.hits, bst.hits + bst.misses));
+	fprintf(f, "icache: hits %lu misses %lu evictions %lu hit %.1f%%\n",
+		ist.hits, ist.misses, ist.evictions,
+		ratio(ist.hits, ist.hits + ist.misses));
+	fprintf(f, "dcache: hits %lu neg_hits %lu misses %lu evictions %lu hit %.1f%%\n",
+		dst.hits, dst.neg_hits, dst.misses, dst.evictions,
+		ratio(dst.hits + dst.neg_hits, dst.hits + dst.neg_hits + dst.misses));
+
+	uint64_t served = __atomic_load_n(&g_served_bytes, __ATOMIC_RELAXED);
+	uint64_t spliced = __atomic_load_n(&g_spliced_bytes, __ATOMIC_RELAXED);
+	fprintf(f, "image: reads %lu read_bytes %lu spliced_bytes %lu writes %lu write_bytes %lu\n",
+		io.reads, io.read_bytes, spliced, io.writes, io.write_bytes);
+	fprintf(f, "served: read_bytes %lu, %.2f image bytes per byte served\n",
+		served, served ? (double) (io.read_bytes + spliced) / served : 0.0);
+
+	fclose(f);
+	return buf;
+}
+
+void e2fs_stats_fill_stat(struct stat *stbuf)
+{
+	memset(stbuf, 0, sizeof(*stbuf));
+	stbuf->st_ino   = E2FS_STATS_INO;
+	stbuf->st_mode  = S_IFREG | 0444;
+	stbuf->st_nlink = 1;
+	stbuf->st_mtime = time(NULL);
+}
+
+/* The text is fixed at open, reads see one consistent snapshot */
+struct e2fs_file *e2fs_stats_open(void)
+{
+	struct e2fs_file *f = xmalloc(sizeof(*f));
+	f->ip = NULL;
+	e2img_ra_init(&f->ra);
+	f->snap = e2fs_stats_report(&f->snap_len);
+	return f;
+}
+
+size_t e2fs_stats_read(struct e2fs_file *f, char *buf, size_t size, off_t off)
+{
+	if (off < 0 || (size_t) off >= f->snap_len)
+		return 0;
+	size = min(size, f->snap_len - off);
+	memcpy(buf, f->snap + off, size);
+	return size;
+}
+
+static sigset_t g_report_sigs;
+static char *g_report_path;
+
+/*
+ * SIGUSR1 reports replace path instead of going to stderr, which is
+ * /dev/null once daemonized. Relative paths are taken from the current
+ * directory now, the daemon runs in /.
+ */
+int e2fs_stats_set_file(const char *path)
+{
+	if (path[0] == '/') {
+		g_report_path = strdup(path);
+	} else {
+		char *cwd = getcwd(NULL, 0);
+		if (!cwd)
+			return -errno;
+		g_report_path = xmalloc(strlen(cwd) + strlen(path) + 2);
+		sprintf(g_report_path, "%s/%s", cwd, path);
+		free(cwd);
+	}
+	return g_report_path ? 0 : -ENOMEM;
+}
+
+/* Written aside and renamed, readers never see a partial report */
+static void e2fs_stats_write_file(const char *rep, size_t len)
+{
+	int fd;
+	char *tmp = xmalloc(strlen(g_report_path) + 5);
+	sprintf(tmp, "%s.tmp", g_report_path);
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		goto out;
+	ssize_t rc = write(fd, rep, len);
+	if (close(fd) < 0 || rc != (ssize_t) len) {
+		unlink(tmp);
+		goto out;
+	}
+	if (rename(tmp, g_report_path) < 0)
+		unlink(tmp);
+out:
+	free(tmp);
+}
+
+/* FUSE threads are started later and inherit the mask */
+void e2fs_stats_block_signal(void)
+{
+	sigemptyset(&g_report_sigs);
+	sigaddset(&g_report_sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &g_report_sigs, NULL);
+}
+
+static void *e2fs_stats_signal_thread(void *arg)
+{
+	for (;;) {
+		int sig;
+		size_t len;
+		if (sigwait(&g_report_sigs, &sig))
+			continue;
+		char *rep = e2fs_stats_report(&len);
+		if (g_report_path) {
+			e2fs_stats_write_file(rep, len);
+		} else {
+			fwrite(rep, 1, len, stderr);
+			fflush(stderr);
+		}
+		free(rep);
+	}
+	return NULL;
+}
+
+/* Called once daemonized, a fork would not keep the thread */
+void e2fs_stats_start_signal_thread(void)
+{
+	pthread_t tid;
+	if (pthread_create(&tid, NULL, e2fs_stats_signal_thread, NULL) == 0)
+		pthread_detach(tid);
+	else
+		fprintf(stderr, "stats: no SIGUSR1 reporter thread\n");
+}